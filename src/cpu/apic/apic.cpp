@@ -73,6 +73,17 @@ void LAPIC::sendEOI() {
     write(LAPIC_EOI, 0);
 }
 
+void LAPIC::sendIPI(uint32_t lapicId, uint8_t vector) {
+    if (!initialized) return;
+    
+    write(LAPIC_ICR_HIGH, lapicId << 24);
+    write(LAPIC_ICR_LOW, vector);
+    
+    while (read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
 uint32_t LAPIC::getId() {
     if (!initialized) return 0;
     return read(LAPIC_ID) >> 24;
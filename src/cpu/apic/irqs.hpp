@@ -18,4 +18,6 @@ static constexpr uint8_t VECTOR_TIMER = VECTOR_BASE + IRQ_TIMER;
 static constexpr uint8_t VECTOR_KEYBOARD = VECTOR_BASE + IRQ_KEYBOARD;
 static constexpr uint8_t VECTOR_RTC = VECTOR_BASE + IRQ_RTC;
 static constexpr uint8_t VECTOR_MOUSE = VECTOR_BASE + IRQ_MOUSE;
+static constexpr uint8_t VECTOR_TLB_SHOOTDOWN = 0xF0;
+static constexpr uint8_t VECTOR_RESCHEDULE = 0xF1;
 static constexpr uint8_t VECTOR_SPURIOUS = 0xFF;
@@ -5,10 +5,17 @@
 static constexpr uint32_t LAPIC_ID = 0x20;
 static constexpr uint32_t LAPIC_EOI = 0xB0;
 static constexpr uint32_t LAPIC_SPURIOUS = 0xF0;
+static constexpr uint32_t LAPIC_ICR_LOW = 0x300;
+static constexpr uint32_t LAPIC_ICR_HIGH = 0x310;
+static constexpr uint32_t LAPIC_ICR_PENDING = 1 << 12;
 static constexpr uint32_t LAPIC_TIMER = 0x320;
 static constexpr uint32_t LAPIC_TIMER_INITCNT = 0x380;
 static constexpr uint32_t LAPIC_TIMER_CURCNT = 0x390;
 static constexpr uint32_t LAPIC_TIMER_DIV = 0x3E0;
+static constexpr uint32_t LAPIC_TIMER_MASKED = 1 << 16;
+static constexpr uint32_t LAPIC_TIMER_PERIODIC = 1 << 17;
+static constexpr uint32_t LAPIC_TIMER_TSC_DEADLINE = 1 << 18;
+static constexpr uint32_t MSR_TSC_DEADLINE = 0x6E0;
 
 class LAPIC {
 public:
@@ -17,6 +24,7 @@ public:
     bool initialize();
     void enable();
     void sendEOI();
+    void sendIPI(uint32_t lapicId, uint8_t vector);
     
     uint32_t getId();
     void setTimerDivide(uint8_t divide);
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+
+// Links an AVLTree keeps inside each of its elements.
+template <typename T>
+struct AVLNode {
+    T* left;
+    T* right;
+    int height;
+};
+
+// Intrusive AVL tree over elements that embed an AVLNode, used by the VMA
+// tree and the fair run queues. Traits tells where the links are and what
+// the tree is ordered by:
+//
+//     static AVLNode<T>* node(T* element);
+//     static uint64_t key(T* element);
+//
+// The functions work on a root pointer and return the new root. Equal keys
+// go right, so elements with the same key keep the order they were inserted
+// in. Not locked, the owner of the root is.
+template <typename T, typename Traits>
+class AVLTree {
+public:
+    static T* left(T* element) { return Traits::node(element)->left; }
+    static T* right(T* element) { return Traits::node(element)->right; }
+
+    static T* first(T* root) {
+        while (root && left(root)) root = left(root);
+        return root;
+    }
+
+    static T* insert(T* root, T* element) {
+        if (!root) {
+            AVLNode<T>* node = Traits::node(element);
+            node->left = nullptr;
+            node->right = nullptr;
+            node->height = 1;
+            return element;
+        }
+
+        AVLNode<T>* node = Traits::node(root);
+        if (Traits::key(element) < Traits::key(root)) {
+            node->left = insert(node->left, element);
+        } else {
+            node->right = insert(node->right, element);
+        }
+        return balance(root);
+    }
+
+    static T* removeMin(T* root, T** min) {
+        AVLNode<T>* node = Traits::node(root);
+        if (!node->left) {
+            *min = root;
+            return node->right;
+        }
+
+        node->left = removeMin(node->left, min);
+        return balance(root);
+    }
+
+    // Takes out element itself rather than any element with its key.
+    static T* remove(T* root, T* element, bool* found = nullptr) {
+        bool removed = false;
+        root = removeNode(root, element, &removed);
+        if (found) *found = removed;
+        return root;
+    }
+
+private:
+    static int height(T* element) { return element ? Traits::node(element)->height : 0; }
+
+    static void updateHeight(T* element) {
+        AVLNode<T>* node = Traits::node(element);
+        int l = height(node->left);
+        int r = height(node->right);
+        node->height = 1 + (l > r ? l : r);
+    }
+
+    static T* rotateLeft(T* element) {
+        T* pivot = right(element);
+        Traits::node(element)->right = left(pivot);
+        Traits::node(pivot)->left = element;
+        updateHeight(element);
+        updateHeight(pivot);
+        return pivot;
+    }
+
+    static T* rotateRight(T* element) {
+        T* pivot = left(element);
+        Traits::node(element)->left = right(pivot);
+        Traits::node(pivot)->right = element;
+        updateHeight(element);
+        updateHeight(pivot);
+        return pivot;
+    }
+
+    static T* balance(T* element) {
+        updateHeight(element);
+        AVLNode<T>* node = Traits::node(element);
+        int factor = height(node->left) - height(node->right);
+
+        if (factor > 1) {
+            if (height(left(node->left)) < height(right(node->left))) {
+                node->left = rotateLeft(node->left);
+            }
+            return rotateRight(element);
+        }
+
+        if (factor < -1) {
+            if (height(right(node->right)) < height(left(node->right))) {
+                node->right = rotateRight(node->right);
+            }
+            return rotateLeft(element);
+        }
+
+        return element;
+    }
+
+    // Rotations can leave equal keys on either side of an element, so both
+    // sides are searched for those.
+    static T* removeNode(T* root, T* element, bool* found) {
+        if (!root) return nullptr;
+
+        AVLNode<T>* node = Traits::node(root);
+        if (root == element) {
+            *found = true;
+            if (!node->left) return node->right;
+            if (!node->right) return node->left;
+
+            T* successor = nullptr;
+            T* rest = removeMin(node->right, &successor);
+            Traits::node(successor)->left = node->left;
+            Traits::node(successor)->right = rest;
+            return balance(successor);
+        }
+
+        uint64_t key = Traits::key(element);
+        uint64_t rootKey = Traits::key(root);
+        if (key < rootKey) {
+            node->left = removeNode(node->left, element, found);
+        } else if (key > rootKey) {
+            node->right = removeNode(node->right, element, found);
+        } else {
+            node->left = removeNode(node->left, element, found);
+            if (!*found) node->right = removeNode(node->right, element, found);
+        }
+
+        return *found ? balance(root) : root;
+    }
+};
@@ -37,3 +37,41 @@ void Cereal::write(const char* str) {
         write(*str++);
     }
 }
+
+void Cereal::writeNumber(uint64_t value) {
+    char buffer[21];
+    int pos = 20;
+    buffer[pos] = '\0';
+
+    do {
+        buffer[--pos] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    write(&buffer[pos]);
+}
+
+void Cereal::writeField(const char* name, uint64_t value) {
+    write("  ");
+    write(name);
+    write(": ");
+    writeNumber(value);
+    write("\n");
+}
+
+void Cereal::writeHistogram(const uint64_t* buckets, size_t count, uint64_t shift) {
+    for (size_t i = 0; i < count; i++) {
+        if (!buckets[i]) continue;
+
+        if (i == count - 1) {
+            write("  >= 2^");
+            writeNumber(i + shift - 1);
+        } else {
+            write("  < 2^");
+            writeNumber(i + shift);
+        }
+        write(" cycles: ");
+        writeNumber(buckets[i]);
+        write("\n");
+    }
+}
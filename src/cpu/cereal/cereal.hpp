@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 
 class Cereal {
 public:
@@ -9,6 +10,14 @@ public:
     void initialize();
     void write(char c);
     void write(const char* str);
+
+    // Formatting shared by the statistics dumps.
+    void writeNumber(uint64_t value);
+    // "  name: value" on a line of its own.
+    void writeField(const char* name, uint64_t value);
+    // One line per non-empty bucket of a log2 cycle histogram whose first
+    // bucket holds everything below 2^shift and whose last is open ended.
+    void writeHistogram(const uint64_t* buckets, size_t count, uint64_t shift);
     
 private:
     Cereal() : initialized(false) {}
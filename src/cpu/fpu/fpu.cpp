@@ -0,0 +1,221 @@
+#include "fpu.hpp"
+#include <cpu/process/thread.hpp>
+#include <cpu/smp/smp.hpp>
+#include <cpu/mm/pmm.hpp>
+#include <x86_64/ports.hpp>
+#include <x86_64/requests.hpp>
+#include <string.h>
+
+FPU& FPU::get() {
+    static FPU instance;
+    return instance;
+}
+
+void FPU::initialize() {
+    uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    bool hasXSave = ecx & (1 << 26);
+
+    if (hasXSave) {
+        eax = 0x0D; ecx = 0;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        uint64_t supported = (static_cast<uint64_t>(edx) << 32) | eax;
+
+        features = supported & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_AVX512);
+        if ((features & XFEATURE_AVX512) != XFEATURE_AVX512 || !(features & XFEATURE_AVX)) {
+            features &= ~XFEATURE_AVX512;
+        }
+
+        eax = 0x0D; ecx = 1;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        if (eax & (1 << 3)) {
+            mode = FPUMode::XSaves;
+        } else if (eax & (1 << 0)) {
+            mode = FPUMode::XSaveOpt;
+        } else {
+            mode = FPUMode::XSave;
+        }
+    }
+
+    initializeCPU();
+
+    // The sizes reported depend on the XCR0 just loaded.
+    if (mode != FPUMode::FXSave) {
+        eax = 0x0D; ecx = (mode == FPUMode::XSaves) ? 1 : 0;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        size = ebx;
+    }
+
+    // Every thread starts from the same image: default control words and
+    // an XSAVE header saying all components are in their init state.
+    void* phys = pmm.allocatePages(statePages());
+    if (!phys) return;
+
+    uint8_t* image = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset);
+    memset(image, 0, statePages() * PAGE_SIZE);
+    *reinterpret_cast<uint16_t*>(image) = 0x037F;            // FCW
+    *reinterpret_cast<uint32_t*>(image + 24) = 0x1F80;       // MXCSR
+    if (mode == FPUMode::XSaves) {
+        *reinterpret_cast<uint64_t*>(image + 520) = (1ULL << 63) | features;  // XCOMP_BV
+    }
+    initState = reinterpret_cast<FPUState*>(image);
+}
+
+void FPU::initializeCPU() {
+    if (mode != FPUMode::FXSave) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_OSXSAVE));
+
+        asm volatile("xsetbv" :: "c"(0), "a"(static_cast<uint32_t>(features)), "d"(static_cast<uint32_t>(features >> 32)));
+        if (mode == FPUMode::XSaves) {
+            wrmsr(MSR_XSS, 0);
+        }
+    }
+
+    setTS(true);
+}
+
+size_t FPU::statePages() const {
+    return (size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+FPUState* FPU::allocateState() {
+    FPUState* state = nullptr;
+
+    poolLock.lock();
+    if (cached) {
+        state = reinterpret_cast<FPUState*>(cached);
+        cached = cached->next;
+        cachedCount--;
+    }
+    poolLock.unlock();
+
+    if (!state) {
+        void* phys = pmm.allocatePages(statePages());
+        if (!phys) return nullptr;
+        state = reinterpret_cast<FPUState*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset);
+    }
+
+    if (initState) {
+        memcpy(state, initState, size);
+    }
+    return state;
+}
+
+void FPU::freeState(FPUState* state) {
+    if (!state) return;
+
+    poolLock.lock();
+    if (cachedCount < MAX_CACHED_STATES) {
+        FreeState* entry = reinterpret_cast<FreeState*>(state);
+        entry->next = cached;
+        cached = entry;
+        cachedCount++;
+        poolLock.unlock();
+        return;
+    }
+    poolLock.unlock();
+
+    void* phys = reinterpret_cast<void*>(reinterpret_cast<uint64_t>(state) - hhdm_request.response->offset);
+    pmm.freePages(phys, statePages());
+}
+
+void FPU::save(FPUState* state) {
+    uint32_t low = static_cast<uint32_t>(features);
+    uint32_t high = static_cast<uint32_t>(features >> 32);
+
+    switch (mode) {
+        case FPUMode::XSaves:
+            asm volatile("xsaves64 (%0)" :: "r"(state), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUMode::XSaveOpt:
+            asm volatile("xsaveopt64 (%0)" :: "r"(state), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUMode::XSave:
+            asm volatile("xsave64 (%0)" :: "r"(state), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUMode::FXSave:
+            asm volatile("fxsave64 (%0)" :: "r"(state) : "memory");
+            break;
+    }
+}
+
+void FPU::restore(FPUState* state) {
+    uint32_t low = static_cast<uint32_t>(features);
+    uint32_t high = static_cast<uint32_t>(features >> 32);
+
+    switch (mode) {
+        case FPUMode::XSaves:
+            asm volatile("xrstors64 (%0)" :: "r"(state), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUMode::XSaveOpt:
+        case FPUMode::XSave:
+            asm volatile("xrstor64 (%0)" :: "r"(state), "a"(low), "d"(high) : "memory");
+            break;
+        case FPUMode::FXSave:
+            asm volatile("fxrstor64 (%0)" :: "r"(state) : "memory");
+            break;
+    }
+}
+
+uint64_t FPU::readCR0() {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+// CR0 writes serialize, so TS is only touched when it actually changes.
+void FPU::setTS(bool set) {
+    uint64_t cr0 = readCR0();
+    if (set && !(cr0 & CR0_TS)) {
+        asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS) : "memory");
+    } else if (!set && (cr0 & CR0_TS)) {
+        asm volatile("clts" ::: "memory");
+    }
+}
+
+void FPU::switchTo(CPUData* cpu, Thread* prev, Thread* next) {
+    // TS clear means prev owns the registers and used them this slice.
+    if (prev && prev == cpu->fpuOwner && !(readCR0() & CR0_TS) && prev->getFPUState()) {
+        save(prev->getFPUState());
+    }
+
+    // The registers still hold next's state if nobody else loaded theirs
+    // here since next last did.
+    setTS(!(next == cpu->fpuOwner && next->getFPUCPU() == static_cast<int>(cpu->id)));
+}
+
+bool FPU::handleTrap() {
+    CPUData* cpu = thisCPU();
+    Thread* current = cpu->current;
+    if (!current) return false;
+
+    setTS(false);
+
+    // First SIMD use of the thread, its state only exists from here on.
+    if (!current->getFPUState()) {
+        FPUState* state = allocateState();
+        if (!state) {
+            setTS(true);
+            return false;
+        }
+        current->setFPUState(state);
+    }
+
+    restore(current->getFPUState());
+    cpu->fpuOwner = current;
+    current->setFPUCPU(cpu->id);
+    return true;
+}
+
+void FPU::release(Thread* thread) {
+    SMP& smp = SMP::get();
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* cpu = smp.getCPU(i);
+        if (!cpu) continue;
+
+        Thread* expected = thread;
+        __atomic_compare_exchange_n(&cpu->fpuOwner, &expected, nullptr, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
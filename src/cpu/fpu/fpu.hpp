@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cpu/smp/spinlock.hpp>
+
+struct CPUData;
+class Thread;
+struct FPUState;
+
+constexpr uint64_t CR0_TS = 1 << 3;
+constexpr uint64_t CR4_OSXSAVE = 1 << 18;
+constexpr uint32_t MSR_XSS = 0xDA0;
+
+constexpr uint64_t XFEATURE_X87 = 1 << 0;
+constexpr uint64_t XFEATURE_SSE = 1 << 1;
+constexpr uint64_t XFEATURE_AVX = 1 << 2;
+constexpr uint64_t XFEATURE_AVX512 = (1 << 5) | (1 << 6) | (1 << 7);
+
+// Best save instruction the CPU has. XSAVEOPT and XSAVES skip components
+// that are unmodified since the last restore or still in their init state.
+enum class FPUMode {
+    FXSave,
+    XSave,
+    XSaveOpt,
+    XSaves
+};
+
+// User SIMD state is switched lazily. CR0.TS is set whenever a thread
+// runs on a CPU whose registers do not hold its state, and the first SIMD
+// instruction traps (#NM) to load it. A thread that used SIMD during its
+// slice is saved when it is switched out, so it can resume on any CPU.
+class FPU {
+public:
+    static FPU& get();
+
+    void initialize();
+    void initializeCPU();
+
+    FPUMode getMode() const { return mode; }
+    uint64_t getFeatures() const { return features; }
+    size_t getSize() const { return size; }
+
+    // Freed areas are kept for the next thread, up to MAX_CACHED_STATES.
+    FPUState* allocateState();
+    void freeState(FPUState* state);
+
+    void switchTo(CPUData* cpu, Thread* prev, Thread* next);
+    bool handleTrap();
+
+    // Forgets a dead thread on every CPU whose registers it still owns.
+    void release(Thread* thread);
+
+private:
+    FPU() : mode(FPUMode::FXSave), features(XFEATURE_X87 | XFEATURE_SSE), size(512), initState(nullptr), cached(nullptr), cachedCount(0) {}
+
+    static constexpr size_t MAX_CACHED_STATES = 64;
+
+    struct FreeState {
+        FreeState* next;
+    };
+
+    FPUMode mode;
+    uint64_t features;   // XCR0
+    size_t size;
+    FPUState* initState;
+
+    Spinlock poolLock;
+    FreeState* cached;
+    size_t cachedCount;
+
+    void save(FPUState* state);
+    void restore(FPUState* state);
+    size_t statePages() const;
+
+    static uint64_t readCR0();
+    static void setTS(bool set);
+};
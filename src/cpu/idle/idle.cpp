@@ -0,0 +1,81 @@
+#include "idle.hpp"
+#include <cpu/smp/cpu.hpp>
+#include <cpu/smp/preempt.hpp>
+#include <interrupts/timer.hpp>
+#include <x86_64/ports.hpp>
+
+extern Timer* globalTimer;
+
+CPUIdle& CPUIdle::get() {
+    static CPUIdle instance;
+    return instance;
+}
+
+void CPUIdle::initialize() {
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    uint32_t maxLeaf = eax;
+
+    eax = 1; ecx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1 << 3)) || maxLeaf < 5) return;
+
+    mode = IdleMode::MWait;
+
+    // EDX of leaf 5 has the number of MWAIT sub-states of C0 to C7 in
+    // consecutive nibbles; take the deepest C-state that has any.
+    eax = 5; ecx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    uint32_t substates = edx;
+
+    // Without an always running APIC timer the deeper states stop the
+    // one-shot timer, and sleeping threads would miss their wakeups.
+    bool arat = false;
+    if (maxLeaf >= 6) {
+        eax = 6; ecx = 0;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        arat = eax & (1 << 2);
+    }
+    int deepest = arat ? 7 : 1;
+
+    for (int state = deepest; state >= 1; state--) {
+        uint32_t count = (substates >> (state * 4)) & 0xF;
+        if (count) {
+            hint = ((state - 1) << 4) | (count - 1);
+            break;
+        }
+    }
+}
+
+// Preemption stays off so the interrupt that ends the sleep cannot switch
+// away in the middle; the idle task reschedules right after anyway.
+void CPUIdle::enter(CPUData* cpu) {
+    preemptDisable();
+    uint64_t start = globalTimer ? globalTimer->now() : 0;
+
+    // STI only takes effect after the next instruction, so no interrupt
+    // can slip in between the last check and the CPU going to sleep.
+    asm volatile("cli");
+    if (mode == IdleMode::MWait) {
+        // Whoever sets needResched after this store sees polling and
+        // relies on the monitor instead of an IPI.
+        __atomic_store_n(&cpu->polling, true, __ATOMIC_SEQ_CST);
+        asm volatile("monitor" :: "a"(&cpu->needResched), "c"(0), "d"(0));
+        if (!__atomic_load_n(&cpu->needResched, __ATOMIC_SEQ_CST)) {
+            asm volatile("sti; mwait" :: "a"(hint), "c"(0));
+        } else {
+            asm volatile("sti");
+        }
+        __atomic_store_n(&cpu->polling, false, __ATOMIC_SEQ_CST);
+    } else if (!cpu->needResched) {
+        asm volatile("sti; hlt");
+    } else {
+        asm volatile("sti");
+    }
+
+    if (globalTimer) {
+        cpu->idleTime += globalTimer->now() - start;
+    }
+    cpu->idleEntries++;
+    preemptEnable();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+struct CPUData;
+
+// How the idle task waits for work. HLT stops the CPU until the next
+// interrupt. MWAIT can also be woken by a store to the CPU's needResched
+// flag, so other CPUs skip the reschedule IPI, and takes a hint for the
+// C-state to enter.
+enum class IdleMode {
+    Halt,
+    MWait
+};
+
+class CPUIdle {
+public:
+    static CPUIdle& get();
+
+    // Run on the BSP once, every CPU uses what it finds.
+    void initialize();
+
+    IdleMode getMode() const { return mode; }
+    uint32_t getHint() const { return hint; }
+
+    // Sleeps until an interrupt or a reschedule and adds the time slept to
+    // the CPU's idle residency. Called by the idle task only.
+    void enter(CPUData* cpu);
+
+private:
+    CPUIdle() : mode(IdleMode::Halt), hint(0) {}
+
+    IdleMode mode;
+    uint32_t hint;       // MWAIT EAX: C-state - 1 in bits 7:4, sub-state in 3:0
+};
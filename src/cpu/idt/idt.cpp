@@ -26,6 +26,11 @@ IDT::IDT(){
     
     setEntry(0x80, (uint64_t)&syscallEntry, 0x08, 0, 0xEE);
 
+    load();
+}
+
+// Every CPU shares the one table.
+void IDT::load() {
     asm volatile("lidt %0" : : "m"(idtp));
 }
 
@@ -25,5 +25,6 @@ private:
 public:
     IDT();
 
+    void load();
     void setEntry(uint8_t target, uint64_t offset, uint16_t selector, uint8_t ist, uint8_t typeAttributes);
 };
\ No newline at end of file
@@ -29,7 +29,17 @@ extern irqHandler
     pop rbx      
 %endmacro
 
+; Entries from user mode swap in the per-CPU GS base, CS sits above the
+; vector and error code.
+%macro swapgsIfUser 0
+    test qword [rsp + 24], 3
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
+
 handleISR:
+    swapgsIfUser
     pushad
     
     mov rdi, rsp
@@ -44,6 +54,7 @@ handleISR:
     mov rsp, rbp
     
     popad
+    swapgsIfUser
     add rsp, 16
     iretq
 
@@ -94,6 +105,7 @@ isrYErr 30
 isrNErr 31
 
 handleIRQ:
+    swapgsIfUser
     pushad
     
     mov rdi, rsp
@@ -108,6 +120,7 @@ handleIRQ:
     mov rsp, rbp
     
     popad
+    swapgsIfUser
     add rsp, 16
     iretq
 
@@ -3,6 +3,7 @@
 #include <limine.h>
 #include <graphics/console.hpp>
 #include <cpu/process/scheduler.hpp>
+#include <cpu/fpu/fpu.hpp>
 
 Interrupt *interruptHandlers[256] = {nullptr};
 void _bsod();
@@ -21,12 +22,29 @@ extern "C" void exceptionHandler(InterruptFrame* frame) {
         "Hypervisor Injection", "VMM Communication", "Security", "Reserved"
     };
 
-    if (frame->cs == 0x1B) {
+    // First SIMD instruction since the switch, load the process's state
+    if (frame->interrupt == 0x07 && FPU::get().handleTrap()) {
+        return;
+    }
+
+    if (frame->interrupt == 0x0E) {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        
+        // Lazily populated user mappings, also hit by syscalls touching user buffers
         Process* current = Scheduler::get().getCurrentProcess();
+        if (current && cr2 < USER_SPACE_END && current->getVMAs()->handleFault(cr2, frame->errCode)) {
+            return;
+        }
+    }
+
+    if (frame->cs == 0x1B) {
+        // The faulting thread takes the signal, whatever the others block.
+        Thread* current = Scheduler::get().getCurrentThread();
         
         if (console && current) {
             console->drawText("Process ");
-            console->drawNumber(current->getPID());
+            console->drawNumber(current->getProcess()->getPID());
             console->drawText(" crashed.\n");
             const char* exception_name = (frame->interrupt < 32) ? exception_names[frame->interrupt] : "Unknown Exception";
             console->drawText(exception_name);
@@ -42,11 +60,7 @@ extern "C" void exceptionHandler(InterruptFrame* frame) {
                 current->sendSignal(SIGTERM);
             }
             
-            current->handlePendingSignals();
-            
-            if (current->getState() == ProcessState::Terminated) {
-                Scheduler::get().schedule(frame);
-            }
+            Scheduler::get().returnToUser();
         }
         return;
     }
@@ -102,4 +116,12 @@ extern "C" void irqHandler(InterruptFrame* frame) {
     } else {
         LAPIC::get().sendEOI();
     }
+    
+    // Kernel code is preempted too, unless it had interrupts off; the frame
+    // and switchContext between them hold its whole state.
+    if (frame->cs & 3) {
+        Scheduler::get().returnToUser();
+    } else if (frame->rflags & 0x200) {
+        Scheduler::get().preempt();
+    }
 }
\ No newline at end of file
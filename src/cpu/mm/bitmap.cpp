@@ -66,6 +66,28 @@ size_t Bitmap::findFirstFreeRegion(size_t count) const {
     return bmpSize;
 }
     
+size_t Bitmap::findFirstFreeAlignedRegion(size_t count, size_t alignment) const {
+    if (count == 0 || alignment == 0) return bmpSize;
+
+    size_t start = 0;
+    while (start + count <= bmpSize) {
+        size_t used = bmpSize;
+        for (size_t i = 0; i < count; i++) {
+            if (get(start + i)) {
+                used = start + i;
+                break;
+            }
+        }
+
+        if (used == bmpSize) return start;
+
+        // Nothing before the used bit can start a region, skip past it.
+        start = (used / alignment + 1) * alignment;
+    }
+
+    return bmpSize;
+}
+    
 bool Bitmap::setRange(size_t start, size_t count) {
     for (size_t i = 0; i < count; i++) {
         if (!set(start + i)) return false;
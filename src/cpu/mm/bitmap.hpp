@@ -16,6 +16,7 @@ public:
     
     size_t findFirstFree() const;
     size_t findFirstFreeRegion(size_t count) const;
+    size_t findFirstFreeAlignedRegion(size_t count, size_t alignment) const;
     
     bool setRange(size_t start, size_t count);
     bool clearRange(size_t start, size_t count);
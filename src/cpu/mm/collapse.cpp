@@ -0,0 +1,29 @@
+#include "collapse.hpp"
+#include <cpu/process/scheduler.hpp>
+
+HugePageCollapser& HugePageCollapser::get() {
+    static HugePageCollapser instance;
+    return instance;
+}
+
+HugePageCollapser::HugePageCollapser() {
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        requests[i].work = {run, &requests[i], nullptr, false};
+        requests[i].pid = 0;
+    }
+}
+
+void HugePageCollapser::request(uint32_t cpu, uint32_t pid) {
+    if (cpu >= MAX_CPUS) return;
+
+    __atomic_store_n(&requests[cpu].pid, pid, __ATOMIC_RELAXED);
+    WorkQueue::get().queueOn(cpu, &requests[cpu].work);
+}
+
+// The process is found again by PID, it may have exited since.
+void HugePageCollapser::run(Work* work) {
+    Request* request = static_cast<Request*>(work->data);
+    ThreadRef ref = Scheduler::get().lookup(__atomic_load_n(&request->pid, __ATOMIC_RELAXED));
+    Process* process = ref.process();
+    if (process) process->getVMAs()->collapse(1);
+}
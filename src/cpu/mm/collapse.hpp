@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cpu/smp/cpu.hpp>
+#include <cpu/process/workqueue.hpp>
+#include <cstdint>
+
+// Merges fully populated small-page ranges into huge pages in the
+// background. The timer names the process it interrupted in user mode and
+// a worker on the same CPU does the copying, outside the interrupt.
+class HugePageCollapser {
+public:
+    static HugePageCollapser& get();
+
+    // Safe from interrupt handlers. A request still waiting for its worker
+    // is retargeted instead of queued twice.
+    void request(uint32_t cpu, uint32_t pid);
+
+private:
+    HugePageCollapser();
+
+    struct Request {
+        Work work;
+        uint32_t pid;
+    };
+
+    Request requests[MAX_CPUS];
+
+    static void run(Work* work);
+};
@@ -78,6 +78,7 @@ void* Heap::allocate(size_t size) {
     if (!initialized || size == 0) return nullptr;
 
     size = alignSize(size);
+    LockGuard guard(lock);
 
     HeapBlock* block = findFreeBlock(size);
 
@@ -117,6 +118,7 @@ void* Heap::allocateAligned(size_t size, size_t alignment) {
 void Heap::free(void* ptr) {
     if (!initialized || !ptr) return;
     
+    LockGuard guard(lock);
     HeapBlock* block = HeapBlock::fromData(ptr);
     
     if (!block->isValid() || block->free) {
@@ -53,6 +53,7 @@ private:
     void* startLocation;
     void* endLocation;
     HeapBlock* firstBlock;
+    Spinlock lock;
     bool initialized;
     size_t totalSize;
     size_t usedSize;
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// Windows the kernel maps at fixed addresses in the higher half. Each has
+// a PML4 slot (512 GiB) of its own, so no window can grow into another.
+// Limine places the HHDM at the bottom of the higher half and the kernel
+// image in the top 2 GiB.
+constexpr uint64_t KERNEL_SPACE_BASE = 0xFFFF800000000000;
+constexpr uint64_t KERNEL_HEAP_BASE = 0xFFFF900000000000;
+constexpr uint64_t FRAMEBUFFER_BASE = 0xFFFFA00000000000;
+constexpr uint64_t KERNEL_STACK_BASE = 0xFFFFA08000000000;
+
+constexpr uint64_t KERNEL_WINDOW_SIZE = 0x0000008000000000;
@@ -12,6 +12,8 @@ MemoryManager::MemoryManager(){
         return;
     }
     
+    VMM::initPAT();
+    
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
         
@@ -40,6 +42,8 @@ MemoryManager::MemoryManager(){
         }
     }
     
+    pmm.initRefCounts();
+    
     PageTable* pageTable = VMM::getCurrentPageTable();
     vmm.init(pageTable);
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
@@ -54,9 +58,14 @@ MemoryManager::MemoryManager(){
 
             pmm.reservePages(reinterpret_cast<void*>(base), page_count);
 
+            uint64_t flags = PTE_PRESENT | PTE_WRITABLE;
+            if (entry->type == LIMINE_MEMMAP_FRAMEBUFFER) {
+                flags |= PTE_WRITE_COMBINING;
+            }
+
             for (size_t j = 0; j < page_count; j++) {
                 void* addr = reinterpret_cast<void*>(base + j * PAGE_SIZE);
-                vmm.map(addr, addr, PTE_PRESENT | PTE_WRITABLE);
+                vmm.map(addr, addr, flags);
             }
         }
     }
@@ -68,7 +77,7 @@ MemoryManager::MemoryManager(){
         return;
     }
     
-    void* virt = reinterpret_cast<void*>(KERNEL_HEAP_START);
+    void* virt = reinterpret_cast<void*>(KERNEL_HEAP_BASE);
     if (!vmm.mapRange(virt, phys, pages, PTE_PRESENT | PTE_WRITABLE)) {
         pmm.freePages(phys, pages);
         return;
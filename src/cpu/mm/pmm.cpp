@@ -1,4 +1,8 @@
 #include "pmm.hpp"
+#include <x86_64/requests.hpp>
+#include <cpu/process/resgroup.hpp>
+#include <string.h>
+
 PMM pmm;
 
 void PMM::init(uint8_t* bmpBuffer, uint64_t maxMemory) {
@@ -12,9 +16,29 @@ void PMM::init(uint8_t* bmpBuffer, uint64_t maxMemory) {
     intialized = true;
 }
 
+void PMM::initRefCounts() {
+    if (!intialized || refCounts) return;
+
+    size_t tablePages = (pages * sizeof(uint16_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    void* phys = allocatePages(tablePages);
+    if (!phys) return;
+
+    refCounts = reinterpret_cast<uint16_t*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset);
+    memset(refCounts, 0, tablePages * PAGE_SIZE);
+
+    size_t ownerPages = (pages * sizeof(uint8_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    phys = allocatePages(ownerPages);
+    if (!phys) return;
+
+    owners = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset);
+    memset(owners, 0, ownerPages * PAGE_SIZE);
+}
+
 void* PMM::allocatePage() {
     if (!intialized) return nullptr;
 
+    LockGuard guard(lock);
+
     size_t index = bitmap.findFirstFree();
     if (index >= pages) {
         return nullptr;  // Out of memory
@@ -23,6 +47,7 @@ void* PMM::allocatePage() {
     bitmap.set(index);
     usedMemory += PAGE_SIZE;
     freeMemory -= PAGE_SIZE;
+    if (refCounts) refCounts[index] = 1;
 
     return indexToAddress(index);
 }
@@ -30,6 +55,8 @@ void* PMM::allocatePage() {
 void* PMM::allocatePages(size_t count) {
     if (!intialized || count == 0) return nullptr;
 
+    LockGuard guard(lock);
+
     size_t index = bitmap.findFirstFreeRegion(count);
     if (index >= pages) {
         return nullptr;  // Not enough contigous memory
@@ -38,26 +65,97 @@ void* PMM::allocatePages(size_t count) {
     bitmap.setRange(index, count);
     usedMemory += count * PAGE_SIZE;
     freeMemory -= count * PAGE_SIZE;
+    if (refCounts) {
+        for (size_t i = 0; i < count; i++) {
+            refCounts[index + i] = 1;
+        }
+    }
     
     return indexToAddress(index);
 }
 
+void* PMM::allocateAlignedPages(size_t count, size_t alignment) {
+    if (!intialized || count == 0) return nullptr;
+
+    LockGuard guard(lock);
+
+    size_t index = bitmap.findFirstFreeAlignedRegion(count, alignment);
+    if (index >= pages) {
+        return nullptr;
+    }
+
+    bitmap.setRange(index, count);
+    usedMemory += count * PAGE_SIZE;
+    freeMemory -= count * PAGE_SIZE;
+    if (refCounts) {
+        for (size_t i = 0; i < count; i++) {
+            refCounts[index + i] = 1;
+        }
+    }
+
+    return indexToAddress(index);
+}
+
+void* PMM::allocatePageFor(ResourceGroup* group) {
+    if (group && !ResourceGroups::get().chargeMemory(group, 1)) return nullptr;
+    return chargeFrames(group, allocatePage(), 1);
+}
+
+void* PMM::allocatePagesFor(ResourceGroup* group, size_t count) {
+    if (group && !ResourceGroups::get().chargeMemory(group, count)) return nullptr;
+    return chargeFrames(group, allocatePages(count), count);
+}
+
+void* PMM::allocateAlignedPagesFor(ResourceGroup* group, size_t count, size_t alignment) {
+    if (group && !ResourceGroups::get().chargeMemory(group, count)) return nullptr;
+    return chargeFrames(group, allocateAlignedPages(count, alignment), count);
+}
+
+// The charge was taken before allocating; it is handed back if nothing
+// came of it, otherwise each frame remembers whom to give it back to.
+void* PMM::chargeFrames(ResourceGroup* group, void* page, size_t count) {
+    if (!group) return page;
+
+    if (!page || !owners) {
+        ResourceGroups::get().unchargeMemory(group->id, count);
+        return page;
+    }
+
+    size_t index = addressToIndex(page);
+    for (size_t i = 0; i < count; i++) {
+        owners[index + i] = group->id + 1;
+    }
+    return page;
+}
+
 void PMM::freePage(void* page) {
     if (!intialized || !page) return;
     
     size_t index = addressToIndex(page);
     if (index >= pages) return;
 
+    LockGuard guard(lock);
+    freeFrame(index);
+}
+
+void PMM::freeFrame(size_t index) {
     if (bitmap.get(index)) {
         bitmap.clear(index);
         usedMemory -= PAGE_SIZE;
         freeMemory += PAGE_SIZE;
     }
+    if (refCounts) refCounts[index] = 0;
+    if (owners && owners[index]) {
+        ResourceGroups::get().unchargeMemory(owners[index] - 1, 1);
+        owners[index] = 0;
+    }
 }
 
 void PMM::freePages(void* page, size_t count) {
     if (!intialized || !page || count == 0) return;
 
+    LockGuard guard(lock);
+
     size_t index = addressToIndex(page);
     if (index >= pages) return;
 
@@ -66,6 +164,11 @@ void PMM::freePages(void* page, size_t count) {
             bitmap.clear(index + i);
             usedMemory -= PAGE_SIZE;
             freeMemory += PAGE_SIZE;
+            if (refCounts) refCounts[index + i] = 0;
+            if (owners && owners[index + i]) {
+                ResourceGroups::get().unchargeMemory(owners[index + i] - 1, 1);
+                owners[index + i] = 0;
+            }
         }
     }
 }
@@ -73,6 +176,8 @@ void PMM::freePages(void* page, size_t count) {
 void PMM::reservePage(void* page) {
     if (!intialized || !page) return;
 
+    LockGuard guard(lock);
+
     size_t index = addressToIndex(page);
     if (index >= pages) return;
 
@@ -86,6 +191,8 @@ void PMM::reservePage(void* page) {
 void PMM::reservePages(void* page, size_t count) {
     if (!intialized || !page || count == 0) return;
 
+    LockGuard guard(lock);
+
     size_t index = addressToIndex(page);
     if (index >= pages) return;
 
@@ -106,4 +213,38 @@ void PMM::reserveRegion(uint64_t base, uint64_t length) {
     uint64_t aligned_base = base & ~(PAGE_SIZE - 1);
     size_t page_count = (length + (base - aligned_base) + PAGE_SIZE - 1) / PAGE_SIZE;
     reservePages(reinterpret_cast<void*>(aligned_base), page_count);
-}
\ No newline at end of file
+}
+
+void PMM::retain(void* page) {
+    if (!refCounts) return;
+
+    LockGuard guard(lock);
+
+    size_t index = addressToIndex(page);
+    if (index >= pages || refCounts[index] == 0) return;
+
+    refCounts[index]++;
+}
+
+void PMM::release(void* page) {
+    if (!refCounts) return;
+
+    size_t index = addressToIndex(page);
+    if (index >= pages) return;
+
+    LockGuard guard(lock);
+    if (refCounts[index] == 0) return;
+
+    if (--refCounts[index] == 0) {
+        freeFrame(index);
+    }
+}
+
+uint16_t PMM::getRefCount(void* page) const {
+    if (!refCounts) return 0;
+
+    size_t index = addressToIndex(page);
+    if (index >= pages) return 0;
+
+    return refCounts[index];
+}
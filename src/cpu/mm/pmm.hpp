@@ -1,26 +1,43 @@
 #pragma once
 
 #include "bitmap.hpp"
+#include <cpu/smp/spinlock.hpp>
 #include <cstdint>
 #include <cstddef>
 
 constexpr size_t PAGE_SIZE = 4096;
 
+struct ResourceGroup;
+
 class PMM {
 public:
     PMM() : intialized(false), availableMemory(0), usedMemory(0), 
-            freeMemory(0), pages(0) {}
+            freeMemory(0), pages(0), refCounts(nullptr), owners(nullptr) {}
 
     void init(uint8_t* bmpBuffer, uint64_t maxMemory);
+    void initRefCounts();
 
     void* allocatePage();
     void* allocatePages(size_t count);
+    void* allocateAlignedPages(size_t count, size_t alignment);
+    // The same, charged to group's memory limit. nullptr once the limit is
+    // reached. The charge is dropped when the frame is freed.
+    void* allocatePageFor(ResourceGroup* group);
+    void* allocatePagesFor(ResourceGroup* group, size_t count);
+    void* allocateAlignedPagesFor(ResourceGroup* group, size_t count, size_t alignment);
     void freePage(void* page);
     void freePages(void* page, size_t count);
     void reservePage(void* page);
     void reservePages(void* page, size_t count);
     void reserveRegion(uint64_t base, uint64_t length);
     
+    // Frames handed out by allocatePage(s) start with one reference. Frames the
+    // PMM never allocated (framebuffer, modules, MMIO) stay at zero and are
+    // ignored by retain/release, so they can be mapped without being freed.
+    void retain(void* page);
+    void release(void* page);
+    uint16_t getRefCount(void* page) const;
+    
     uint64_t getTotalMemory() const { return availableMemory; }
     uint64_t getUsedMemory() const { return usedMemory; }
     uint64_t getFreeMemory() const { return freeMemory; }
@@ -30,12 +47,18 @@ public:
     
 private:
     Bitmap bitmap;
+    Spinlock lock;
     bool intialized;
 
     uint64_t availableMemory;
     uint64_t usedMemory;
     uint64_t freeMemory;
     size_t pages;
+    uint16_t* refCounts;
+    uint8_t* owners;        // group id + 1 a frame is charged to, or 0
+
+    void freeFrame(size_t index);
+    void* chargeFrames(ResourceGroup* group, void* page, size_t count);
 
     size_t addressToIndex(void* addr) const {
         return reinterpret_cast<uint64_t>(addr) / PAGE_SIZE;
@@ -0,0 +1,729 @@
+#include "vma.hpp"
+#include "pmm.hpp"
+#include <x86_64/requests.hpp>
+#include <x86_64/ports.hpp>
+#include <fs/vfs/vfs.hpp>
+#include <fs/elf/execcache.hpp>
+#include <cpu/process/resgroup.hpp>
+#include <cpu/smp/smp.hpp>
+#include <string.h>
+
+static void* allocateZeroedPage(ResourceGroup* group) {
+    void* page = pmm.allocatePageFor(group);
+    if (!page) return nullptr;
+
+    memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(page) + hhdm_request.response->offset), 0, PAGE_SIZE);
+    return page;
+}
+
+// Shootdowns go out with the lock held and wait for every CPU the address
+// space is active on. A sibling thread spinning here with interrupts off
+// would never answer one, so it answers them while it waits.
+class VMALockGuard {
+public:
+    explicit VMALockGuard(Spinlock& lock) : lock(lock) {
+        while (!lock.tryLock()) {
+            SMP::get().serviceShootdown();
+            asm volatile("pause");
+        }
+    }
+    ~VMALockGuard() { lock.unlock(); }
+
+    VMALockGuard(const VMALockGuard&) = delete;
+    VMALockGuard& operator=(const VMALockGuard&) = delete;
+
+private:
+    Spinlock& lock;
+};
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment = PAGE_SIZE) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void dropFile(VNode* file) {
+    if (!file) return;
+
+    file->refCount--;
+    if (file->refCount == 0) {
+        delete file;
+    }
+}
+
+VMAManager::~VMAManager() {
+    clear();
+}
+
+void VMAManager::clear() {
+    PendingWrite* writes = nullptr;
+    while (root) {
+        VMArea* area = root;
+        root = VMATree::remove(root, area);
+        destroyArea(area, &writes);
+    }
+    writeOut(writes);
+}
+
+void VMAManager::init(VMM* vmm) {
+    this->vmm = vmm;
+    vmm->setStats(&stats);
+}
+
+void VMAManager::count(uint64_t VMStats::* counter) {
+    __atomic_add_fetch(&(systemVMStats.*counter), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(stats.*counter), 1, __ATOMIC_RELAXED);
+}
+
+uint64_t VMAManager::protToFlags(uint64_t prot) {
+    // PROT_NONE keeps populated frames mapped for the kernel only, so user
+    // accesses fault while the contents survive a later mprotect.
+    if (prot == PROT_NONE) {
+        return PTE_PRESENT;
+    }
+
+    uint64_t flags = PTE_PRESENT | PTE_USER;
+    if (prot & PROT_WRITE) {
+        flags |= PTE_WRITABLE;
+    }
+    return flags;
+}
+
+uint64_t VMAManager::areaFlags(VMArea* area, uint64_t prot) {
+    uint64_t flags = protToFlags(prot);
+
+    // Private file pages stay read-only until a write fault gives the
+    // process its own copy.
+    if (area->file && (area->flags & MAP_PRIVATE)) {
+        flags &= ~PTE_WRITABLE;
+    }
+    return flags;
+}
+
+VMArea* VMAManager::find(uint64_t addr) {
+    VMArea* node = root;
+    while (node) {
+        if (addr < node->start) {
+            node = node->tree.left;
+        } else if (addr >= node->end) {
+            node = node->tree.right;
+        } else {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+VMArea* VMAManager::findFirstOverlap(uint64_t start, uint64_t end) {
+    // Areas never overlap, so ordering by start also orders them by end.
+    VMArea* node = root;
+    VMArea* best = nullptr;
+    while (node) {
+        if (node->end > start) {
+            best = node;
+            node = node->tree.left;
+        } else {
+            node = node->tree.right;
+        }
+    }
+
+    if (best && best->start < end) {
+        return best;
+    }
+    return nullptr;
+}
+
+uint64_t VMAManager::findFreeRange(size_t length, uint64_t alignment) {
+    uint64_t candidate = alignUp(mmapHint, alignment);
+    bool wrapped = false;
+
+    while (true) {
+        if (candidate + length > USER_MMAP_END || candidate + length < candidate) {
+            if (wrapped) return 0;
+            wrapped = true;
+            candidate = USER_MMAP_BASE;
+            continue;
+        }
+
+        VMArea* overlap = findFirstOverlap(candidate, candidate + length);
+        if (!overlap) return candidate;
+
+        candidate = alignUp(overlap->end, alignment);
+    }
+}
+
+bool VMAManager::splitAt(uint64_t addr) {
+    VMArea* area = find(addr);
+    if (!area || area->start == addr) return true;
+
+    VMArea* tail = new VMArea(*area);
+    if (!tail) return false;
+
+    tail->start = addr;
+    tail->objectOffset += (addr - area->start) / PAGE_SIZE;
+    tail->fileOffset += addr - area->start;
+    if (tail->shared) {
+        tail->shared->refCount++;
+    }
+    if (tail->file) {
+        tail->file->refCount++;
+    }
+
+    // The original keeps its start, so its position in the tree is unchanged.
+    area->end = addr;
+    root = VMATree::insert(root, tail);
+    return true;
+}
+
+void VMAManager::releaseObject(AnonObject* object) {
+    if (!object || --object->refCount > 0) return;
+
+    for (size_t i = 0; i < object->pageCount; i++) {
+        if (object->frames[i]) {
+            pmm.release(reinterpret_cast<void*>(object->frames[i]));
+        }
+    }
+
+    delete[] object->frames;
+    delete object;
+}
+
+// Only collects the dirty pages, file I/O cannot run under the spinlock.
+void VMAManager::writeBack(VMArea* area, PendingWrite** writes) {
+    VNode* file = area->file;
+    if (!file || !(area->flags & MAP_SHARED) || !file->ops->write || !file->ops->stat) return;
+
+    for (uint64_t page = area->start; page < area->end; page += PAGE_SIZE) {
+        PageTableEntry* entry = vmm->getEntry(reinterpret_cast<void*>(page));
+        if (!entry || !entry->hasFlag(PTE_PRESENT) || !entry->hasFlag(PTE_DIRTY)) continue;
+
+        PendingWrite* write = new PendingWrite;
+        if (!write) break;
+
+        write->file = file;
+        file->refCount++;
+        write->frame = entry->getAddress();
+        pmm.retain(reinterpret_cast<void*>(write->frame));
+        write->offset = area->fileOffset + (page - area->start);
+        write->next = *writes;
+        *writes = write;
+        entry->removeFlags(PTE_DIRTY);
+    }
+}
+
+void VMAManager::writeOut(PendingWrite* writes) {
+    FileStats stats;
+    VNode* statted = nullptr;
+    bool written = false;
+
+    while (writes) {
+        PendingWrite* write = writes;
+        writes = write->next;
+        VNode* file = write->file;
+
+        if (file != statted) {
+            statted = file->ops->stat(file, &stats) == 0 ? file : nullptr;
+        }
+        if (statted && write->offset < stats.size) {
+            uint64_t length = stats.size - write->offset;
+            if (length > PAGE_SIZE) length = PAGE_SIZE;
+
+            void* data = reinterpret_cast<void*>(write->frame + hhdm_request.response->offset);
+            file->ops->write(file, data, length, write->offset);
+            written = true;
+        }
+
+        // Pages of one area are queued next to each other.
+        if (written && (!writes || writes->file != file)) {
+            ExecCache::get().evict(file->getFS(), file->getInode());
+            written = false;
+        }
+
+        pmm.release(reinterpret_cast<void*>(write->frame));
+        dropFile(file);
+        delete write;
+    }
+}
+
+void VMAManager::destroyArea(VMArea* area, PendingWrite** writes) {
+    writeBack(area, writes);
+    vmm->unmapRange(reinterpret_cast<void*>(area->start), area->pageCount(), true);
+    releaseObject(area->shared);
+    dropFile(area->file);
+    delete area;
+}
+
+uint64_t VMAManager::map(uint64_t addr, size_t length, uint64_t prot, uint64_t flags, VNode* file, uint64_t offset, bool fileWritable) {
+    PendingWrite* writes = nullptr;
+    uint64_t result;
+    {
+        VMALockGuard guard(lock);
+        result = mapLocked(addr, length, prot, flags, file, offset, fileWritable, &writes);
+    }
+    writeOut(writes);
+    return result;
+}
+
+uint64_t VMAManager::mapLocked(uint64_t addr, size_t length, uint64_t prot, uint64_t flags, VNode* file, uint64_t offset, bool fileWritable, PendingWrite** writes) {
+    if (!vmm || length == 0) return MAP_FAILED;
+
+    bool shared = flags & MAP_SHARED;
+    bool priv = flags & MAP_PRIVATE;
+    if (shared == priv) return MAP_FAILED;
+
+    // Writes to a shared file mapping end up in the file, private ones
+    // only ever touch copies.
+    bool mayWrite = true;
+    if (flags & MAP_ANONYMOUS) {
+        file = nullptr;
+        offset = 0;
+    } else {
+        if (!file || file->getType() != FileType::Regular || !file->ops || !file->ops->getPage) return MAP_FAILED;
+        if (offset & (PAGE_SIZE - 1)) return MAP_FAILED;
+        if (shared) mayWrite = fileWritable && !file->getFS()->isReadOnly();
+        if ((prot & PROT_WRITE) && !mayWrite) return MAP_FAILED;
+    }
+
+    length = alignUp(length);
+    if (length == 0) return MAP_FAILED;
+
+    uint64_t start = 0;
+    if (flags & MAP_FIXED) {
+        if ((addr & (PAGE_SIZE - 1)) || addr == 0) return MAP_FAILED;
+        if (addr + length > USER_SPACE_END || addr + length < addr) return MAP_FAILED;
+
+        // Whatever is left of the old mappings must not overlap the new one.
+        if (unmapLocked(addr, length, writes) != 0) return MAP_FAILED;
+        start = addr;
+    } else {
+        if (addr && !(addr & (PAGE_SIZE - 1)) && addr + length <= USER_SPACE_END &&
+            addr + length > addr && !findFirstOverlap(addr, addr + length)) {
+            start = addr;
+        } else {
+            // Large private anonymous regions start on a huge page boundary
+            // so faults can back them with 2 MiB pages.
+            uint64_t alignment = PAGE_SIZE;
+            if (!file && priv && length >= HUGE_PAGE_SIZE) {
+                alignment = HUGE_PAGE_SIZE;
+            }
+            start = findFreeRange(length, alignment);
+        }
+        if (!start) return MAP_FAILED;
+    }
+
+    flags &= ~MAP_FIXED;
+
+    AnonObject* object = nullptr;
+    if (file) {
+        file->refCount++;
+    } else if (shared) {
+        object = new AnonObject;
+        if (!object) return MAP_FAILED;
+
+        object->pageCount = length / PAGE_SIZE;
+        object->frames = new uint64_t[object->pageCount];
+        if (!object->frames) {
+            delete object;
+            return MAP_FAILED;
+        }
+        memset(object->frames, 0, object->pageCount * sizeof(uint64_t));
+        object->refCount = 1;
+    } else {
+        // Growing heaps tend to map right after their last chunk, so extend
+        // the neighbour instead of adding another node.
+        VMArea* prev = find(start - 1);
+        if (prev && prev->end == start && !prev->shared && !prev->file && prev->prot == prot && prev->flags == flags) {
+            prev->end += length;
+            mmapHint = start + length;
+            return start;
+        }
+    }
+
+    VMArea* area = new VMArea;
+    if (!area) {
+        releaseObject(object);
+        dropFile(file);
+        return MAP_FAILED;
+    }
+
+    area->start = start;
+    area->end = start + length;
+    area->prot = prot;
+    area->flags = flags;
+    area->shared = object;
+    area->objectOffset = 0;
+    area->file = file;
+    area->fileOffset = offset;
+    area->mayWrite = mayWrite;
+
+    root = VMATree::insert(root, area);
+    mmapHint = start + length;
+
+    return start;
+}
+
+int VMAManager::unmap(uint64_t addr, size_t length) {
+    PendingWrite* writes = nullptr;
+    int result;
+    {
+        VMALockGuard guard(lock);
+        result = unmapLocked(addr, length, &writes);
+    }
+    writeOut(writes);
+    return result;
+}
+
+int VMAManager::unmapLocked(uint64_t addr, size_t length, PendingWrite** writes) {
+    if (!vmm || (addr & (PAGE_SIZE - 1)) || length == 0) return -1;
+
+    uint64_t end = addr + alignUp(length);
+    if (end > USER_SPACE_END || end <= addr) return -1;
+
+    if (!splitAt(addr) || !splitAt(end)) return -1;
+
+    while (VMArea* area = findFirstOverlap(addr, end)) {
+        root = VMATree::remove(root, area);
+        destroyArea(area, writes);
+    }
+
+    return 0;
+}
+
+int VMAManager::protect(uint64_t addr, size_t length, uint64_t prot) {
+    VMALockGuard guard(lock);
+    if (!vmm || (addr & (PAGE_SIZE - 1)) || length == 0) return -1;
+
+    uint64_t end = addr + alignUp(length);
+    if (end > USER_SPACE_END || end <= addr) return -1;
+
+    for (uint64_t cursor = addr; cursor < end; ) {
+        VMArea* area = find(cursor);
+        if (!area) return -1;
+        cursor = area->end;
+    }
+
+    for (uint64_t cursor = addr; cursor < end; ) {
+        VMArea* area = find(cursor);
+        if ((prot & PROT_WRITE) && !area->mayWrite) {
+            return -1;
+        }
+        cursor = area->end;
+    }
+
+    if (!splitAt(addr) || !splitAt(end)) return -1;
+
+    for (uint64_t cursor = addr; cursor < end; ) {
+        VMArea* area = find(cursor);
+        area->prot = prot;
+        vmm->protectRange(reinterpret_cast<void*>(area->start), area->pageCount(), areaFlags(area, prot));
+        cursor = area->end;
+    }
+
+    return 0;
+}
+
+// A file page that has to be read is fetched with the lock dropped, then
+// the fault is tried again against the mappings as they are by then.
+bool VMAManager::handleFault(uint64_t addr, uint64_t errorCode) {
+    uint64_t start = rdtsc();
+    FilePage fill = {};
+    bool resolved = false;
+    bool major = false;
+
+    while (true) {
+        {
+            VMALockGuard guard(lock);
+            fill.wanted = false;
+            resolved = resolveFault(addr, errorCode, &fill);
+            if (!fill.wanted) {
+                if (resolved) {
+                    count(major ? &VMStats::majorFaults : &VMStats::minorFaults);
+                    ResourceGroup* owner = getGroup();
+                    if (owner) __atomic_add_fetch(&owner->faults, 1, __ATOMIC_RELAXED);
+                }
+                VMStatistics::recordFault(&stats, rdtsc() - start, resolved);
+                break;
+            }
+        }
+
+        bool missed = false;
+        if (fill.file->ops->getPage(fill.file, fill.offset, &fill.frame, &missed) != 0) {
+            fill.frame = 0;
+        }
+        major |= missed;
+    }
+
+    releaseFill(&fill);
+    return resolved;
+}
+
+void VMAManager::releaseFill(FilePage* fill) {
+    if (fill->frame) pmm.release(reinterpret_cast<void*>(fill->frame));
+    dropFile(fill->file);
+    *fill = {};
+}
+
+bool VMAManager::resolveFault(uint64_t addr, uint64_t errorCode, FilePage* fill) {
+    VMArea* area = find(addr);
+    if (!area) return false;
+
+    bool present = errorCode & 0x1;
+    bool write = errorCode & 0x2;
+    uint64_t page = addr & ~(PAGE_SIZE - 1);
+
+    if (area->prot == PROT_NONE) return false;
+    if (write && !(area->prot & PROT_WRITE)) return false;
+
+    // The mapping changed between the fault and taking the lock, as when a
+    // collapse write-protected the range while copying it or another thread
+    // faulted the page in while a file page was read.
+    if (allowsAccess(page, write)) return true;
+    if (!present && vmm->getPhysical(reinterpret_cast<void*>(page))) present = true;
+
+    if (area->file) {
+        return handleFileFault(area, page, present, write, fill);
+    }
+
+    if (present) return false;
+
+    void* frame = nullptr;
+
+    if (area->shared) {
+        size_t index = area->objectOffset + (page - area->start) / PAGE_SIZE;
+        uint64_t& slot = area->shared->frames[index];
+        if (!slot) {
+            void* fresh = allocateZeroedPage(getGroup());
+            if (!fresh) return false;
+            slot = reinterpret_cast<uint64_t>(fresh);
+            count(&VMStats::zeroFillFaults);
+        }
+        frame = reinterpret_cast<void*>(slot);
+        pmm.retain(frame);
+    } else {
+        if (mapHugePage(area, page)) return true;
+
+        frame = allocateZeroedPage(getGroup());
+        if (!frame) return false;
+        count(&VMStats::zeroFillFaults);
+    }
+
+    if (!vmm->map(reinterpret_cast<void*>(page), frame, protToFlags(area->prot))) {
+        pmm.release(frame);
+        return false;
+    }
+
+    return true;
+}
+
+bool VMAManager::allowsAccess(uint64_t page, bool write) {
+    PageTableEntry* entry = vmm->getDirectoryEntry(reinterpret_cast<void*>(page));
+    if (!entry || !entry->hasFlag(PTE_PRESENT)) return false;
+    if (!entry->hasFlag(PTE_HUGE)) {
+        entry = vmm->getEntry(reinterpret_cast<void*>(page));
+        if (!entry || !entry->hasFlag(PTE_PRESENT)) return false;
+    }
+    return entry->hasFlag(PTE_USER) && (!write || entry->hasFlag(PTE_WRITABLE));
+}
+
+bool VMAManager::isHugeCandidate(VMArea* area) {
+    // Stacks grow a page at a time; a 2 MiB page would defeat lazy growth.
+    return !area->shared && !area->file && !(area->flags & MAP_STACK) && area->prot != PROT_NONE;
+}
+
+bool VMAManager::mapHugePage(VMArea* area, uint64_t addr) {
+    uint64_t base = addr & ~(HUGE_PAGE_SIZE - 1);
+    if (!isHugeCandidate(area) || base < area->start || base + HUGE_PAGE_SIZE > area->end) return false;
+
+    // Ranges that already hold small pages are left to collapse().
+    PageTableEntry* pde = vmm->getDirectoryEntry(reinterpret_cast<void*>(base));
+    if (pde && pde->hasFlag(PTE_PRESENT)) return false;
+
+    void* frames = pmm.allocateAlignedPagesFor(getGroup(), PAGES_PER_HUGE_PAGE, PAGES_PER_HUGE_PAGE);
+    if (!frames) {
+        hugePageStats.fallbacks++;
+        return false;
+    }
+
+    memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(frames) + hhdm_request.response->offset), 0, HUGE_PAGE_SIZE);
+
+    if (!vmm->mapHuge(reinterpret_cast<void*>(base), frames, protToFlags(area->prot))) {
+        pmm.freePages(frames, PAGES_PER_HUGE_PAGE);
+        hugePageStats.fallbacks++;
+        return false;
+    }
+
+    hugePageStats.faults++;
+    count(&VMStats::zeroFillFaults);
+    return true;
+}
+
+bool VMAManager::isCollapsible(PageTableEntry* entries) {
+    for (size_t i = 0; i < PAGES_PER_HUGE_PAGE; i++) {
+        if (!entries[i].hasFlag(PTE_PRESENT)) return false;
+        if (pmm.getRefCount(reinterpret_cast<void*>(entries[i].getAddress())) != 1) return false;
+    }
+    return true;
+}
+
+bool VMAManager::collapseRange(VMArea* area, uint64_t base) {
+    PageTableEntry* pde = vmm->getDirectoryEntry(reinterpret_cast<void*>(base));
+    if (!pde || !pde->hasFlag(PTE_PRESENT) || pde->hasFlag(PTE_HUGE)) return false;
+
+    // Only fully populated ranges are merged, collapsing never adds memory.
+    PageTableEntry* entries = vmm->getEntry(reinterpret_cast<void*>(base));
+    if (!isCollapsible(entries)) return false;
+
+    void* frames = pmm.allocateAlignedPagesFor(getGroup(), PAGES_PER_HUGE_PAGE, PAGES_PER_HUGE_PAGE);
+    if (!frames) return false;
+
+    // Other threads of the process keep writing through their TLBs. The
+    // range goes read-only everywhere before it is copied, so a write either
+    // lands first or faults and waits for the lock until the huge page is in.
+    uint64_t flags = protToFlags(area->prot);
+    vmm->protectRange(reinterpret_cast<void*>(base), PAGES_PER_HUGE_PAGE, flags & ~PTE_WRITABLE);
+    if (!isCollapsible(entries)) {
+        vmm->protectRange(reinterpret_cast<void*>(base), PAGES_PER_HUGE_PAGE, flags);
+        pmm.freePages(frames, PAGES_PER_HUGE_PAGE);
+        return false;
+    }
+
+    uint64_t offset = hhdm_request.response->offset;
+    for (size_t i = 0; i < PAGES_PER_HUGE_PAGE; i++) {
+        memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(frames) + i * PAGE_SIZE + offset),
+               reinterpret_cast<void*>(entries[i].getAddress() + offset), PAGE_SIZE);
+    }
+
+    if (!vmm->mapHuge(reinterpret_cast<void*>(base), frames, flags)) {
+        vmm->protectRange(reinterpret_cast<void*>(base), PAGES_PER_HUGE_PAGE, flags);
+        pmm.freePages(frames, PAGES_PER_HUGE_PAGE);
+        return false;
+    }
+
+    hugePageStats.collapses++;
+    return true;
+}
+
+void VMAManager::collapseTree(VMArea* node, size_t& budget) {
+    if (!node || budget == 0) return;
+
+    collapseTree(node->tree.left, budget);
+
+    if (budget > 0 && isHugeCandidate(node)) {
+        for (uint64_t base = alignUp(node->start, HUGE_PAGE_SIZE); base + HUGE_PAGE_SIZE <= node->end && budget > 0; base += HUGE_PAGE_SIZE) {
+            if (collapseRange(node, base)) budget--;
+        }
+    }
+
+    collapseTree(node->tree.right, budget);
+}
+
+bool VMAManager::populate(uint64_t addr, size_t length) {
+    if (!vmm || length == 0) return false;
+
+    uint64_t end = alignUp(addr + length);
+    for (uint64_t page = addr & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        bool mapped;
+        {
+            VMALockGuard guard(lock);
+            mapped = vmm->getPhysical(reinterpret_cast<void*>(page)) != nullptr;
+        }
+        if (!mapped && !handleFault(page, 0x2)) return false;
+    }
+    return true;
+}
+
+size_t VMAManager::collapse(size_t budget) {
+    if (!vmm) return 0;
+
+    VMALockGuard guard(lock);
+    size_t remaining = budget;
+    collapseTree(root, remaining);
+    return budget - remaining;
+}
+
+bool VMAManager::breakCopyOnWrite(uint64_t page, void* frame, uint64_t flags) {
+    count(&VMStats::cowBreaks);
+
+    // The last reference can simply be made writable in place.
+    if (pmm.getRefCount(frame) == 1) {
+        return vmm->map(reinterpret_cast<void*>(page), frame, flags);
+    }
+
+    void* copy = pmm.allocatePageFor(getGroup());
+    if (!copy) return false;
+
+    uint64_t offset = hhdm_request.response->offset;
+    memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(copy) + offset),
+           reinterpret_cast<void*>(reinterpret_cast<uint64_t>(frame) + offset), PAGE_SIZE);
+
+    if (!vmm->map(reinterpret_cast<void*>(page), copy, flags)) {
+        pmm.freePage(copy);
+        return false;
+    }
+
+    return true;
+}
+
+bool VMAManager::handleFileFault(VMArea* area, uint64_t page, bool present, bool write, FilePage* fill) {
+    bool priv = area->flags & MAP_PRIVATE;
+    uint64_t flags = protToFlags(area->prot);
+
+    if (present) {
+        if (!priv || !write) return false;
+
+        PageTableEntry* entry = vmm->getEntry(reinterpret_cast<void*>(page));
+        if (!entry || !entry->hasFlag(PTE_PRESENT)) return false;
+
+        void* shared = reinterpret_cast<void*>(entry->getAddress());
+        if (!breakCopyOnWrite(page, shared, flags)) return false;
+
+        if (vmm->getPhysical(reinterpret_cast<void*>(page)) != shared) {
+            pmm.release(shared);
+        }
+        return true;
+    }
+
+    // Filling the page may wait for the disk. The caller reads it without
+    // the lock and comes back, a read for another page is dropped.
+    uint64_t offset = area->fileOffset + (page - area->start);
+    if (fill->file != area->file || fill->offset != offset) {
+        releaseFill(fill);
+        fill->file = area->file;
+        fill->file->refCount++;
+        fill->offset = offset;
+        fill->wanted = true;
+        return false;
+    }
+    if (!fill->frame) return false;
+
+    uint64_t frame = fill->frame;
+    fill->frame = 0;
+
+    if (priv && write) {
+        // Copy straight away instead of mapping the shared page first.
+        void* copy = pmm.allocatePageFor(getGroup());
+        if (!copy) {
+            pmm.release(reinterpret_cast<void*>(frame));
+            return false;
+        }
+
+        uint64_t hhdm = hhdm_request.response->offset;
+        memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(copy) + hhdm),
+               reinterpret_cast<void*>(frame + hhdm), PAGE_SIZE);
+        pmm.release(reinterpret_cast<void*>(frame));
+
+        if (!vmm->map(reinterpret_cast<void*>(page), copy, flags)) {
+            pmm.freePage(copy);
+            return false;
+        }
+        count(&VMStats::cowBreaks);
+        return true;
+    }
+
+    // The mapping keeps the reference getPage() took.
+    void* shared = reinterpret_cast<void*>(frame);
+    if (!vmm->map(reinterpret_cast<void*>(page), shared, areaFlags(area, area->prot))) {
+        pmm.release(shared);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "vmm.hpp"
+#include <cpu/avltree.hpp>
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+class VNode;
+struct ResourceGroup;
+
+constexpr uint64_t PROT_NONE = 0x0;
+constexpr uint64_t PROT_READ = 0x1;
+constexpr uint64_t PROT_WRITE = 0x2;
+constexpr uint64_t PROT_EXEC = 0x4;
+
+constexpr uint64_t MAP_SHARED = 0x01;
+constexpr uint64_t MAP_PRIVATE = 0x02;
+constexpr uint64_t MAP_FIXED = 0x10;
+constexpr uint64_t MAP_ANONYMOUS = 0x20;
+constexpr uint64_t MAP_STACK = 0x20000;
+
+constexpr uint64_t MAP_FAILED = static_cast<uint64_t>(-1);
+
+constexpr uint64_t USER_SPACE_END = 0x0000800000000000;
+constexpr uint64_t USER_MMAP_BASE = 0x0000100000000000;
+constexpr uint64_t USER_MMAP_END = 0x0000700000000000;
+
+// Frames behind a MAP_SHARED anonymous mapping. Every VMA split off the
+// original mapping points at the same object, so all of them see one copy.
+struct AnonObject {
+    uint64_t* frames;
+    size_t pageCount;
+    uint32_t refCount;
+};
+
+// A dirty page of a shared file mapping, written out once the lock is
+// dropped. It holds a reference on both the file and the frame.
+struct PendingWrite {
+    VNode* file;
+    uint64_t frame;
+    uint64_t offset;
+    PendingWrite* next;
+};
+
+// A file page a fault needs, read from the filesystem without the lock.
+struct FilePage {
+    VNode* file;        // held until the fault is done
+    uint64_t offset;
+    uint64_t frame;     // retained, 0 once mapped or if the read failed
+    bool wanted;        // resolveFault has to wait for the read
+};
+
+struct VMArea {
+    uint64_t start;
+    uint64_t end;
+    uint64_t prot;
+    uint64_t flags;
+
+    AnonObject* shared;
+    uint64_t objectOffset;  // in pages, into the backing object
+
+    VNode* file;
+    uint64_t fileOffset;    // in bytes, page aligned
+    bool mayWrite;          // PROT_WRITE allowed, false for shared maps of files opened read-only
+
+    AVLNode<VMArea> tree;
+
+    size_t pageCount() const { return (end - start) / PAGE_SIZE; }
+};
+
+struct VMAreaTraits {
+    static AVLNode<VMArea>* node(VMArea* area) { return &area->tree; }
+    static uint64_t key(VMArea* area) { return area->start; }
+};
+
+using VMATree = AVLTree<VMArea, VMAreaTraits>;
+
+// Threads of a process share one manager, so every public entry point but
+// clear() takes the lock. find() is for callers that hold it already.
+class VMAManager {
+public:
+    VMAManager() : root(nullptr), vmm(nullptr), group(nullptr), mmapHint(USER_MMAP_BASE), stats{} {}
+    ~VMAManager();
+
+    void init(VMM* vmm);
+    void clear();
+    // Frames for faults, copies and huge pages are charged to group.
+    ResourceGroup* getGroup() const { return __atomic_load_n(&group, __ATOMIC_ACQUIRE); }
+    void setGroup(ResourceGroup* group) { __atomic_store_n(&this->group, group, __ATOMIC_RELEASE); }
+
+    // fileWritable says whether file was opened for writing, shared
+    // mappings of it may only become writable then.
+    uint64_t map(uint64_t addr, size_t length, uint64_t prot, uint64_t flags, VNode* file = nullptr, uint64_t offset = 0, bool fileWritable = false);
+    int unmap(uint64_t addr, size_t length);
+    int protect(uint64_t addr, size_t length, uint64_t prot);
+
+    bool handleFault(uint64_t addr, uint64_t errorCode);
+    size_t collapse(size_t budget);
+    bool populate(uint64_t addr, size_t length);
+
+    VMArea* find(uint64_t addr);
+    VMStats* getStats() { return &stats; }
+
+    static uint64_t protToFlags(uint64_t prot);
+
+private:
+    VMArea* root;
+    VMM* vmm;
+    ResourceGroup* group;
+    uint64_t mmapHint;
+    VMStats stats;
+    Spinlock lock;
+
+    uint64_t mapLocked(uint64_t addr, size_t length, uint64_t prot, uint64_t flags, VNode* file, uint64_t offset, bool fileWritable, PendingWrite** writes);
+    int unmapLocked(uint64_t addr, size_t length, PendingWrite** writes);
+    bool resolveFault(uint64_t addr, uint64_t errorCode, FilePage* fill);
+    void count(uint64_t VMStats::* counter);
+    VMArea* findFirstOverlap(uint64_t start, uint64_t end);
+    uint64_t findFreeRange(size_t length, uint64_t alignment);
+    bool splitAt(uint64_t addr);
+    void destroyArea(VMArea* area, PendingWrite** writes);
+    void writeBack(VMArea* area, PendingWrite** writes);
+    bool handleFileFault(VMArea* area, uint64_t page, bool present, bool write, FilePage* fill);
+    bool breakCopyOnWrite(uint64_t page, void* frame, uint64_t flags);
+    uint64_t areaFlags(VMArea* area, uint64_t prot);
+    bool mapHugePage(VMArea* area, uint64_t addr);
+    bool collapseRange(VMArea* area, uint64_t base);
+    bool allowsAccess(uint64_t page, bool write);
+    void collapseTree(VMArea* node, size_t& budget);
+    
+    static bool isHugeCandidate(VMArea* area);
+    static bool isCollapsible(PageTableEntry* entries);
+
+    static void releaseObject(AnonObject* object);
+    static void writeOut(PendingWrite* writes);
+    static void releaseFill(FilePage* fill);
+};
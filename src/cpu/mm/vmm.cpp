@@ -1,10 +1,30 @@
 
 #include "vmm.hpp"
 #include <x86_64/requests.hpp>
+#include <cpu/smp/smp.hpp>
+#include <string.h>
 
 VMM vmm;
+HugePageStats hugePageStats;
 
-VMM::VMM() : _pml4(nullptr), initialized(false) {}
+VMM::VMM() : _pml4(nullptr), initialized(false), stats(nullptr), cpuMask(0) {}
+
+// WB, WC, UC-, UC in the low half; the high half matches what Limine set up
+// (WP, WC) so mappings it made with the PAT bit keep their type.
+constexpr uint64_t PAT_MSR = 0x277;
+constexpr uint64_t PAT_VALUE = 0x0007010500070106;
+
+void VMM::initPAT() {
+    uint32_t low = PAT_VALUE & 0xFFFFFFFF;
+    uint32_t high = PAT_VALUE >> 32;
+    asm volatile("wrmsr" :: "a"(low), "d"(high), "c"(PAT_MSR));
+
+    // Drop lines and translations cached under the old memory types.
+    uint64_t cr3;
+    asm volatile("wbinvd" ::: "memory");
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
 
 void VMM::init(PageTable* pml4) {
     if (pml4) {
@@ -49,116 +69,429 @@ PageTable* VMM::getTable(PageTableEntry& entry) {
     if (!entry.hasFlag(PTE_PRESENT)) {
         return nullptr;
     }
-    return reinterpret_cast<PageTable*>(entry.getAddress());
+    return reinterpret_cast<PageTable*>(entry.getAddress() + hhdm_request.response->offset);
 }
 
-bool VMM::map(void* virt, void* phys, uint64_t flags) {
-    if (!initialized) return false;
-
-    size_t pml4Index = getPML4Index(virt);
-    size_t pdptIndex = getPDPTIndex(virt);
-    size_t pdIndex = getPDIndex(virt);
-    size_t ptIndex = getPTIndex(virt);
-
-    PageTable* pdpt = getOrCreateTable(_pml4->entries[pml4Index]);
-    if (!pdpt) return false;
+PageTable* VMM::getDirectory(void* virt, bool create, uint64_t flags) {
+    PageTableEntry& pml4e = _pml4->entries[getPML4Index(virt)];
+    PageTable* pdpt = create ? getOrCreateTable(pml4e) : getTable(pml4e);
+    if (!pdpt) return nullptr;
     
     if (flags & PTE_USER) {
-        _pml4->entries[pml4Index].addFlags(PTE_USER);
+        pml4e.addFlags(PTE_USER);
     }
-        
-    PageTable* pd = getOrCreateTable(pdpt->entries[pdptIndex]);
-    if (!pd) return false;
+    
+    PageTableEntry& pdpte = pdpt->entries[getPDPTIndex(virt)];
+    PageTable* pd = create ? getOrCreateTable(pdpte) : getTable(pdpte);
+    if (!pd) return nullptr;
     
     if (flags & PTE_USER) {
-        pdpt->entries[pdptIndex].addFlags(PTE_USER);
+        pdpte.addFlags(PTE_USER);
     }
+
+    return pd;
+}
+
+PageTable* VMM::getLeafTable(void* virt, bool create, uint64_t flags) {
+    PageTable* pd = getDirectory(virt, create, flags);
+    if (!pd) return nullptr;
     
-    PageTable* pt = getOrCreateTable(pd->entries[pdIndex]);
-    if (!pt) return false;
+    // Callers want individual entries, so a huge page has to be broken up.
+    PageTableEntry& pde = pd->entries[getPDIndex(virt)];
+    if (pde.hasFlag(PTE_PRESENT) && pde.hasFlag(PTE_HUGE) && !splitHuge(pde, virt)) {
+        return nullptr;
+    }
+    
+    PageTable* pt = create ? getOrCreateTable(pde) : getTable(pde);
+    if (!pt) return nullptr;
     
     if (flags & PTE_USER) {
-        pd->entries[pdIndex].addFlags(PTE_USER);
+        pde.addFlags(PTE_USER);
+    }
+
+    return pt;
+}
+
+bool VMM::splitHuge(PageTableEntry& pde, void* virt) {
+    void* page = pmm.allocatePage();
+    if (!page) return false;
+
+    PageTable* table = reinterpret_cast<PageTable*>(reinterpret_cast<uint64_t>(page) + hhdm_request.response->offset);
+    uint64_t base = pde.getAddress();
+    uint64_t flags = pde.value & 0xFFF0000000000FFF & ~PTE_HUGE;
+
+    // Each 4 KiB frame of a huge page already carries its own reference,
+    // so the split frames need no extra accounting.
+    for (size_t i = 0; i < PAGES_PER_HUGE_PAGE; i++) {
+        table->entries[i].clear();
+        table->entries[i].setAddress(base + i * PAGE_SIZE);
+        table->entries[i].setFlags(flags);
+    }
+
+    pde.clear();
+    pde.setAddress(reinterpret_cast<uint64_t>(page));
+    pde.setFlags(PTE_PRESENT | PTE_WRITABLE | (isUser(virt) ? PTE_USER : 0));
+
+    flushPage(virt, false);
+
+    if (isUser(virt)) {
+        hugePageStats.inUse--;
+        hugePageStats.splits++;
+    }
+    return true;
+}
+
+void VMM::releaseHuge(uint64_t phys) {
+    for (size_t i = 0; i < PAGES_PER_HUGE_PAGE; i++) {
+        pmm.release(reinterpret_cast<void*>(phys + i * PAGE_SIZE));
+    }
+}
+
+bool VMM::isTableEmpty(PageTable* table) {
+    for (int i = 0; i < 512; i++) {
+        if (table->entries[i].hasFlag(PTE_PRESENT)) return false;
+    }
+    return true;
+}
+
+void VMM::freeTable(PageTable* table) {
+    pmm.freePage(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(table) - hhdm_request.response->offset));
+}
+
+void VMM::pruneTables(void* virt, PageTable*& freed) {
+    // Kernel tables are shared by every address space and never go away.
+    if (getPML4Index(virt) >= USER_PML4_ENTRIES) return;
+
+    PageTableEntry& pml4e = _pml4->entries[getPML4Index(virt)];
+    PageTable* pdpt = getTable(pml4e);
+    if (!pdpt) return;
+
+    PageTableEntry& pdpte = pdpt->entries[getPDPTIndex(virt)];
+    PageTable* pd = getTable(pdpte);
+    if (!pd) return;
+
+    PageTableEntry& pde = pd->entries[getPDIndex(virt)];
+    if (pde.hasFlag(PTE_HUGE)) return;
+
+    // Empty tables are only unlinked here, the walker of another CPU may
+    // still hold them until the caller has flushed.
+    PageTable* pt = getTable(pde);
+    if (pt) {
+        if (!isTableEmpty(pt)) return;
+        pde.clear();
+        deferTable(pt, freed);
     }
+    if (!isTableEmpty(pd)) return;
+
+    pdpte.clear();
+    deferTable(pd, freed);
+    if (!isTableEmpty(pdpt)) return;
+
+    pml4e.clear();
+    deferTable(pdpt, freed);
+}
+
+void VMM::deferTable(PageTable* table, PageTable*& freed) {
+    // An empty table links the list through its first entry.
+    table->entries[0].value = reinterpret_cast<uint64_t>(freed);
+    freed = table;
+}
+
+void VMM::freeTables(PageTable* freed) {
+    while (freed) {
+        PageTable* next = reinterpret_cast<PageTable*>(freed->entries[0].value);
+        freed->entries[0].clear();
+        freeTable(freed);
+        freed = next;
+    }
+}
+
+bool VMM::isActive() const {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t pml4Phys = reinterpret_cast<uint64_t>(_pml4) - hhdm_request.response->offset;
+    return (cr3 & ~0xFFFULL) == pml4Phys;
+}
+
+void VMM::flushRange(void* virt, size_t count, bool shootdown) {
+    uint64_t start = reinterpret_cast<uint64_t>(virt);
+    
+    // The local flush and the shootdown, which skips this CPU, must happen
+    // on the same CPU. Interrupts rather than a preempt count, this also
+    // runs before the per-CPU block exists.
+    uint64_t flags = Spinlock::saveAndDisable();
+    
+    // User mappings of an inactive address space cannot be cached in this
+    // CPU's TLB, the kernel half is shared by every PML4 and always has to be flushed.
+    if (!isUser(virt) || isActive()) {
+        if (count > FLUSH_THRESHOLD && isUser(virt)) {
+            uint64_t cr3;
+            asm volatile("mov %%cr3, %0" : "=r"(cr3));
+            asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+            record(&VMStats::tlbFullFlushes);
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                asm volatile("invlpg (%0)" :: "r"(start + i * PAGE_SIZE) : "memory");
+            }
+            record(&VMStats::tlbFlushes);
+        }
+    }
+    
+    // Other CPUs running this address space may hold the same entries.
+    // New kernel mappings skip this, non-present entries are never cached.
+    uint64_t targets = isUser(virt) ? cpuMask : ~0ULL;
+    if (shootdown && SMP::get().shootdown(targets, start, count)) {
+        record(&VMStats::tlbShootdowns);
+    }
+    
+    Spinlock::restore(flags);
+}
+
+void VMM::flushPage(void* virt, bool shootdown) {
+    flushRange(virt, 1, shootdown);
+}
+
+void VMM::record(uint64_t VMStats::* counter) {
+    VMStats* targets[] = { &systemVMStats, stats };
+    for (VMStats* target : targets) {
+        if (target) __atomic_add_fetch(&(target->*counter), 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool VMM::map(void* virt, void* phys, uint64_t flags) {
+    if (!initialized) return false;
+
+    PageTable* pt = getLeafTable(virt, true, flags);
+    if (!pt) return false;
     
+    size_t ptIndex = getPTIndex(virt);
     pt->entries[ptIndex].setAddress(reinterpret_cast<uint64_t>(phys));
     pt->entries[ptIndex].setFlags(flags);
 
-    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    flushPage(virt, isUser(virt));
 
     return true;
 }
 
 bool VMM::mapRange(void* virt, void* phys, size_t count, uint64_t flags) {
+    if (!initialized) return false;
+
     uint64_t _virtual = reinterpret_cast<uint64_t>(virt);
     uint64_t physical = reinterpret_cast<uint64_t>(phys);
+    size_t done = 0;
+
+    // Walk the upper levels once per leaf table instead of once per page.
+    while (done < count) {
+        void* v = reinterpret_cast<void*>(_virtual + done * PAGE_SIZE);
+        PageTable* pt = getLeafTable(v, true, flags);
+        if (!pt) {
+            flushRange(virt, done, isUser(virt));
+            return false;
+        }
+        
+        size_t index = getPTIndex(v);
+        size_t batch = 512 - index;
+        if (batch > count - done) batch = count - done;
+        
+        for (size_t i = 0; i < batch; i++) {
+            PageTableEntry& entry = pt->entries[index + i];
+            entry.setAddress(physical + (done + i) * PAGE_SIZE);
+            entry.setFlags(flags);
+        }
+        
+        done += batch;
+    }
+
+    flushRange(virt, count, isUser(virt));
+    return true;
+}
+
+bool VMM::mapHuge(void* virt, void* phys, uint64_t flags) {
+    if (!initialized) return false;
 
-    for (size_t i = 0; i < count; i++) {
-        void* v = reinterpret_cast<void*>(_virtual + i * PAGE_SIZE);
-        void* p = reinterpret_cast<void*>(physical + i * PAGE_SIZE);
+    PageTable* pd = getDirectory(virt, true, flags);
+    if (!pd) return false;
 
-        if (!map(v, p, flags)) {
-            return false;
+    PageTableEntry& pde = pd->entries[getPDIndex(virt)];
+    PageTableEntry old = pde;
+
+    pde.clear();
+    pde.setAddress(reinterpret_cast<uint64_t>(phys));
+    pde.setFlags(flags | PTE_HUGE);
+    flushRange(virt, PAGES_PER_HUGE_PAGE);
+
+    // Whatever was mapped here before is replaced, as when collapsing a
+    // populated range of small pages.
+    if (old.hasFlag(PTE_PRESENT)) {
+        if (old.hasFlag(PTE_HUGE)) {
+            releaseHuge(old.getAddress());
+            if (isUser(virt)) hugePageStats.inUse--;
+        } else {
+            PageTable* pt = getTable(old);
+            for (size_t i = 0; i < 512; i++) {
+                if (pt->entries[i].hasFlag(PTE_PRESENT)) {
+                    pmm.release(reinterpret_cast<void*>(pt->entries[i].getAddress()));
+                }
+            }
+            freeTable(pt);
         }
     }
 
+    if (isUser(virt)) hugePageStats.inUse++;
     return true;
 }
 
 bool VMM::unmap(void* virt) {
     if (!initialized) return false;
 
-    size_t pml4Index = getPML4Index(virt);
-    size_t pdptIndex = getPDPTIndex(virt);
-    size_t pdIndex = getPDIndex(virt);
-    size_t ptIndex = getPTIndex(virt);
+    PageTable* pt = getLeafTable(virt, false, 0);
+    if (!pt) return false;
 
-    PageTable* pdpt = getTable(_pml4->entries[pml4Index]);
-    if (!pdpt) return false;
+    pt->entries[getPTIndex(virt)].clear();
 
-    PageTable* pd = getTable(pdpt->entries[pdptIndex]);
-    if (!pd) return false;
+    flushPage(virt);
 
-    PageTable* pt = getTable(pd->entries[pdIndex]);
-    if (!pt) return false;
+    return true;
+}
 
-    pt->entries[ptIndex].clear();
+bool VMM::unmapRange(void* virt, size_t count, bool releaseFrames) {
+    if (!initialized) return false;
 
-    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+    uint64_t _virtual = reinterpret_cast<uint64_t>(virt);
+    size_t done = 0;
+
+    // Entries are made non-present first and keep their frame under
+    // PTE_UNMAPPING, frames and tables are released only after every CPU
+    // has dropped the old translations.
+    while (done < count) {
+        void* v = reinterpret_cast<void*>(_virtual + done * PAGE_SIZE);
+        size_t index = getPTIndex(v);
+        size_t batch = 512 - index;
+        if (batch > count - done) batch = count - done;
+        
+        // A huge page covered completely goes in one step.
+        PageTableEntry* pde = getDirectoryEntry(v);
+        if (pde && pde->hasFlag(PTE_PRESENT) && pde->hasFlag(PTE_HUGE) && batch == PAGES_PER_HUGE_PAGE) {
+            pde->removeFlags(PTE_PRESENT);
+            pde->addFlags(PTE_UNMAPPING);
+            done += batch;
+            continue;
+        }
+        
+        // Holes in the range skip a whole leaf table at a time.
+        PageTable* pt = getLeafTable(v, false, 0);
+        if (pt) {
+            for (size_t i = 0; i < batch; i++) {
+                PageTableEntry& entry = pt->entries[index + i];
+                if (entry.hasFlag(PTE_PRESENT)) {
+                    entry.removeFlags(PTE_PRESENT);
+                    entry.addFlags(PTE_UNMAPPING);
+                }
+            }
+        }
+        
+        done += batch;
+    }
 
+    flushRange(virt, count);
+
+    PageTable* freed = nullptr;
+    done = 0;
+    while (done < count) {
+        void* v = reinterpret_cast<void*>(_virtual + done * PAGE_SIZE);
+        size_t index = getPTIndex(v);
+        size_t batch = 512 - index;
+        if (batch > count - done) batch = count - done;
+        
+        PageTableEntry* pde = getDirectoryEntry(v);
+        if (!pde) {
+            done += batch;
+            continue;
+        }
+        
+        if (pde->hasFlag(PTE_UNMAPPING)) {
+            if (releaseFrames) {
+                releaseHuge(pde->getAddress());
+            }
+            pde->clear();
+            if (isUser(v)) hugePageStats.inUse--;
+            pruneTables(v, freed);
+            done += batch;
+            continue;
+        }
+        
+        PageTable* pt = getLeafTable(v, false, 0);
+        if (pt) {
+            for (size_t i = 0; i < batch; i++) {
+                PageTableEntry& entry = pt->entries[index + i];
+                if (!entry.hasFlag(PTE_UNMAPPING)) continue;
+                if (releaseFrames) {
+                    pmm.release(reinterpret_cast<void*>(entry.getAddress()));
+                }
+                entry.clear();
+            }
+            pruneTables(v, freed);
+        }
+        
+        done += batch;
+    }
+
+    // Unlinking tables changed upper levels the walker caches as well.
+    if (freed) {
+        flushRange(virt, count);
+        freeTables(freed);
+    }
     return true;
 }
 
-bool VMM::unmapRange(void* virt, size_t count) {
+bool VMM::protectRange(void* virt, size_t count, uint64_t flags) {
+    if (!initialized) return false;
+
     uint64_t _virtual = reinterpret_cast<uint64_t>(virt);
+    size_t done = 0;
 
-    for (size_t i = 0; i < count; i++) {
-        void* v = reinterpret_cast<void*>(_virtual + i * PAGE_SIZE);
-        if (!unmap(v)) {
-            return false;
+    while (done < count) {
+        void* v = reinterpret_cast<void*>(_virtual + done * PAGE_SIZE);
+        size_t index = getPTIndex(v);
+        size_t batch = 512 - index;
+        if (batch > count - done) batch = count - done;
+        
+        PageTableEntry* pde = getDirectoryEntry(v);
+        if (pde && pde->hasFlag(PTE_PRESENT) && pde->hasFlag(PTE_HUGE) && batch == PAGES_PER_HUGE_PAGE) {
+            pde->setFlags(flags | PTE_HUGE);
+            done += batch;
+            continue;
         }
+        
+        PageTable* pt = getLeafTable(v, false, 0);
+        if (pt) {
+            for (size_t i = 0; i < batch; i++) {
+                PageTableEntry& entry = pt->entries[index + i];
+                if (entry.hasFlag(PTE_PRESENT)) {
+                    entry.setFlags(flags);
+                }
+            }
+        }
+        
+        done += batch;
     }
 
+    flushRange(virt, count);
     return true;
 }
 
 void* VMM::getPhysical(void* virt) {
     if (!initialized) return nullptr;
 
-    size_t pml4Index = getPML4Index(virt);
-    size_t pdptIndex = getPDPTIndex(virt);
-    size_t pdIndex = getPDIndex(virt);
-    size_t ptIndex = getPTIndex(virt);
-
-    PageTable* pdpt = getTable(_pml4->entries[pml4Index]);
-    if (!pdpt) return nullptr;
-
-    PageTable* pd = getTable(pdpt->entries[pdptIndex]);
-    if (!pd) return nullptr;
+    PageTableEntry* pde = getDirectoryEntry(virt);
+    if (pde && pde->hasFlag(PTE_PRESENT) && pde->hasFlag(PTE_HUGE)) {
+        return reinterpret_cast<void*>(pde->getAddress() + (reinterpret_cast<uint64_t>(virt) & (HUGE_PAGE_SIZE - 1)));
+    }
 
-    PageTable* pt = getTable(pd->entries[pdIndex]);
+    PageTable* pt = getLeafTable(virt, false, 0);
     if (!pt) return nullptr;
 
+    size_t ptIndex = getPTIndex(virt);
     if (!pt->entries[ptIndex].hasFlag(PTE_PRESENT)) {
         return nullptr;
     }
@@ -169,6 +502,43 @@ void* VMM::getPhysical(void* virt) {
     return reinterpret_cast<void*>(phys + offset);
 }
 
+bool VMM::copyTo(void* virt, const void* data, size_t size) {
+    uint64_t dest = reinterpret_cast<uint64_t>(virt);
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    while (size) {
+        void* phys = getPhysical(reinterpret_cast<void*>(dest));
+        if (!phys) return false;
+
+        size_t chunk = PAGE_SIZE - (dest & (PAGE_SIZE - 1));
+        if (chunk > size) chunk = size;
+
+        memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset), src, chunk);
+        dest += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+PageTableEntry* VMM::getEntry(void* virt) {
+    if (!initialized) return nullptr;
+
+    PageTable* pt = getLeafTable(virt, false, 0);
+    if (!pt) return nullptr;
+
+    return &pt->entries[getPTIndex(virt)];
+}
+
+PageTableEntry* VMM::getDirectoryEntry(void* virt) {
+    if (!initialized) return nullptr;
+
+    PageTable* pd = getDirectory(virt, false, 0);
+    if (!pd) return nullptr;
+
+    return &pd->entries[getPDIndex(virt)];
+}
+
 void VMM::load() {
     if (!initialized) return;
 
@@ -186,13 +556,57 @@ PageTable* VMM::getCurrentPageTable() {
 void VMM::cloneKernelMappings() {
     if (!initialized) return;
     
-    PageTable* kernelPML4 = getCurrentPageTable();
-    if (!kernelPML4) return;
-    
-    uint64_t kernelPML4Phys = (uint64_t)kernelPML4 - hhdm_request.response->offset;
-    PageTable* kernelPML4Virt = (PageTable*)((uint64_t)kernelPML4Phys + hhdm_request.response->offset);
+    // From the kernel's own tables, not whatever the caller runs on.
+    PageTable* kernelPML4Virt = ::vmm.getPageTable();
+    if (!kernelPML4Virt) return;
     
     for (int i = 256; i < 512; i++) {
         _pml4->entries[i] = kernelPML4Virt->entries[i];
     }
 }
+
+
+void VMM::destroy() {
+    if (!initialized) return;
+
+    // Never pull the tables out from under the CPU.
+    if (isActive()) {
+        ::vmm.load();
+    }
+
+    for (size_t i = 0; i < USER_PML4_ENTRIES; i++) {
+        PageTable* pdpt = getTable(_pml4->entries[i]);
+        if (!pdpt) continue;
+
+        for (int j = 0; j < 512; j++) {
+            PageTable* pd = getTable(pdpt->entries[j]);
+            if (!pd) continue;
+
+            for (int k = 0; k < 512; k++) {
+                if (pd->entries[k].hasFlag(PTE_PRESENT) && pd->entries[k].hasFlag(PTE_HUGE)) {
+                    releaseHuge(pd->entries[k].getAddress());
+                    hugePageStats.inUse--;
+                    continue;
+                }
+
+                PageTable* pt = getTable(pd->entries[k]);
+                if (!pt) continue;
+
+                // Shared frames only go back to the PMM with their last
+                // mapping; device memory has no count and is left alone.
+                for (int l = 0; l < 512; l++) {
+                    if (pt->entries[l].hasFlag(PTE_PRESENT)) {
+                        pmm.release(reinterpret_cast<void*>(pt->entries[l].getAddress()));
+                    }
+                }
+                freeTable(pt);
+            }
+            freeTable(pd);
+        }
+        freeTable(pdpt);
+    }
+
+    freeTable(_pml4);
+    _pml4 = nullptr;
+    initialized = false;
+}
\ No newline at end of file
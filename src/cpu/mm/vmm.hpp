@@ -2,6 +2,8 @@
 
 #include "pmm.hpp"
 #include "page.hpp"
+#include "vmstats.hpp"
+#include "layout.hpp"
 #include <cstdint>
 #include <cstddef>
 
@@ -14,8 +16,28 @@ constexpr uint64_t PTE_ACCESSED = (1ULL << 5);
 constexpr uint64_t PTE_DIRTY = (1ULL << 6);
 constexpr uint64_t PTE_HUGE = (1ULL << 7);
 constexpr uint64_t PTE_GLOBAL = (1ULL << 8);
+// Available to software: a non-present entry whose frame still waits for
+// the TLB flush that lets unmapRange release it.
+constexpr uint64_t PTE_UNMAPPING = (1ULL << 9);
 constexpr uint64_t PTE_NO_EXECUTE = (1ULL << 63);
 
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+constexpr size_t PAGES_PER_HUGE_PAGE = HUGE_PAGE_SIZE / PAGE_SIZE;
+
+// User space 2 MiB mappings; kernel huge pages set up by Limine are not counted.
+struct HugePageStats {
+    uint64_t inUse;
+    uint64_t faults;      // faults served with a whole huge page
+    uint64_t fallbacks;   // eligible faults that got 4 KiB pages instead
+    uint64_t collapses;   // populated 4 KiB ranges merged into a huge page
+    uint64_t splits;      // huge pages broken up by partial unmap/mprotect
+};
+
+extern HugePageStats hugePageStats;
+
+// initPAT turns PAT entry 1 (PWT set, PCD clear) into write-combining.
+constexpr uint64_t PTE_WRITE_COMBINING = PTE_WRITE_THROUGH;
+
 class VMM {
 public:
     VMM();
@@ -23,27 +45,66 @@ public:
 
     bool map(void* virt, void* phys, uint64_t flags = PTE_PRESENT | PTE_WRITABLE);
     bool mapRange(void* virt, void* phys, size_t count, uint64_t flags = PTE_PRESENT | PTE_WRITABLE);
+    bool mapHuge(void* virt, void* phys, uint64_t flags);
     
     bool unmap(void* virt);    
-    bool unmapRange(void* virt, size_t count);
+    bool unmapRange(void* virt, size_t count, bool releaseFrames = false);
+    bool protectRange(void* virt, size_t count, uint64_t flags);
     
     void* getPhysical(void* virt);
+    // Writes into this address space through the HHDM, whichever one is
+    // loaded. False if part of the range is not mapped.
+    bool copyTo(void* virt, const void* data, size_t size);
+    PageTableEntry* getEntry(void* virt);
+    PageTableEntry* getDirectoryEntry(void* virt);
     
     void load();
     
     static PageTable* getCurrentPageTable();
+    static void initPAT();
     
     void cloneKernelMappings();
+    void destroy();
     
     PageTable* getPageTable() const { return _pml4; }
+    void setStats(VMStats* stats) { this->stats = stats; }
     bool isInitialized() const { return initialized; }
     
+    // CPUs that may hold translations of this address space in their TLBs.
+    void markActive(uint32_t cpu) { __atomic_or_fetch(&cpuMask, 1ULL << cpu, __ATOMIC_SEQ_CST); }
+    void markInactive(uint32_t cpu) { __atomic_and_fetch(&cpuMask, ~(1ULL << cpu), __ATOMIC_SEQ_CST); }
+    
+    static bool isUser(void* virt) { return reinterpret_cast<uint64_t>(virt) < KERNEL_SPACE_BASE; }
+    
+    // Above this many pages a full CR3 reload is cheaper than invlpg per page.
+    static constexpr size_t FLUSH_THRESHOLD = 32;
+    
 private:
     PageTable* _pml4;
     bool initialized;
+    VMStats* stats;
+    volatile uint64_t cpuMask;
     
     PageTable* getOrCreateTable(PageTableEntry& entry);    
     PageTable* getTable(PageTableEntry& entry);
+    PageTable* getDirectory(void* virt, bool create, uint64_t flags);
+    PageTable* getLeafTable(void* virt, bool create, uint64_t flags);
+    bool splitHuge(PageTableEntry& pde, void* virt);
+    
+    bool isActive() const;
+    void flushRange(void* virt, size_t count, bool shootdown = true);
+    void flushPage(void* virt, bool shootdown = true);
+    void record(uint64_t VMStats::* counter);
+    void pruneTables(void* virt, PageTable*& freed);
+    
+    static bool isTableEmpty(PageTable* table);
+    static void freeTable(PageTable* table);
+    static void deferTable(PageTable* table, PageTable*& freed);
+    static void freeTables(PageTable* freed);
+    static void releaseHuge(uint64_t phys);
+    
+    // PML4 slots below this index map user space and belong to one process.
+    static constexpr size_t USER_PML4_ENTRIES = 256;
     
     static size_t getPML4Index(void* virt) { return (reinterpret_cast<uint64_t>(virt) >> 39) & 0x1FF; }
     static size_t getPDPTIndex(void* virt) { return (reinterpret_cast<uint64_t>(virt) >> 30) & 0x1FF; }
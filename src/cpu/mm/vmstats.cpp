@@ -0,0 +1,51 @@
+#include "vmstats.hpp"
+#include <cpu/cereal/cereal.hpp>
+
+VMStats systemVMStats;
+
+static size_t latencyBucket(uint64_t cycles) {
+    size_t bucket = 0;
+    cycles >>= FAULT_LATENCY_SHIFT;
+    while (cycles && bucket < FAULT_LATENCY_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void VMStatistics::recordFault(VMStats* stats, uint64_t cycles, bool resolved) {
+    VMStats* targets[] = { &systemVMStats, stats };
+    size_t bucket = latencyBucket(cycles);
+
+    for (VMStats* target : targets) {
+        if (!target) continue;
+
+        if (!resolved) {
+            __atomic_add_fetch(&target->failedFaults, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_add_fetch(&target->faultCycles, cycles, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&target->faultLatency[bucket], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void VMStatistics::dump(const char* label, const VMStats* stats) {
+    if (!stats) return;
+
+    Cereal& serial = Cereal::get();
+    serial.write("[VMSTATS] ");
+    serial.write(label);
+    serial.write("\n");
+
+    serial.writeField("minor faults", stats->minorFaults);
+    serial.writeField("major faults", stats->majorFaults);
+    serial.writeField("zero-fill faults", stats->zeroFillFaults);
+    serial.writeField("cow breaks", stats->cowBreaks);
+    serial.writeField("failed faults", stats->failedFaults);
+    serial.writeField("tlb flushes", stats->tlbFlushes);
+    serial.writeField("tlb full flushes", stats->tlbFullFlushes);
+    serial.writeField("tlb shootdowns", stats->tlbShootdowns);
+    serial.writeField("fault cycles", stats->faultCycles);
+
+    serial.writeHistogram(stats->faultLatency, FAULT_LATENCY_BUCKETS, FAULT_LATENCY_SHIFT);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Bucket i counts faults that took fewer than 2^(i + 8) TSC cycles, the last
+// bucket takes everything slower.
+constexpr size_t FAULT_LATENCY_BUCKETS = 16;
+constexpr size_t FAULT_LATENCY_SHIFT = 8;
+
+struct VMStats {
+    uint64_t minorFaults;       // resolved from memory already at hand
+    uint64_t majorFaults;       // had to read file contents
+    uint64_t zeroFillFaults;
+    uint64_t cowBreaks;
+    uint64_t failedFaults;      // not backed by any mapping, become SIGSEGV
+    uint64_t tlbFlushes;        // invlpg batches
+    uint64_t tlbFullFlushes;    // CR3 reloads in place of invlpg
+    uint64_t tlbShootdowns;     // flushes that had to interrupt other CPUs
+    uint64_t faultCycles;
+    uint64_t faultLatency[FAULT_LATENCY_BUCKETS];
+};
+
+// sys_vmstats flag: also print the counters on the serial port.
+constexpr uint64_t VMSTATS_DUMP = 0x1;
+
+extern VMStats systemVMStats;
+
+namespace VMStatistics {
+    void recordFault(VMStats* stats, uint64_t cycles, bool resolved);
+    void dump(const char* label, const VMStats* stats);
+}
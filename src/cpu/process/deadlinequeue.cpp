@@ -0,0 +1,100 @@
+#include "deadlinequeue.hpp"
+#include "thread.hpp"
+
+bool DeadlineQueue::earlier(Thread* a, Thread* b) {
+    return a->getDeadlineEntity()->absDeadline < b->getDeadlineEntity()->absDeadline;
+}
+
+// Behind every thread with the same deadline, so they take turns.
+void DeadlineQueue::insert(Thread* thread) {
+    Thread** link = &head;
+    while (*link && !earlier(thread, *link)) {
+        link = &(*link)->runNext;
+    }
+    thread->runNext = *link;
+    *link = thread;
+
+    thread->getDeadlineEntity()->queued = true;
+    count++;
+}
+
+void DeadlineQueue::remove(Thread* thread) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    if (!dl->queued) return;
+
+    Thread** link = &head;
+    while (*link && *link != thread) {
+        link = &(*link)->runNext;
+    }
+    if (*link) {
+        *link = thread->runNext;
+        count--;
+    }
+    thread->runNext = nullptr;
+    dl->queued = false;
+}
+
+Thread* DeadlineQueue::first() const {
+    for (Thread* thread = head; thread; thread = thread->runNext) {
+        if (!thread->getDeadlineEntity()->throttled) return thread;
+    }
+    return nullptr;
+}
+
+void DeadlineQueue::startJob(Thread* thread, uint64_t now) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    dl->absDeadline = now + dl->deadline;
+    dl->remaining = dl->runtime;
+}
+
+void DeadlineQueue::wakeup(Thread* thread, uint64_t now) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    if (dl->throttled) return;
+
+    if (dl->absDeadline <= now || dl->remaining <= 0 ||
+        static_cast<uint64_t>(dl->remaining) * dl->deadline > (dl->absDeadline - now) * dl->runtime) {
+        startJob(thread, now);
+    }
+}
+
+// A job still running at its deadline has missed it and the next one starts
+// right away. A job out of budget waits for its next period, unless that
+// has already begun.
+bool DeadlineQueue::charge(Thread* thread, uint64_t ns, uint64_t now) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    dl->remaining -= static_cast<int64_t>(ns);
+
+    bool late = now >= dl->absDeadline;
+    if (late) dl->missed++;
+
+    if (dl->remaining > 0) {
+        if (late) startJob(thread, now);
+        return false;
+    }
+
+    dl->throttles++;
+    if (nextPeriod(thread) <= now) {
+        replenish(thread, now);
+        return false;
+    }
+    dl->throttled = true;
+    return true;
+}
+
+uint64_t DeadlineQueue::nextPeriod(Thread* thread) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    return dl->absDeadline - dl->deadline + dl->period;
+}
+
+// Any overrun is paid back from the following periods.
+void DeadlineQueue::replenish(Thread* thread, uint64_t now) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    while (dl->remaining <= 0) {
+        dl->absDeadline += dl->period;
+        dl->remaining += dl->runtime;
+    }
+    if (dl->absDeadline <= now) {
+        startJob(thread, now);
+    }
+    dl->throttled = false;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+class Thread;
+
+// Reservations are limited to what the timer wheel can replenish on time
+// and to products that fit in 64 bits.
+constexpr uint64_t DEADLINE_MIN_RUNTIME_NS = 100000;
+constexpr uint64_t DEADLINE_MAX_PERIOD_NS = 1000000000;
+
+// Admitted bandwidth per CPU, in fractions of 1 << DEADLINE_BW_SHIFT. The
+// rest is left to the other classes.
+constexpr uint64_t DEADLINE_BW_SHIFT = 20;
+constexpr uint64_t DEADLINE_BW_LIMIT = (95ULL << DEADLINE_BW_SHIFT) / 100;
+
+// What SchedDeadlineInfo reports about a thread. The counters keep going
+// across changes of its reservation.
+struct DeadlineInfo {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;     // all 0 outside the deadline class
+    uint64_t missed;
+    uint64_t throttles;
+};
+
+// Runnable deadline class threads of one CPU, earliest absolute deadline
+// first. Throttled threads stay queued but are skipped until replenished.
+// Not locked itself, the owning RunQueue is.
+class DeadlineQueue {
+public:
+    DeadlineQueue() : head(nullptr), count(0) {}
+
+    void insert(Thread* thread);
+    void remove(Thread* thread);
+    Thread* first() const;
+
+    size_t size() const { return count; }
+
+    // Constant bandwidth server rules. A woken thread keeps its job only if
+    // the budget left still fits its reserved bandwidth until the deadline.
+    static void wakeup(Thread* thread, uint64_t now);
+    // Returns true when the budget ran out and the thread has to wait for
+    // nextPeriod().
+    static bool charge(Thread* thread, uint64_t ns, uint64_t now);
+    static void replenish(Thread* thread, uint64_t now);
+    static uint64_t nextPeriod(Thread* thread);
+
+    static bool earlier(Thread* a, Thread* b);
+
+private:
+    Thread* head;
+    size_t count;
+
+    static void startJob(Thread* thread, uint64_t now);
+};
@@ -1,57 +1,54 @@
 #include "exec.hpp"
 #include "../mm/pmm.hpp"
-#include "../gdt/gdt.hpp"
-#include "../syscall/syscall.hpp"
 #include <x86_64/requests.hpp>
 #include <string.h>
 #include <fs/vfs/vfs.hpp>
 #include <fs/elf/elf.hpp>
 
-Process* ProcessExecutor::createKernelProcess(void (*entry)()) {
+Process* ProcessExecutor::createKernelProcess(KernelEntry entry, void* arg) {
     uint32_t pid = Scheduler::get().allocatePID();
-    Process* proc = new Process(pid);
+    if (!pid) return nullptr;
+    Process* proc = Process::create(pid);
+    if (!proc) return nullptr;
     
-    uint64_t stack = proc->getKernelStack();
-    stack &= ~0xFULL;
-    stack -= 8;
+    // Kernel work is never limited, whoever started it.
+    ResourceGroups::get().attach(proc, ResourceGroups::get().getRoot());
+    proc->getMainThread()->setKernelEntry(entry, arg);
     
-    proc->getContext()->rip = reinterpret_cast<uint64_t>(entry);
-    proc->getContext()->rsp = stack;
-    proc->getContext()->rbp = 0;
-    proc->getContext()->rflags = 0x202;
+    return proc;
+}
+
+Process* ProcessExecutor::createKernelThread(KernelEntry entry, void* arg, int cpu) {
+    Process* proc = createKernelProcess(entry, arg);
+    if (!proc) return nullptr;
     
+    if (cpu >= 0) proc->setAffinity(1ULL << cpu);
+    Scheduler::get().addProcess(proc);
     return proc;
 }
 
 Process* ProcessExecutor::createUserProcess(uint64_t entry) {
     uint32_t pid = Scheduler::get().allocatePID();
-    Process* proc = new Process(pid);
+    if (!pid) return nullptr;
+    Process* proc = Process::create(pid);
+    if (!proc) return nullptr;
     
-    uint64_t stack = proc->getUserStack();
-    stack &= ~0xFULL;
-    
-    proc->getContext()->rip = entry;
-    proc->getContext()->rsp = stack;
-    proc->getContext()->rbp = 0;
-    proc->getContext()->rflags = 0x202;
+    proc->getMainThread()->setUserStack(proc->getMainThread()->getUserStack() & ~0xFULL);
+    proc->getMainThread()->setEntry(entry);
     
     return proc;
 }
 
-void ProcessExecutor::executeUserProcess(Process* proc, GDT* gdt) {
-    proc->jumpToUsermode(proc->getContext()->rip, gdt);
-}
-
 constexpr uint64_t USER_CODE_BASE = 0x400000;
 
-extern "C" void processTrampoline();
-
-Process* ProcessExecutor::createUserProcessWithCode(void* code, size_t codeSize) {
+Process* ProcessExecutor::createUserProcessWithCode(void* code, size_t codeSize, size_t stackSize) {
     uint32_t pid = Scheduler::get().allocatePID();
+    if (!pid) return nullptr;
     
-    Process* proc = new Process(pid);
+    Process* proc = Process::create(pid, stackSize);
+    if (!proc) return nullptr;
     size_t pages = (codeSize + PAGE_SIZE - 1) / PAGE_SIZE;
-    void* codePhys = pmm.allocatePages(pages);
+    void* codePhys = pmm.allocatePagesFor(proc->getGroup(), pages);
     
     if (codePhys) {
         uint64_t codeVirt = reinterpret_cast<uint64_t>(codePhys) + hhdm_request.response->offset;
@@ -62,27 +59,18 @@ Process* ProcessExecutor::createUserProcessWithCode(void* code, size_t codeSize)
         proc->getVMM()->mapRange(reinterpret_cast<void*>(USER_CODE_BASE), codePhys, pages, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
     }
     
-    uint64_t userStack = proc->getUserStack();
-    userStack &= ~0xFULL;
-
-    uint64_t entry = USER_CODE_BASE;
-    uint64_t trampolineAddr = reinterpret_cast<uint64_t>(&processTrampoline);
-    
-    uint64_t kernelStack = proc->getKernelStack();
-    kernelStack -= 8;
-    *reinterpret_cast<uint64_t*>(kernelStack) = userStack;
-    kernelStack -= 8;
-    *reinterpret_cast<uint64_t*>(kernelStack) = entry;
-    
-    proc->getContext()->rip = trampolineAddr;
-    proc->getContext()->rsp = kernelStack;
-    proc->getContext()->rbp = 0;
-    proc->getContext()->rflags = 0x202;
+    proc->getMainThread()->setUserStack(proc->getMainThread()->getUserStack() & ~0xFULL);
+    proc->getMainThread()->setEntry(USER_CODE_BASE);
     
     return proc;
 }
 
+// ELF images come from the exec cache; flat binaries and ELFs it cannot
+// hold are still read whole and loaded from the buffer.
 Process* ProcessExecutor::loadUserBinary(const char* path) {
+    Process* cached = nullptr;
+    if (ELFLoader::loadCached(path, &cached)) return cached;
+
     FileDescriptor* fd = nullptr;
     int result = VFS::get().open(path, 0, &fd);
     
@@ -122,7 +110,7 @@ Process* ProcessExecutor::loadUserBinary(const char* path) {
 void ProcessExecutor::setupArguments(Process* proc, int argc, const char** argv) {
     if (!proc || argc < 0) return;
     
-    uint64_t userStack = proc->getUserStack();
+    uint64_t userStack = proc->getMainThread()->getUserStack();
     userStack &= ~0xFULL;
     
     size_t totalStringSize = 0;
@@ -138,6 +126,10 @@ void ProcessExecutor::setupArguments(Process* proc, int argc, const char** argv)
     userStack -= totalSize;
     userStack &= ~0xFULL;
     
+    // The stack is populated lazily, and the arguments are written through
+    // the HHDM without switching to the new address space.
+    if (!proc->getVMAs()->populate(userStack, totalSize)) return;
+    
     uint8_t* buffer = new uint8_t[totalSize];
     if (!buffer) return;
     memset(buffer, 0, totalSize);
@@ -162,26 +154,15 @@ void ProcessExecutor::setupArguments(Process* proc, int argc, const char** argv)
     uint64_t* argcPtr = reinterpret_cast<uint64_t*>(buffer);
     *argcPtr = argc;
     
-    uint64_t savedCR3;
-    asm volatile("mov %%cr3, %0" : "=r"(savedCR3));
-    
-    proc->getVMM()->load();
-    
-    memcpy(reinterpret_cast<void*>(userStack), buffer, totalSize);
-    
-    asm volatile("mov %0, %%cr3" :: "r"(savedCR3) : "memory");
+    bool copied = proc->getVMM()->copyTo(reinterpret_cast<void*>(userStack), buffer, totalSize);
     
     delete[] buffer;
     
-    proc->setUserStack(userStack);
-   
-    uint64_t* userRspOnStack = reinterpret_cast<uint64_t*>(proc->getContext()->rsp + 8);
-    uint64_t oldValue = *userRspOnStack;
-    *userRspOnStack = userStack;
+    if (copied) proc->getMainThread()->setUserStack(userStack);
 }
 
-Process* ProcessExecutor::createUserProcessWithArgs(void* code, size_t codeSize, int argc, const char** argv) {
-    Process* proc = createUserProcessWithCode(code, codeSize);
+Process* ProcessExecutor::createUserProcessWithArgs(void* code, size_t codeSize, int argc, const char** argv, size_t stackSize) {
+    Process* proc = createUserProcessWithCode(code, codeSize, stackSize);
     
     if (proc) {
         setupArguments(proc, argc, argv);
@@ -189,7 +170,10 @@ Process* ProcessExecutor::createUserProcessWithArgs(void* code, size_t codeSize,
     return proc;
 }
 
-Process* ProcessExecutor::loadUserBinaryWithArgs(const char* path, int argc, const char** argv) {
+Process* ProcessExecutor::loadUserBinaryWithArgs(const char* path, int argc, const char** argv, size_t stackSize) {
+    Process* cached = nullptr;
+    if (ELFLoader::loadCached(path, &cached, argc, argv, stackSize)) return cached;
+
     FileDescriptor* fd = nullptr;
     int result = VFS::get().open(path, 0, &fd);
     
@@ -216,9 +200,9 @@ Process* ProcessExecutor::loadUserBinaryWithArgs(const char* path, int argc, con
     
     Process* proc = nullptr;
     if (ELFLoader::isValidELF(buffer, size)) {
-        proc = ELFLoader::loadELFWithArgs(buffer, size, argc, argv);
+        proc = ELFLoader::loadELFWithArgs(buffer, size, argc, argv, stackSize);
     } else {
-        proc = createUserProcessWithArgs(buffer, size, argc, argv);
+        proc = createUserProcessWithArgs(buffer, size, argc, argv, stackSize);
     }
     
     delete[] static_cast<uint8_t*>(buffer);
@@ -3,19 +3,18 @@
 #include "process.hpp"
 #include "scheduler.hpp"
 
-class GDT;
-
 class ProcessExecutor {
 public:
-    static Process* createKernelProcess(void (*entry)());
+    static Process* createKernelProcess(KernelEntry entry, void* arg = nullptr);
+    // Creates and starts a kernel task, bound to cpu unless it is -1. It
+    // exits when entry returns.
+    static Process* createKernelThread(KernelEntry entry, void* arg, int cpu = -1);
     static Process* createUserProcess(uint64_t entry);
-    static Process* createUserProcessWithCode(void* code, size_t codeSize);
-    static Process* createUserProcessWithArgs(void* code, size_t codeSize, int argc, const char** argv);
+    static Process* createUserProcessWithCode(void* code, size_t codeSize, size_t stackSize = 0);
+    static Process* createUserProcessWithArgs(void* code, size_t codeSize, int argc, const char** argv, size_t stackSize = 0);
     static Process* loadUserBinary(const char* path);
-    static Process* loadUserBinaryWithArgs(const char* path, int argc, const char** argv);
-    static void executeUserProcess(Process* proc, GDT* gdt);
+    static Process* loadUserBinaryWithArgs(const char* path, int argc, const char** argv, size_t stackSize = 0);
     
 private:
-    static void kernelProcessWrapper();
     static void setupArguments(Process* proc, int argc, const char** argv);
 };
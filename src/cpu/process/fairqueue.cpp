@@ -0,0 +1,106 @@
+#include "fairqueue.hpp"
+#include "thread.hpp"
+
+struct FairTraits {
+    static AVLNode<Thread>* node(Thread* thread) { return &thread->getSchedEntity()->tree; }
+    static uint64_t key(Thread* thread) { return thread->getSchedEntity()->vruntime; }
+};
+
+using FairTree = AVLTree<Thread, FairTraits>;
+
+// Each nice level is worth about 10% of CPU time against its neighbour.
+static const uint32_t niceWeights[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+uint32_t FairQueue::weightOf(int nice) {
+    if (nice < NICE_MIN) nice = NICE_MIN;
+    if (nice > NICE_MAX) nice = NICE_MAX;
+    return niceWeights[nice - NICE_MIN];
+}
+
+void FairQueue::insert(Thread* thread) {
+    SchedEntity* se = thread->getSchedEntity();
+    se->weight = weightOf(thread->getNice());
+
+    root = FairTree::insert(root, thread);
+    if (!leftmost || se->vruntime < leftmost->getSchedEntity()->vruntime) {
+        leftmost = thread;
+    }
+
+    count++;
+    totalWeight += se->weight;
+}
+
+Thread* FairQueue::popFirst() {
+    if (!root) return nullptr;
+
+    Thread* thread = nullptr;
+    root = FairTree::removeMin(root, &thread);
+    leftmost = FairTree::first(root);
+
+    count--;
+    totalWeight -= thread->getSchedEntity()->weight;
+    return thread;
+}
+
+void FairQueue::remove(Thread* thread) {
+    bool found = false;
+    root = FairTree::remove(root, thread, &found);
+    if (!found) return;
+
+    leftmost = FairTree::first(root);
+    count--;
+    totalWeight -= thread->getSchedEntity()->weight;
+}
+
+Thread* FairQueue::firstAllowedOn(uint32_t cpu) const {
+    if (leftmost && leftmost->canRunOn(cpu)) return leftmost;
+    return findAllowed(root, cpu);
+}
+
+void FairQueue::updateMin(Thread* current) {
+    uint64_t candidate = minVruntime;
+    bool found = false;
+
+    if (current && current->getPolicy() == SchedPolicy::Fair) {
+        candidate = current->getSchedEntity()->vruntime;
+        found = true;
+    }
+    if (leftmost) {
+        uint64_t first = leftmost->getSchedEntity()->vruntime;
+        if (!found || first < candidate) candidate = first;
+        found = true;
+    }
+
+    if (found && candidate > minVruntime) {
+        minVruntime = candidate;
+    }
+}
+
+uint64_t FairQueue::sliceFor(Thread* thread) const {
+    uint64_t running = count + 1;
+    uint64_t period = SCHED_LATENCY_NS;
+    if (running * SCHED_MIN_GRANULARITY_NS > period) {
+        period = running * SCHED_MIN_GRANULARITY_NS;
+    }
+
+    uint32_t weight = weightOf(thread->getNice());
+    uint64_t slice = period * weight / (totalWeight + weight);
+    return slice < SCHED_MIN_GRANULARITY_NS ? SCHED_MIN_GRANULARITY_NS : slice;
+}
+
+Thread* FairQueue::findAllowed(Thread* node, uint32_t cpu) {
+    if (!node) return nullptr;
+
+    if (Thread* thread = findAllowed(FairTree::left(node), cpu)) return thread;
+    if (node->canRunOn(cpu)) return node;
+    return findAllowed(FairTree::right(node), cpu);
+}
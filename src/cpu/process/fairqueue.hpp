@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+class Thread;
+
+constexpr uint32_t NICE_0_WEIGHT = 1024;
+
+// Every runnable fair thread gets a turn within the target latency, as
+// long as that leaves each of them at least the minimum granularity.
+constexpr uint64_t SCHED_LATENCY_NS = 20000000;
+constexpr uint64_t SCHED_MIN_GRANULARITY_NS = 2000000;
+constexpr uint64_t SCHED_WAKEUP_GRANULARITY_NS = 1000000;
+
+// Runnable fair class threads of one CPU in an AVL tree ordered by
+// virtual runtime. Not locked itself, the owning RunQueue is.
+class FairQueue {
+public:
+    FairQueue() : root(nullptr), leftmost(nullptr), count(0), totalWeight(0), minVruntime(0) {}
+
+    void insert(Thread* thread);
+    Thread* popFirst();
+    Thread* first() const { return leftmost; }
+    void remove(Thread* thread);
+
+    // Smallest vruntime among the threads allowed on cpu.
+    Thread* firstAllowedOn(uint32_t cpu) const;
+
+    size_t size() const { return count; }
+    uint64_t getTotalWeight() const { return totalWeight; }
+    uint64_t getMinVruntime() const { return minVruntime; }
+
+    // Moves minVruntime forward to the smallest vruntime on the CPU,
+    // counting the running thread, and never backwards.
+    void updateMin(Thread* current);
+
+    // Slice for thread out of one latency period shared by the queue and it.
+    uint64_t sliceFor(Thread* thread) const;
+
+    static uint32_t weightOf(int nice);
+    static uint64_t scale(uint64_t ns, uint32_t weight) { return ns * NICE_0_WEIGHT / weight; }
+
+private:
+    Thread* root;
+    Thread* leftmost;
+    size_t count;
+    uint64_t totalWeight;
+    uint64_t minVruntime;
+
+    static Thread* findAllowed(Thread* node, uint32_t cpu);
+};
@@ -0,0 +1,100 @@
+#include "pidtable.hpp"
+#include "thread.hpp"
+
+PIDTable::PIDTable() : last(0), used(0) {
+    for (uint32_t i = 0; i < PID_MAX / PID_LEAF_SIZE; i++) {
+        leaves[i] = nullptr;
+    }
+    for (uint32_t i = 0; i < PID_MAX / 64; i++) {
+        bitmap[i] = 0;
+    }
+    bitmap[0] = 1;
+}
+
+// PIDs go round instead of reusing the lowest free one, so a PID that was
+// just released is not immediately somebody else's.
+uint32_t PIDTable::allocate() {
+    lock.lock();
+    if (used == PID_MAX - 1) {
+        lock.unlock();
+        return 0;
+    }
+
+    uint32_t pid = last + 1 < PID_MAX ? last + 1 : 1;
+    for (;;) {
+        uint32_t word = pid / 64;
+        uint64_t free = ~bitmap[word] & (~0ULL << (pid % 64));
+        if (free) {
+            pid = word * 64 + __builtin_ctzll(free);
+            break;
+        }
+        pid = (word + 1) * 64;
+        if (pid >= PID_MAX) pid = 0;
+    }
+
+    bitmap[pid / 64] |= 1ULL << (pid % 64);
+    last = pid;
+    used++;
+    lock.unlock();
+
+    ensureLeaf(pid);
+    return pid;
+}
+
+// Leaves are allocated here rather than in insert(), outside the lock, and
+// never freed; all of them together are only 64 pages.
+void PIDTable::ensureLeaf(uint32_t pid) {
+    Thread*** slot = &leaves[pid >> PID_LEAF_BITS];
+    if (__atomic_load_n(slot, __ATOMIC_ACQUIRE)) return;
+
+    Thread** leaf = new Thread*[PID_LEAF_SIZE];
+    for (uint32_t i = 0; i < PID_LEAF_SIZE; i++) {
+        leaf[i] = nullptr;
+    }
+
+    Thread** expected = nullptr;
+    if (!__atomic_compare_exchange_n(slot, &expected, leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        delete[] leaf;
+    }
+}
+
+void PIDTable::release(uint32_t pid) {
+    if (pid == 0 || pid >= PID_MAX) return;
+
+    LockGuard guard(lock);
+    uint64_t bit = 1ULL << (pid % 64);
+    if (!(bitmap[pid / 64] & bit)) return;
+
+    bitmap[pid / 64] &= ~bit;
+    used--;
+}
+
+void PIDTable::insert(Thread* thread) {
+    uint32_t pid = thread->getTID();
+    if (pid == 0 || pid >= PID_MAX) return;
+
+    LockGuard guard(lock);
+    Thread** leaf = leaves[pid >> PID_LEAF_BITS];
+    if (leaf) leaf[pid & (PID_LEAF_SIZE - 1)] = thread;
+}
+
+void PIDTable::remove(Thread* thread) {
+    uint32_t pid = thread->getTID();
+    if (pid == 0 || pid >= PID_MAX) return;
+
+    LockGuard guard(lock);
+    Thread** leaf = leaves[pid >> PID_LEAF_BITS];
+    if (leaf && leaf[pid & (PID_LEAF_SIZE - 1)] == thread) {
+        leaf[pid & (PID_LEAF_SIZE - 1)] = nullptr;
+    }
+}
+
+Thread* PIDTable::lookup(uint32_t pid) {
+    if (pid == 0 || pid >= PID_MAX) return nullptr;
+
+    LockGuard guard(lock);
+    Thread** leaf = leaves[pid >> PID_LEAF_BITS];
+    Thread* thread = leaf ? leaf[pid & (PID_LEAF_SIZE - 1)] : nullptr;
+    if (thread) thread->hold();
+    return thread;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+class Thread;
+
+// IDs run from 1 to PID_MAX - 1; 0 belongs to the idle tasks.
+constexpr uint32_t PID_MAX = 32768;
+constexpr uint32_t PID_LEAF_BITS = 9;
+constexpr uint32_t PID_LEAF_SIZE = 1 << PID_LEAF_BITS;
+
+// Maps IDs to threads through a two level radix tree, with a bitmap of the
+// IDs in use. Threads and processes share the ID space, a process's PID is
+// the TID of its main thread. An ID is reserved by allocate() before its
+// thread exists, gets the thread with insert() once it is started and stays
+// reserved after remove() until release(), when the thread (or for a PID,
+// the process) is freed, so it is never handed out again while anything may
+// still hold the old one.
+class PIDTable {
+public:
+    PIDTable();
+
+    // Next free PID after the last one handed out, or 0 when all are taken.
+    uint32_t allocate();
+    void release(uint32_t pid);
+
+    void insert(Thread* thread);
+    void remove(Thread* thread);
+    // The thread comes with a reference held, see Thread::hold().
+    Thread* lookup(uint32_t pid);
+
+    size_t size() const { return used; }
+
+private:
+    Spinlock lock;
+    Thread** leaves[PID_MAX / PID_LEAF_SIZE];
+    uint64_t bitmap[PID_MAX / 64];
+    uint32_t last;
+    size_t used;
+
+    void ensureLeaf(uint32_t pid);
+};
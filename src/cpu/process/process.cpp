@@ -1,155 +1,214 @@
 #include "process.hpp"
 #include <cpu/mm/pmm.hpp>
 #include <x86_64/requests.hpp>
-#include <cpu/gdt/gdt.hpp>
-#include <cpu/syscall/syscall.hpp>
-#include <graphics/console.hpp>
-
-extern Console* console;
-extern "C" void enterUsermode(uint64_t entry, uint64_t stack);
+#include <cpu/process/scheduler.hpp>
+#include <fs/vfs/vfs.hpp>
 
 constexpr uint64_t USER_STACK_TOP = 0x00007FFFFFFFE000;  // Top of canonical user space
-constexpr size_t USER_STACK_PAGES = 4;
 
-Process::Process(uint32_t pid) : pid(pid), parentPID(0), next(nullptr), exitCode(0), state(ProcessState::Ready), kernelStack(0), userStack(0), fpuState(nullptr), validUserState(false) {
+Process::Process(uint32_t pid, size_t stackSize) : pid(pid), parentPID(0), exitCode(0), exiting(false), affinity(~0ULL), schedStats{}, group(nullptr), mainThread(nullptr), threads(nullptr), threadCount(0), liveThreads(0) {
     for (int i = 0; i < NSIG; i++) {
         signalHandler.handlers[i] = nullptr;
     }
-    signalHandler.pending = 0;
-    signalHandler.blocked = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        files[i] = nullptr;
+    }
     vmm.init();
     vmm.cloneKernelMappings();
-    
-    void* kstackPhys = pmm.allocatePages(4);
-    if (kstackPhys) {
-        uint64_t kstackVirt = reinterpret_cast<uint64_t>(kstackPhys) + hhdm_request.response->offset;
-        kernelStack = kstackVirt + (4 * PAGE_SIZE);
-        if (console) {
-            console->drawText("[PROCESS] PID=");
-            console->drawNumber(pid);
-            console->drawText(" KernelStack=");
-            console->drawHex(kernelStack);
-            console->drawText("\n");
-        }
+    vmas.init(&vmm);
+
+    Process* creator = Scheduler::get().getCurrentProcess();
+    ResourceGroups::get().attach(this, creator ? creator->getGroup() : ResourceGroups::get().getRoot());
+
+    mainThread = createThread(pid);
+    if (!mainThread) return;
+
+    // The stack is only reserved here and faulted in as it grows. The
+    // PROT_NONE page below it turns an overflow into a fault instead of a
+    // silent write into whatever is mapped underneath.
+    if (stackSize == 0 || stackSize > MAX_USER_STACK_SIZE) {
+        stackSize = DEFAULT_USER_STACK_SIZE;
     }
-    
-    void* ustackPhys = pmm.allocatePages(USER_STACK_PAGES);
-    if (ustackPhys) {
-        uint64_t ustackBase = USER_STACK_TOP - (USER_STACK_PAGES * PAGE_SIZE);
-        vmm.mapRange(reinterpret_cast<void*>(ustackBase), ustackPhys, USER_STACK_PAGES, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-        userStack = USER_STACK_TOP - 8;  // Start 8 bytes below top (inside mapped region)
-    }
-    
-    void* fpuPhys = pmm.allocatePage();
-    if (fpuPhys) {
-        fpuState = reinterpret_cast<FPUState*>(reinterpret_cast<uint64_t>(fpuPhys) + hhdm_request.response->offset);
-    }
-    
-    context.rax = 0;
-    context.rbx = 0;
-    context.rcx = 0;
-    context.rdx = 0;
-    context.rsi = 0;
-    context.rdi = 0;
-    context.rbp = 0;
-    context.rsp = kernelStack;
-    context.r8 = 0;
-    context.r9 = 0;
-    context.r10 = 0;
-    context.r11 = 0;
-    context.r12 = 0;
-    context.r13 = 0;
-    context.r14 = 0;
-    context.r15 = 0;
-    context.rip = 0;
-    context.rflags = 0x202;
-    
-    uint64_t pml4Virt = reinterpret_cast<uint64_t>(vmm.getPageTable());
-    uint64_t pml4Phys = pml4Virt - hhdm_request.response->offset;
-    context.cr3 = pml4Phys;
-    
-    context.fxstate = reinterpret_cast<uint64_t>(fpuState);
-    
-    if (fpuState) {
-        asm volatile("fxsave (%0)" : : "r"(fpuState));
+    stackSize = (stackSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    uint64_t ustackBase = USER_STACK_TOP - stackSize;
+    vmas.map(ustackBase - PAGE_SIZE, PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED);
+    if (vmas.map(ustackBase, stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_STACK) != MAP_FAILED) {
+        mainThread->setUserStack(USER_STACK_TOP - 8);  // Start 8 bytes below top (inside mapped region)
     }
 }
 
+// Only runs once the last thread has been freed.
 Process::~Process() {
-    if (kernelStack) {
-        uint64_t kstackVirt = kernelStack - (4 * PAGE_SIZE);
-        void* kstackPhys = reinterpret_cast<void*>(kstackVirt - hhdm_request.response->offset);
-        pmm.freePages(kstackPhys, 4);
-    }
-    
-    if (userStack) {
-        uint64_t ustackBase = USER_STACK_TOP - (USER_STACK_PAGES * PAGE_SIZE);
-        void* ustackVirt = reinterpret_cast<void*>(ustackBase);
-        void* ustackPhys = vmm.getPhysical(ustackVirt);
-        if (ustackPhys) {
-            vmm.unmapRange(ustackVirt, USER_STACK_PAGES);
-            pmm.freePages(ustackPhys, USER_STACK_PAGES);
+    for (int fd = FIRST_FILE_FD; fd < MAX_FILES; fd++) {
+        closeFile(fd);
+    }
+
+    // Mappings go first so shared file pages are written back while the
+    // page tables still describe them; the walk then frees every user frame
+    // and table, the stack and loaded image included.
+    vmas.clear();
+    vmm.destroy();
+    ResourceGroups::get().detach(this);
+
+    Scheduler::get().releasePID(pid);
+}
+
+Process* Process::create(uint32_t pid, size_t stackSize) {
+    Process* proc = new Process(pid, stackSize);
+    if (!proc->mainThread) {
+        delete proc;
+        return nullptr;
+    }
+    return proc;
+}
+
+void Process::setGroup(ResourceGroup* newGroup) {
+    __atomic_store_n(&group, newGroup, __ATOMIC_RELEASE);
+    vmas.setGroup(newGroup);
+}
+
+Thread* Process::createThread(uint32_t tid) {
+    Thread* thread = new Thread(this, tid);
+    if (!thread->getKernelStack()) {
+        delete thread;
+        return nullptr;
+    }
+
+    LockGuard guard(threadLock);
+    thread->sibling = threads;
+    threads = thread;
+    threadCount++;
+    liveThreads++;
+    return thread;
+}
+
+bool Process::removeThread(Thread* thread) {
+    LockGuard guard(threadLock);
+
+    Thread** link = &threads;
+    while (*link && *link != thread) {
+        link = &(*link)->sibling;
+    }
+    if (*link) {
+        *link = thread->sibling;
+        threadCount--;
+    }
+    if (thread == mainThread) {
+        mainThread = nullptr;
+    }
+    return threadCount == 0;
+}
+
+void Process::terminate(int code, Thread* caller) {
+    bool first = false;
+    if (!__atomic_exchange_n(&exiting, true, __ATOMIC_SEQ_CST)) {
+        exitCode = code;
+        first = true;
+    }
+
+    if (first) {
+        LockGuard guard(threadLock);
+        for (Thread* thread = threads; thread; thread = thread->sibling) {
+            if (thread != caller) thread->sendSignal(SIGKILL);
+        }
+    }
+
+    if (caller) caller->setState(ThreadState::Terminated);
+}
+
+void Process::threadExited(Thread* thread) {
+    if (__atomic_sub_fetch(&liveThreads, 1, __ATOMIC_SEQ_CST) != 0) return;
+
+    // Nobody is left to join the others, so nobody holds a claim on them.
+    if (!__atomic_exchange_n(&exiting, true, __ATOMIC_SEQ_CST)) {
+        exitCode = thread->getExitCode();
+    }
+    collectExited();
+}
+
+// Exited threads nobody joined yet. One still on its CPU is left to
+// scheduleTail, which checks exiting only after it is off.
+void Process::collectExited() {
+    LockGuard guard(threadLock);
+    for (Thread* thread = threads; thread; thread = thread->sibling) {
+        if (thread->getState() == ThreadState::Terminated && !__atomic_load_n(&thread->onCPU, __ATOMIC_SEQ_CST)) {
+            Scheduler::get().reap(thread);
         }
     }
-    
-    if (fpuState) {
-        void* fpuPhys = reinterpret_cast<void*>(reinterpret_cast<uint64_t>(fpuState) - hhdm_request.response->offset);
-        pmm.freePage(fpuPhys);
+}
+
+bool Process::allowsDeadlineThreads(uint64_t mask) {
+    LockGuard guard(threadLock);
+    for (Thread* thread = threads; thread; thread = thread->sibling) {
+        if (thread->getPolicy() != SchedPolicy::Deadline) continue;
+        if (!(mask & (1ULL << thread->getDeadlineEntity()->cpu))) return false;
     }
+    return true;
 }
 
-void Process::jumpToUsermode(uint64_t entry, GDT* gdt) {    
-    vmm.load();
-    
-    if (gdt) {
-        gdt->setKernelStack(kernelStack);
+void Process::migrateThreads() {
+    LockGuard guard(threadLock);
+    for (Thread* thread = threads; thread; thread = thread->sibling) {
+        int cpu = thread->getLastCPU();
+        if (thread->onCPU && cpu >= 0 && !thread->canRunOn(cpu)) {
+            Scheduler::get().resched(cpu);
+        }
     }
-    
-    Syscall::get().setKernelStack(kernelStack);
-    
-    context.rip = entry;
-    context.rsp = userStack;
-    
-    enterUsermode(entry, userStack);
 }
 
+// The first thread that takes the signal gets it, the main thread if all
+// of them block it.
 void Process::sendSignal(int sig) {
     if (sig < 0 || sig >= NSIG) return;
-    signalHandler.pending |= (1ULL << sig);
-}
-
-void Process::handlePendingSignals() {
-    if (!signalHandler.pending) return;
-    
-    for (int sig = 0; sig < NSIG; sig++) {
-        if (!(signalHandler.pending & (1ULL << sig))) continue;
-        if (signalHandler.blocked & (1ULL << sig)) continue;
-        
-        signalHandler.pending &= ~(1ULL << sig);
-        
-        if (sig == SIGKILL) {
-            state = ProcessState::Terminated;
-            exitCode = 128 + sig;
-            return;
+
+    LockGuard guard(threadLock);
+    Thread* target = mainThread;
+    for (Thread* thread = threads; thread; thread = thread->sibling) {
+        if (thread->getState() == ThreadState::Terminated) continue;
+        if (!(thread->getSignalMask() & (1ULL << sig))) {
+            target = thread;
+            break;
         }
-        
-        sighandler_t handler = signalHandler.handlers[sig];
-        if (!handler) {
-            state = ProcessState::Terminated;
-            exitCode = 128 + sig;
-            return;
+    }
+    if (target) target->sendSignal(sig);
+}
+
+int Process::installFile(FileDescriptor* file) {
+    LockGuard guard(threadLock);
+    for (int fd = FIRST_FILE_FD; fd < MAX_FILES; fd++) {
+        if (!files[fd]) {
+            files[fd] = file;
+            return fd;
         }
-        
-        uint64_t oldRsp = context.rsp;
-        context.rsp -= 128;
-        context.rsp &= ~0xFULL;
-        
-        uint64_t* stack = reinterpret_cast<uint64_t*>(context.rsp);
-        stack[0] = context.rip;
-        
-        context.rip = reinterpret_cast<uint64_t>(handler);
-        context.rdi = sig;
-        
-        break;
     }
+    return -1;
+}
+
+// The descriptor stays open until the caller hands it back with putFile,
+// even if another thread closes fd in the meantime.
+FileDescriptor* Process::getFile(int fd) {
+    if (fd < FIRST_FILE_FD || fd >= MAX_FILES) return nullptr;
+
+    LockGuard guard(threadLock);
+    FileDescriptor* file = files[fd];
+    if (file) file->hold();
+    return file;
+}
+
+void Process::putFile(FileDescriptor* file) {
+    if (file->drop()) VFS::get().close(file);
+}
+
+int Process::closeFile(int fd) {
+    if (fd < FIRST_FILE_FD || fd >= MAX_FILES) return -1;
+
+    threadLock.lock();
+    FileDescriptor* file = files[fd];
+    files[fd] = nullptr;
+    threadLock.unlock();
+
+    if (!file) return -1;
+    putFile(file);
+    return 0;
 }
@@ -2,87 +2,113 @@
 
 #include <cstdint>
 #include <cpu/mm/vmm.hpp>
-
-enum class ProcessState {
-    Ready,
-    Running,
-    Blocked,
-    Terminated
-};
-
-struct alignas(16) FPUState {
-    uint8_t data[512];
-};
-
-struct ProcessContext {
-    uint64_t rax, rbx, rcx, rdx;
-    uint64_t rsi, rdi, rbp, rsp;
-    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
-    uint64_t rip, rflags, cr3, fxstate;
-};
-
-#define NSIG 32
-#define SIGKILL 9
-#define SIGSEGV 11
-#define SIGTERM 15
+#include <cpu/mm/vma.hpp>
+#include <cpu/smp/spinlock.hpp>
+#include "thread.hpp"
+#include "schedstats.hpp"
+#include "resgroup.hpp"
 
 typedef void (*sighandler_t)(int);
 
 struct SignalHandler {
     sighandler_t handlers[NSIG];
-    uint64_t pending;
-    uint64_t blocked;
 };
 
+class FileDescriptor;
+
+constexpr size_t DEFAULT_USER_STACK_SIZE = 8 * 1024 * 1024;
+constexpr size_t MAX_USER_STACK_SIZE = 1024 * 1024 * 1024;
 
-class GDT;
+// Descriptors 0-2 belong to the console and never enter the table.
+constexpr int FIRST_FILE_FD = 3;
+constexpr int MAX_FILES = 32;
 
+// An address space with its files and signal handlers, and the threads
+// running in it. The main thread is created with the process and has the
+// process's PID as its TID. A process lives until its last thread is freed.
 class Process {
 public:
-    Process(uint32_t pid);
+    Process(uint32_t pid, size_t stackSize = DEFAULT_USER_STACK_SIZE);
     ~Process();
-    
+
+    // nullptr if the main thread got no kernel stack; the PID is released.
+    static Process* create(uint32_t pid, size_t stackSize = DEFAULT_USER_STACK_SIZE);
+
     uint32_t getPID() const { return pid; }
-    ProcessState getState() const { return state; }
-    void setState(ProcessState s) { state = s; }
-    
-    ProcessContext* getContext() { return &context; }
-    FPUState* getFPUState() { return fpuState; }
     VMM* getVMM() { return &vmm; }
-    
-    uint64_t getKernelStack() const { return kernelStack; }
-    uint64_t getUserStack() const { return userStack; }
-    
-    void setKernelStack(uint64_t stack) { kernelStack = stack; }
-    void setUserStack(uint64_t stack) { userStack = stack; }
-    
-    void jumpToUsermode(uint64_t entry, GDT* gdt);
-    
+    VMAManager* getVMAs() { return &vmas; }
+
+    Thread* getMainThread() const { return mainThread; }
+
+    // A new thread with the given TID, not yet started. nullptr if the stack
+    // pool is out of slots or memory, tid is released then.
+    Thread* createThread(uint32_t tid);
+    // Returns true when that was the last thread of the process.
+    bool removeThread(Thread* thread);
+    size_t getThreadCount() const { return threadCount; }
+
     uint32_t getParentPID() const { return parentPID; }
     void setParentPID(uint32_t ppid) { parentPID = ppid; }
-    
+
     int getExitCode() const { return exitCode; }
     void setExitCode(int code) { exitCode = code; }
-    
-    Process* next;
-    
-    bool hasValidUserState() const { return validUserState; }
-    void setValidUserState(bool valid) { validUserState = valid; }
-    
+
+    // Once set, exited threads are freed right away instead of waiting to
+    // be joined, and no new threads are created.
+    bool isExiting() const { return __atomic_load_n(&exiting, __ATOMIC_SEQ_CST); }
+
+    // Ends the whole process with code: every other thread is killed and
+    // the caller is marked Terminated, to exit on its way back to user mode.
+    // The last thread to exit frees the ones nobody joined.
+    void terminate(int code, Thread* caller);
+    // Called by each thread as it exits. The last one ends the process.
+    void threadExited(Thread* thread);
+
+    // Bit n allows CPU n. Threads already queued elsewhere move the next
+    // time they are picked.
+    uint64_t getAffinity() const { return __atomic_load_n(&affinity, __ATOMIC_RELAXED); }
+    void setAffinity(uint64_t mask) { __atomic_store_n(&affinity, mask, __ATOMIC_RELAXED); }
+    // False if a deadline thread of the process would lose its CPU.
+    bool allowsDeadlineThreads(uint64_t mask);
+    // Makes every thread running where the affinity no longer allows it
+    // reschedule.
+    void migrateThreads();
+
+    // Summed over every thread the process has had.
+    SchedStats* getSchedStats() { return &schedStats; }
+
+    // Inherited from the process that created this one. Only changed
+    // through ResourceGroups::attach().
+    ResourceGroup* getGroup() const { return __atomic_load_n(&group, __ATOMIC_ACQUIRE); }
+    void setGroup(ResourceGroup* newGroup);
+
     SignalHandler* getSignalHandler() { return &signalHandler; }
+    // Delivered to the first thread that does not block the signal.
     void sendSignal(int sig);
-    void handlePendingSignals();
-    
+
+    int installFile(FileDescriptor* file);
+    FileDescriptor* getFile(int fd);
+    void putFile(FileDescriptor* file);
+    int closeFile(int fd);
+
 private:
     uint32_t pid;
     uint32_t parentPID;
     int exitCode;
-    ProcessState state;
-    uint64_t kernelStack;
-    uint64_t userStack;
-    ProcessContext context;
-    FPUState* fpuState;
+    bool exiting;
+    uint64_t affinity;
     VMM vmm;
-    bool validUserState;
+    VMAManager vmas;
+    SchedStats schedStats;
+    ResourceGroup* group;
     SignalHandler signalHandler;
+    FileDescriptor* files[MAX_FILES];
+
+    Spinlock threadLock;
+    Thread* mainThread;
+    Thread* threads;
+    size_t threadCount;     // thread objects not yet freed
+    uint32_t liveThreads;   // threads that have not exited
+
+    void collectExited();
 };
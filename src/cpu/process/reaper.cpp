@@ -0,0 +1,36 @@
+#include "reaper.hpp"
+#include "process.hpp"
+#include <cpu/fpu/fpu.hpp>
+
+Reaper& Reaper::get() {
+    static Reaper instance;
+    return instance;
+}
+
+// Before the workqueue runs, threads just pile up and go with the next
+// one reaped afterwards.
+void Reaper::reap(Thread* thread) {
+    Thread* head = __atomic_load_n(&dead, __ATOMIC_RELAXED);
+    do {
+        thread->next = head;
+    } while (!__atomic_compare_exchange_n(&dead, &head, thread, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    WorkQueue::get().queue(&work);
+}
+
+void Reaper::reapAll(Work*) {
+    Reaper& reaper = get();
+    Thread* thread = __atomic_exchange_n(&reaper.dead, nullptr, __ATOMIC_ACQUIRE);
+
+    while (thread) {
+        Thread* next = thread->next;
+        Process* process = thread->getProcess();
+
+        FPU::get().release(thread);
+        bool last = process->removeThread(thread);
+        delete thread;
+        if (last) delete process;
+
+        thread = next;
+    }
+}
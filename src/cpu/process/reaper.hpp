@@ -0,0 +1,25 @@
+#pragma once
+
+#include "thread.hpp"
+#include "workqueue.hpp"
+
+// Frees exited threads, and their process with the last of them. The
+// scheduler finds them with interrupts off on its way out of a switch, where
+// tearing down an address space does not belong, so it only hands them over
+// here and a worker does the rest.
+class Reaper {
+public:
+    static Reaper& get();
+
+    // thread must already be out of the scheduler's PID table, with its
+    // last reference dropped.
+    void reap(Thread* thread);
+
+private:
+    Reaper() : dead(nullptr), work{reapAll, nullptr, nullptr, false} {}
+
+    Thread* dead;   // linked through Thread::next
+    Work work;
+
+    static void reapAll(Work* work);
+};
@@ -0,0 +1,191 @@
+#include "resgroup.hpp"
+#include "process.hpp"
+#include <cpu/mm/pmm.hpp>
+#include <cpu/smp/smp.hpp>
+
+ResourceGroups& ResourceGroups::get() {
+    static ResourceGroups instance;
+    return instance;
+}
+
+ResourceGroups::ResourceGroups() {
+    for (uint32_t i = 0; i < MAX_RESOURCE_GROUPS; i++) {
+        groups[i].id = i;
+        groups[i].active = false;
+        groups[i].parked = nullptr;
+        groups[i].timer = {};
+    }
+    groups[ROOT_GROUP].active = true;
+}
+
+ResourceGroup* ResourceGroups::lookup(uint32_t id) {
+    if (id >= MAX_RESOURCE_GROUPS) return nullptr;
+
+    LockGuard guard(lock);
+    return groups[id].active ? &groups[id] : nullptr;
+}
+
+ResourceGroup* ResourceGroups::create() {
+    LockGuard guard(lock);
+    for (uint32_t i = 0; i < MAX_RESOURCE_GROUPS; i++) {
+        ResourceGroup* group = &groups[i];
+        if (group->active) continue;
+
+        // A destroyed group keeps its slot until the last frame charged to
+        // it is freed.
+        if (__atomic_load_n(&group->memoryUsed, __ATOMIC_RELAXED)) continue;
+
+        group->processes = 0;
+        group->quota = 0;
+        group->period = 0;
+        group->periodStart = 0;
+        group->runtime = 0;
+        group->throttled = false;
+        group->parked = nullptr;
+        group->cpuTime = 0;
+        group->throttles = 0;
+        group->memoryLimit = 0;
+        group->memoryPeak = 0;
+        group->memoryFailures = 0;
+        group->faults = 0;
+        group->active = true;
+        return group;
+    }
+    return nullptr;
+}
+
+bool ResourceGroups::destroy(uint32_t id) {
+    if (id == ROOT_GROUP || id >= MAX_RESOURCE_GROUPS) return false;
+
+    ResourceGroup* group = &groups[id];
+    lock.lock();
+    if (!group->active || group->processes) {
+        lock.unlock();
+        return false;
+    }
+    group->active = false;
+    lock.unlock();
+
+    // Without processes nothing is parked, only the timer may be left.
+    TimerWheel::cancel(&group->timer);
+    return true;
+}
+
+bool ResourceGroups::setLimits(uint32_t id, uint64_t quota, uint64_t period, uint64_t memoryLimit) {
+    if (id == ROOT_GROUP) return false;
+    if (quota && (period < GROUP_MIN_PERIOD_NS || period > GROUP_MAX_PERIOD_NS || quota > period * SMP::get().getCPUCount())) {
+        return false;
+    }
+
+    ResourceGroup* group = lookup(id);
+    if (!group) return false;
+
+    // A throttled group keeps waiting for the end of its current period.
+    LockGuard guard(group->lock);
+    group->period = quota ? period : 0;
+    __atomic_store_n(&group->quota, quota, __ATOMIC_RELAXED);
+    group->runtime = 0;
+    __atomic_store_n(&group->memoryLimit, (memoryLimit + PAGE_SIZE - 1) / PAGE_SIZE, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool ResourceGroups::attach(Process* process, ResourceGroup* group) {
+    LockGuard guard(lock);
+    if (!group->active) return false;
+
+    ResourceGroup* old = process->getGroup();
+    if (old) old->processes--;
+    group->processes++;
+    process->setGroup(group);
+    return true;
+}
+
+void ResourceGroups::detach(Process* process) {
+    LockGuard guard(lock);
+    ResourceGroup* old = process->getGroup();
+    if (old) old->processes--;
+}
+
+bool ResourceGroups::chargeCPU(ResourceGroup* group, uint64_t ns, uint64_t now, bool enforce) {
+    // Groups without a quota, the root among them, never take the lock.
+    __atomic_add_fetch(&group->cpuTime, ns, __ATOMIC_RELAXED);
+    if (!enforce || !__atomic_load_n(&group->quota, __ATOMIC_RELAXED)) return false;
+
+    LockGuard guard(group->lock);
+    if (!group->quota) return false;
+
+    if (!group->throttled && now - group->periodStart >= group->period) {
+        group->periodStart = now - (now - group->periodStart) % group->period;
+        group->runtime = 0;
+    }
+
+    group->runtime += ns;
+    if (group->throttled || group->runtime < group->quota) return false;
+
+    __atomic_store_n(&group->throttled, true, __ATOMIC_RELEASE);
+    group->throttles++;
+    return true;
+}
+
+uint64_t ResourceGroups::remaining(ResourceGroup* group, uint64_t now) {
+    if (!__atomic_load_n(&group->quota, __ATOMIC_RELAXED)) return UINT64_MAX;
+
+    LockGuard guard(group->lock);
+    if (!group->quota) return UINT64_MAX;
+    if (now - group->periodStart >= group->period) return group->quota;
+    return group->runtime < group->quota ? group->quota - group->runtime : 0;
+}
+
+bool ResourceGroups::park(ResourceGroup* group, Thread* thread) {
+    LockGuard guard(group->lock);
+    if (!group->throttled) return false;
+
+    thread->runNext = group->parked;
+    group->parked = thread;
+    return true;
+}
+
+Thread* ResourceGroups::unthrottle(ResourceGroup* group, uint64_t now) {
+    LockGuard guard(group->lock);
+    Thread* parked = group->parked;
+    group->parked = nullptr;
+    group->periodStart = now;
+    group->runtime = 0;
+    __atomic_store_n(&group->throttled, false, __ATOMIC_RELEASE);
+    return parked;
+}
+
+bool ResourceGroups::chargeMemory(ResourceGroup* group, size_t pages) {
+    uint64_t used = __atomic_add_fetch(&group->memoryUsed, pages, __ATOMIC_RELAXED);
+    uint64_t limit = __atomic_load_n(&group->memoryLimit, __ATOMIC_RELAXED);
+    if (limit && used > limit) {
+        __atomic_sub_fetch(&group->memoryUsed, pages, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&group->memoryFailures, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    uint64_t peak = __atomic_load_n(&group->memoryPeak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&group->memoryPeak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return true;
+}
+
+void ResourceGroups::unchargeMemory(uint32_t id, size_t pages) {
+    if (id >= MAX_RESOURCE_GROUPS) return;
+    __atomic_sub_fetch(&groups[id].memoryUsed, pages, __ATOMIC_RELAXED);
+}
+
+void ResourceGroups::getInfo(ResourceGroup* group, ResourceGroupInfo* info) {
+    LockGuard guard(group->lock);
+    info->quota = group->quota;
+    info->period = group->period;
+    info->cpuTime = __atomic_load_n(&group->cpuTime, __ATOMIC_RELAXED);
+    info->throttles = group->throttles;
+    info->throttled = group->throttled;
+    info->memoryLimit = group->memoryLimit * PAGE_SIZE;
+    info->memoryUsed = __atomic_load_n(&group->memoryUsed, __ATOMIC_RELAXED) * PAGE_SIZE;
+    info->memoryPeak = group->memoryPeak * PAGE_SIZE;
+    info->memoryFailures = group->memoryFailures;
+    info->faults = group->faults;
+    info->processes = group->processes;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "timerwheel.hpp"
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+class Thread;
+class Process;
+
+// Group 0 holds the kernel and everything not moved elsewhere, and can
+// not be limited or destroyed.
+constexpr uint32_t MAX_RESOURCE_GROUPS = 32;
+constexpr uint32_t ROOT_GROUP = 0;
+
+constexpr uint64_t GROUP_MIN_PERIOD_NS = 1000000;
+constexpr uint64_t GROUP_MAX_PERIOD_NS = 1000000000;
+
+// Processes sharing a CPU quota and a memory limit. A new process joins
+// the group of the process that created it.
+//
+// The quota is quota ns of CPU per period, across all CPUs. Once it is
+// used up, the group's threads are parked off the run queues until the
+// period ends. Deadline threads are counted but never parked, their
+// reservation already bounds them.
+//
+// Memory is counted in frames the PMM handed out for user pages of the
+// group's processes. The charge stays with the frame until it is freed,
+// even if its process moves to another group.
+struct ResourceGroup {
+    uint32_t id;
+    bool active;
+    uint32_t processes;
+
+    uint64_t quota;          // ns per period, 0 for no limit
+    uint64_t period;
+    uint64_t periodStart;
+    uint64_t runtime;        // used in the current period
+    bool throttled;
+    Thread* parked;          // linked through runNext
+    TimerEvent timer;        // ends a throttled period
+    Spinlock lock;
+
+    uint64_t cpuTime;        // ns, in total
+    uint64_t throttles;
+
+    uint64_t memoryLimit;    // pages, 0 for no limit
+    uint64_t memoryUsed;
+    uint64_t memoryPeak;
+    uint64_t memoryFailures; // allocations refused at the limit
+    uint64_t faults;         // page faults resolved
+};
+
+// What GroupInfo reports. Memory is in bytes.
+struct ResourceGroupInfo {
+    uint64_t quota;
+    uint64_t period;
+    uint64_t cpuTime;
+    uint64_t throttles;
+    uint64_t throttled;
+    uint64_t memoryLimit;
+    uint64_t memoryUsed;
+    uint64_t memoryPeak;
+    uint64_t memoryFailures;
+    uint64_t faults;
+    uint64_t processes;
+};
+
+class ResourceGroups {
+public:
+    static ResourceGroups& get();
+
+    ResourceGroup* getRoot() { return &groups[ROOT_GROUP]; }
+    // nullptr unless id names a group that exists.
+    ResourceGroup* lookup(uint32_t id);
+
+    // An unlimited group, nullptr when every slot is taken.
+    ResourceGroup* create();
+    // Only a group without processes and memory charged to it can go.
+    bool destroy(uint32_t id);
+    // quota 0 lifts the CPU limit, memoryLimit 0 the memory one.
+    bool setLimits(uint32_t id, uint64_t quota, uint64_t period, uint64_t memoryLimit);
+
+    // Moves process into group, false if the group is gone. Every process
+    // is in a group from when it is created until it is freed.
+    bool attach(Process* process, ResourceGroup* group);
+    void detach(Process* process);
+
+    // Adds ns of CPU time. Returns true for the charge that used up the
+    // quota; the caller then calls throttle().
+    bool chargeCPU(ResourceGroup* group, uint64_t ns, uint64_t now, bool enforce);
+    bool isThrottled(ResourceGroup* group) const { return __atomic_load_n(&group->throttled, __ATOMIC_ACQUIRE); }
+    // What is left of the quota this period, UINT64_MAX without one.
+    uint64_t remaining(ResourceGroup* group, uint64_t now);
+    // Keeps a runnable thread of a throttled group until its period ends.
+    // False if the group was unthrottled meanwhile.
+    bool park(ResourceGroup* group, Thread* thread);
+    // Starts a new period, handing back the parked threads.
+    Thread* unthrottle(ResourceGroup* group, uint64_t now);
+
+    // False, and nothing charged, if it would take group over its limit.
+    bool chargeMemory(ResourceGroup* group, size_t pages);
+    void unchargeMemory(uint32_t id, size_t pages);
+
+    void getInfo(ResourceGroup* group, ResourceGroupInfo* info);
+
+private:
+    ResourceGroups();
+
+    ResourceGroup groups[MAX_RESOURCE_GROUPS];
+    Spinlock lock;
+};
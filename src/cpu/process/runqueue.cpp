@@ -0,0 +1,200 @@
+#include "runqueue.hpp"
+
+RunQueue::RunQueue() : bitmap(0), count(0), peak(0) {
+    for (int i = 0; i < PRIORITY_LEVELS; i++) {
+        heads[i] = nullptr;
+        tails[i] = nullptr;
+    }
+}
+
+void RunQueue::push(Thread* thread) {
+    LockGuard guard(lock);
+    pushLocked(thread);
+}
+
+void RunQueue::pushWoken(Thread* thread, uint64_t now) {
+    LockGuard guard(lock);
+    if (thread->getPolicy() == SchedPolicy::Deadline) {
+        DeadlineQueue::wakeup(thread, now);
+    }
+    pushLocked(thread);
+}
+
+void RunQueue::pushLocked(Thread* thread) {
+    count++;
+    if (count > peak) peak = count;
+
+    if (thread->getPolicy() == SchedPolicy::Deadline) {
+        deadline.insert(thread);
+        return;
+    }
+
+    if (thread->getPolicy() == SchedPolicy::Fair) {
+        // A thread that slept keeps at most half a period of credit, so it
+        // gets the CPU soon without being able to monopolise it.
+        SchedEntity* se = thread->getSchedEntity();
+        uint64_t floor = fair.getMinVruntime();
+        floor = floor > SCHED_LATENCY_NS / 2 ? floor - SCHED_LATENCY_NS / 2 : 0;
+        if (se->vruntime < floor) se->vruntime = floor;
+
+        fair.insert(thread);
+        return;
+    }
+
+    int prio = thread->getPriority();
+    thread->runNext = nullptr;
+    if (tails[prio]) {
+        tails[prio]->runNext = thread;
+    } else {
+        heads[prio] = thread;
+    }
+    tails[prio] = thread;
+    bitmap |= 1U << prio;
+}
+
+Thread* RunQueue::popFixed() {
+    int prio = __builtin_ctz(bitmap);
+    Thread* thread = heads[prio];
+    heads[prio] = thread->runNext;
+    if (!heads[prio]) {
+        tails[prio] = nullptr;
+        bitmap &= ~(1U << prio);
+    }
+    thread->runNext = nullptr;
+    return thread;
+}
+
+Thread* RunQueue::pop(Thread* current) {
+    LockGuard guard(lock);
+    fair.updateMin(current);
+
+    // An earlier deadline preempts a deadline thread, anything else never
+    // does.
+    bool deadlineCurrent = current && current->getPolicy() == SchedPolicy::Deadline;
+    Thread* earliest = deadline.first();
+    if (earliest && (!deadlineCurrent || DeadlineQueue::earlier(earliest, current))) {
+        deadline.remove(earliest);
+        count--;
+        return earliest;
+    }
+    if (deadlineCurrent) return nullptr;
+
+    bool fixedCurrent = current && current->getPolicy() == SchedPolicy::Fixed;
+    if (bitmap) {
+        // Equal levels take turns, a lower one never interrupts.
+        if (fixedCurrent && __builtin_ctz(bitmap) > current->getPriority()) return nullptr;
+        count--;
+        return popFixed();
+    }
+
+    Thread* first = fair.first();
+    if (!first || fixedCurrent) return nullptr;
+    if (current && current->getSchedEntity()->vruntime <= first->getSchedEntity()->vruntime) return nullptr;
+
+    count--;
+    return fair.popFirst();
+}
+
+Thread* RunQueue::stealFixed(uint32_t cpu) {
+    for (uint32_t levels = bitmap; levels; levels &= levels - 1) {
+        int prio = __builtin_ctz(levels);
+
+        Thread* prev = nullptr;
+        for (Thread* thread = heads[prio]; thread; prev = thread, thread = thread->runNext) {
+            if (!thread->canRunOn(cpu)) continue;
+
+            if (prev) {
+                prev->runNext = thread->runNext;
+            } else {
+                heads[prio] = thread->runNext;
+            }
+            if (tails[prio] == thread) tails[prio] = prev;
+            if (!heads[prio]) bitmap &= ~(1U << prio);
+
+            thread->runNext = nullptr;
+            return thread;
+        }
+    }
+    return nullptr;
+}
+
+Thread* RunQueue::steal(uint32_t cpu) {
+    LockGuard guard(lock);
+    if (Thread* thread = stealFixed(cpu)) {
+        count--;
+        return thread;
+    }
+
+    Thread* thread = fair.firstAllowedOn(cpu);
+    if (!thread) return nullptr;
+
+    fair.remove(thread);
+    count--;
+    thread->getSchedEntity()->vruntime -= fair.getMinVruntime();
+    return thread;
+}
+
+void RunQueue::adopt(Thread* thread) {
+    if (thread->getPolicy() != SchedPolicy::Fair) return;
+
+    LockGuard guard(lock);
+    thread->getSchedEntity()->vruntime += fair.getMinVruntime();
+}
+
+bool RunQueue::charge(Thread* current, uint64_t ns, uint64_t now) {
+    SchedEntity* se = current->getSchedEntity();
+    se->runtime += ns;
+    if (current->getPolicy() == SchedPolicy::Fixed) return false;
+
+    LockGuard guard(lock);
+    if (current->getPolicy() == SchedPolicy::Deadline) {
+        return DeadlineQueue::charge(current, ns, now);
+    }
+
+    se->vruntime += FairQueue::scale(ns, FairQueue::weightOf(current->getNice()));
+    fair.updateMin(current);
+    return false;
+}
+
+// A deadline thread runs until its budget is used up.
+uint64_t RunQueue::sliceFor(Thread* thread) {
+    if (thread->getPolicy() == SchedPolicy::Fixed) return FIXED_SLICE_NS;
+
+    LockGuard guard(lock);
+    if (thread->getPolicy() == SchedPolicy::Deadline) {
+        int64_t remaining = thread->getDeadlineEntity()->remaining;
+        return remaining > 0 ? remaining : 0;
+    }
+    return fair.sliceFor(thread);
+}
+
+// A queued thread is taken out and put back at its new deadline.
+bool RunQueue::replenish(Thread* thread, uint64_t now) {
+    LockGuard guard(lock);
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    if (thread->getPolicy() != SchedPolicy::Deadline || !dl->throttled) return false;
+
+    bool queued = dl->queued;
+    if (queued) deadline.remove(thread);
+    DeadlineQueue::replenish(thread, now);
+    if (queued) deadline.insert(thread);
+    return queued;
+}
+
+bool RunQueue::preempts(Thread* thread, Thread* current) {
+    if (thread->getPolicy() == SchedPolicy::Deadline && thread->getDeadlineEntity()->throttled) {
+        return false;
+    }
+    if (thread->getPolicy() != current->getPolicy()) {
+        if (thread->getPolicy() == SchedPolicy::Deadline) return true;
+        if (current->getPolicy() == SchedPolicy::Deadline) return false;
+        return thread->getPolicy() == SchedPolicy::Fixed;
+    }
+    if (thread->getPolicy() == SchedPolicy::Deadline) {
+        return DeadlineQueue::earlier(thread, current);
+    }
+    if (thread->getPolicy() == SchedPolicy::Fixed) {
+        return thread->getPriority() < current->getPriority();
+    }
+    return thread->getSchedEntity()->vruntime + SCHED_WAKEUP_GRANULARITY_NS < current->getSchedEntity()->vruntime;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "thread.hpp"
+#include "fairqueue.hpp"
+#include "deadlinequeue.hpp"
+#include <cpu/smp/spinlock.hpp>
+#include <cstddef>
+
+// Round-robin slice of the fixed priority class.
+constexpr uint64_t FIXED_SLICE_NS = 10000000;
+
+// Runnable threads owned by one CPU. Deadline threads sit in a
+// DeadlineQueue, fixed priority ones in a FIFO per level with a bitmap of
+// the non-empty levels, fair ones in a FairQueue. Other CPUs only take from
+// it when their own queue is empty, and never take deadline threads.
+class RunQueue {
+public:
+    RunQueue();
+
+    void push(Thread* thread);
+    // For a thread that was blocked or is new: a deadline thread may start
+    // a new job first.
+    void pushWoken(Thread* thread, uint64_t now);
+
+    // The thread that should run next, or nullptr when current (if it is
+    // still runnable) should keep the CPU or nothing is queued.
+    Thread* pop(Thread* current = nullptr);
+
+    // Takes a thread allowed on cpu for that CPU. Its vruntime leaves
+    // relative to this queue and is made absolute again by the new owner's
+    // adopt().
+    Thread* steal(uint32_t cpu);
+    void adopt(Thread* thread);
+
+    // Accounts ns of CPU time to the running thread. Returns true when a
+    // deadline thread is out of budget and has to be throttled.
+    bool charge(Thread* current, uint64_t ns, uint64_t now);
+    uint64_t sliceFor(Thread* thread);
+
+    // Gives a throttled deadline thread its next budget. Returns true if it
+    // is queued here and can be picked again.
+    bool replenish(Thread* thread, uint64_t now);
+
+    // Whether a newly queued thread should preempt the running one.
+    static bool preempts(Thread* thread, Thread* current);
+
+    // Unlocked peek, only used as a scheduling hint.
+    size_t size() const { return __atomic_load_n(&count, __ATOMIC_RELAXED); }
+    // The longest the queue has been.
+    size_t getPeak() const { return __atomic_load_n(&peak, __ATOMIC_RELAXED); }
+
+private:
+    static_assert(PRIORITY_LEVELS <= 32, "priority bitmap is 32 bits wide");
+
+    Spinlock lock;
+    Thread* heads[PRIORITY_LEVELS];
+    Thread* tails[PRIORITY_LEVELS];
+    uint32_t bitmap;
+    FairQueue fair;
+    DeadlineQueue deadline;
+    size_t count;
+    size_t peak;
+
+    void pushLocked(Thread* thread);
+    Thread* popFixed();
+    Thread* stealFixed(uint32_t cpu);
+};
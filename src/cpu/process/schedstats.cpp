@@ -0,0 +1,95 @@
+#include "schedstats.hpp"
+#include <cpu/smp/cpu.hpp>
+#include <cpu/smp/smp.hpp>
+#include <cpu/cereal/cereal.hpp>
+
+static size_t latencyBucket(uint64_t cycles) {
+    size_t bucket = 0;
+    cycles >>= WAKEUP_LATENCY_SHIFT;
+    while (cycles && bucket < WAKEUP_LATENCY_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static void raise(uint64_t* counter, uint64_t value) {
+    uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(counter, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void SchedStatistics::recordSwitch(CPUData* cpu, SchedStats* process, bool involuntary) {
+    uint64_t SchedStats::* counter = involuntary ? &SchedStats::involuntarySwitches : &SchedStats::voluntarySwitches;
+    cpu->schedStats.*counter += 1;
+    if (process) add(&(process->*counter), 1);
+}
+
+void SchedStatistics::recordSwitchTime(CPUData* cpu, SchedStats* process, uint64_t cycles) {
+    cpu->schedStats.switchCycles += cycles;
+    if (process) add(&process->switchCycles, cycles);
+}
+
+void SchedStatistics::recordWakeup(CPUData* cpu, SchedStats* process, uint64_t cycles) {
+    size_t bucket = latencyBucket(cycles);
+
+    SchedStats* local = &cpu->schedStats;
+    local->wakeups++;
+    local->wakeupCycles += cycles;
+    local->wakeupLatency[bucket]++;
+    if (cycles > local->maxWakeupCycles) local->maxWakeupCycles = cycles;
+
+    if (!process) return;
+    add(&process->wakeups, 1);
+    add(&process->wakeupCycles, cycles);
+    add(&process->wakeupLatency[bucket], 1);
+    raise(&process->maxWakeupCycles, cycles);
+}
+
+// Other CPUs keep counting meanwhile, so the sum is only a snapshot.
+void SchedStatistics::collect(SchedStats* total) {
+    *total = {};
+
+    SMP& smp = SMP::get();
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* cpu = smp.getCPU(i);
+        if (!cpu) continue;
+
+        const SchedStats* stats = &cpu->schedStats;
+        total->schedules += stats->schedules;
+        total->voluntarySwitches += stats->voluntarySwitches;
+        total->involuntarySwitches += stats->involuntarySwitches;
+        total->switchCycles += stats->switchCycles;
+        total->wakeups += stats->wakeups;
+        total->wakeupCycles += stats->wakeupCycles;
+        if (stats->maxWakeupCycles > total->maxWakeupCycles) {
+            total->maxWakeupCycles = stats->maxWakeupCycles;
+        }
+        for (size_t j = 0; j < WAKEUP_LATENCY_BUCKETS; j++) {
+            total->wakeupLatency[j] += stats->wakeupLatency[j];
+        }
+    }
+}
+
+void SchedStatistics::dump(const char* label, const SchedStats* stats) {
+    if (!stats) return;
+
+    Cereal& serial = Cereal::get();
+    serial.write("[SCHEDSTATS] ");
+    serial.write(label);
+    serial.write("\n");
+
+    serial.writeField("schedules", stats->schedules);
+    serial.writeField("voluntary switches", stats->voluntarySwitches);
+    serial.writeField("involuntary switches", stats->involuntarySwitches);
+    serial.writeField("switch cycles", stats->switchCycles);
+    serial.writeField("wakeups", stats->wakeups);
+    serial.writeField("wakeup cycles", stats->wakeupCycles);
+    serial.writeField("max wakeup cycles", stats->maxWakeupCycles);
+
+    serial.writeHistogram(stats->wakeupLatency, WAKEUP_LATENCY_BUCKETS, WAKEUP_LATENCY_SHIFT);
+}
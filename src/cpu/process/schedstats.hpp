@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Bucket i counts wakeups that waited fewer than 2^(i + 10) TSC cycles for
+// a CPU, the last bucket takes everything slower.
+constexpr size_t WAKEUP_LATENCY_BUCKETS = 20;
+constexpr size_t WAKEUP_LATENCY_SHIFT = 10;
+
+// Run queue lengths kept per CPU, one sample every BALANCE_INTERVAL_NS.
+constexpr size_t QUEUE_TRACE_LENGTH = 32;
+
+// Kept per CPU and per process. The system wide figures are the sum over
+// all CPUs.
+struct SchedStats {
+    uint64_t schedules;             // passes through reschedule(), CPUs only
+    uint64_t voluntarySwitches;     // gave up the CPU to block or exit
+    uint64_t involuntarySwitches;   // taken off while still runnable
+    uint64_t switchCycles;          // in switchContext, charged to the thread switched to
+    uint64_t wakeups;
+    uint64_t wakeupCycles;
+    uint64_t maxWakeupCycles;
+    uint64_t wakeupLatency[WAKEUP_LATENCY_BUCKETS];
+};
+
+// sys_schedstats flag: also print the counters on the serial port.
+constexpr uint64_t SCHEDSTATS_DUMP = 0x1;
+
+struct CPUData;
+
+namespace SchedStatistics {
+    // Each records into the CPU's stats, which only that CPU touches, and
+    // atomically into those of process, which may be null.
+    void recordSwitch(CPUData* cpu, SchedStats* process, bool involuntary);
+    void recordSwitchTime(CPUData* cpu, SchedStats* process, uint64_t cycles);
+    void recordWakeup(CPUData* cpu, SchedStats* process, uint64_t cycles);
+
+    void collect(SchedStats* total);
+    void dump(const char* label, const SchedStats* stats);
+}
@@ -1,334 +1,844 @@
 #include "scheduler.hpp"
+#include "reaper.hpp"
+#include "waitqueue.hpp"
 #include <cpu/gdt/gdt.hpp>
+#include <cpu/fpu/fpu.hpp>
+#include <cpu/idle/idle.hpp>
+#include <cpu/smp/smp.hpp>
+#include <cpu/smp/preempt.hpp>
+#include <cpu/apic/irqs.hpp>
+#include <x86_64/ports.hpp>
 #include <graphics/console.hpp>
-#include <cpu/syscall/syscall.hpp>
-#include <cpu/idt/interrupt.hpp>
+#include <interrupts/timer.hpp>
 
-extern GDT* globalGDT;
+extern "C" [[noreturn]] void enterUsermode(uint64_t entry, uint64_t stack, uint64_t arg);
+extern Timer* globalTimer;
 
 Scheduler schedulerInstance;
 
+// Everyone waiting in join(), woken whenever a joinable thread exits.
+static WaitQueue joiners;
+
+// Serialises admission to the deadline class across CPUs.
+static Spinlock deadlineLock;
+
+// Fair threads of a group out of quota wait off the run queues until its
+// period ends. Deadline threads keep running on their own reservation.
+static bool groupThrottled(Thread* thread) {
+    return thread->getPolicy() != SchedPolicy::Deadline &&
+           ResourceGroups::get().isThrottled(thread->getProcess()->getGroup());
+}
+
 Scheduler& Scheduler::get() {
     return schedulerInstance;
 }
 
+static void idleLoop(void*) {
+    for (;;) {
+        Scheduler::get().schedule();
+        // Nothing else to run and the timer is stopped unless a timer
+        // event is due; sleep until an interrupt or a reschedule.
+        CPUIdle::get().enter(thisCPU());
+    }
+}
+
 void Scheduler::initialize() {
     if (initialized) return;
-    
-    currentProcess = nullptr;
-    processListHead = nullptr;
-    nextPID = 1;
+
     initialized = true;
+
+    initializeCPU(thisCPU());
+}
+
+void Scheduler::initializeCPU(CPUData* cpu) {
+    // Never queued and never in the PID table, it runs only when the CPU
+    // has nothing else to do.
+    Thread* idle = (new Process(0))->getMainThread();
+    idle->setKernelEntry(idleLoop);
+    idle->setState(ThreadState::Running);
+
+    cpu->idle = idle;
+    cpu->current = nullptr;
+    cpu->slice = 0;
+    cpu->timers.init(globalTimer ? globalTimer->getTicks() : 0);
 }
 
 void Scheduler::addProcess(Process* proc) {
     if (!proc) return;
-    
-    proc->next = nullptr;
-    
-    if (!processListHead) {
-        processListHead = proc;
-    } else {
-        Process* current = processListHead;
-        while (current->next) {
-            current = current->next;
+    addThread(proc->getMainThread());
+}
+
+void Scheduler::addThread(Thread* thread) {
+    if (!thread) return;
+
+    pids.insert(thread);
+    thread->setState(ThreadState::Ready);
+    thread->wokenAt = rdtsc();
+
+    PreemptGuard guard;
+    enqueue(thread);
+}
+
+// Queues a ready thread on the least loaded CPU and makes that CPU
+// reschedule if it should run instead of what is there now.
+void Scheduler::enqueue(Thread* thread) {
+    thread->active = true;
+
+    CPUData* cpu = nullptr;
+    if (thread->getPolicy() == SchedPolicy::Deadline) {
+        cpu = SMP::get().getCPU(thread->getDeadlineEntity()->cpu);
+    }
+    if (!cpu) cpu = pickCPU(thread);
+    cpu->runQueue.pushWoken(thread, globalTimer ? globalTimer->now() : 0);
+
+    Thread* running = cpu->current;
+    if (!running || running == cpu->idle || RunQueue::preempts(thread, running)) {
+        resched(cpu->id);
+    }
+}
+
+void Scheduler::resched(uint32_t id) {
+    CPUData* cpu = SMP::get().getCPU(id);
+    if (!cpu) return;
+
+    if (cpu == thisCPU()) {
+        cpu->needResched = true;
+        return;
+    }
+
+    // A CPU waiting in MWAIT wakes from the store alone.
+    __atomic_store_n(&cpu->needResched, true, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&cpu->polling, __ATOMIC_SEQ_CST)) {
+        SMP::get().sendIPI(cpu, VECTOR_RESCHEDULE);
+    }
+}
+
+// Takes an exited thread out of the PID table and hands it to the Reaper
+// once no lookup holds it, unless someone else already did or is joining it.
+bool Scheduler::reap(Thread* thread) {
+    if (!thread->claim()) return false;
+
+    pids.remove(thread);
+    release(thread);
+    return true;
+}
+
+void Scheduler::release(Thread* thread) {
+    if (thread && thread->drop()) Reaper::get().reap(thread);
+}
+
+ThreadRef::~ThreadRef() {
+    Scheduler::get().release(thread);
+}
+
+Thread* Scheduler::getCurrentThread() {
+    if (!initialized) return nullptr;
+    return currentThread();
+}
+
+Process* Scheduler::getCurrentProcess() {
+    Thread* current = getCurrentThread();
+    return current ? current->getProcess() : nullptr;
+}
+
+ThreadRef Scheduler::lookup(uint32_t tid) {
+    return ThreadRef(pids.lookup(tid));
+}
+
+// Least loaded online CPU the thread may run on, counting the thread each
+// is running. This one if none is allowed.
+CPUData* Scheduler::pickCPU(Thread* thread) {
+    SMP& smp = SMP::get();
+    CPUData* best = thisCPU();
+    size_t bestLoad = static_cast<size_t>(-1);
+
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* cpu = smp.getCPU(i);
+        if (!cpu || !cpu->online || !thread->canRunOn(cpu->id)) continue;
+
+        size_t load = cpu->runQueue.size();
+        if (cpu->current && cpu->current != cpu->idle) load++;
+
+        if (load < bestLoad) {
+            best = cpu;
+            bestLoad = load;
         }
-        current->next = proc;
     }
-    
+    return best;
 }
 
-void Scheduler::removeProcess(uint32_t pid) {
-    if (!processListHead) return;
-    
-    Process* toDelete = nullptr;
-    
-    if (processListHead->getPID() == pid) {
-        toDelete = processListHead;
-        processListHead = processListHead->next;
-    } else {
-        Process* current = processListHead;
-        while (current->next) {
-            if (current->next->getPID() == pid) {
-                toDelete = current->next;
-                current->next = current->next->next;
-                break;
-            }
-            current = current->next;
+// Takes the first thread allowed here from the longest queue of another
+// CPU. Only one queue lock is ever held at a time.
+Thread* Scheduler::steal(CPUData* cpu) {
+    SMP& smp = SMP::get();
+    CPUData* victim = nullptr;
+    size_t longest = 0;
+
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* other = smp.getCPU(i);
+        if (!other || other == cpu || !other->online) continue;
+
+        size_t length = other->runQueue.size();
+        if (length > longest) {
+            victim = other;
+            longest = length;
         }
     }
-    
-    if (toDelete) {
-        if (currentProcess == toDelete) currentProcess = nullptr;
-        delete toDelete;
+
+    if (!victim) return nullptr;
+
+    Thread* thread = victim->runQueue.steal(cpu->id);
+    if (thread) cpu->runQueue.adopt(thread);
+    return thread;
+}
+
+void Scheduler::switchTo(CPUData* cpu, Thread* prev, Thread* next) {
+    cpu->previous = prev;
+    cpu->current = next;
+    next->setState(ThreadState::Running);
+    next->onCPU = true;
+
+    if (next->getLastCPU() != static_cast<int>(cpu->id)) {
+        if (next->getLastCPU() >= 0) cpu->migrations++;
+        next->setLastCPU(cpu->id);
+    }
+
+    if (next->wokenAt) {
+        SchedStatistics::recordWakeup(cpu, next->getProcess()->getSchedStats(), rdtsc() - next->wokenAt);
+        next->wokenAt = 0;
+    }
+
+    cpu->kernelStack = next->getKernelStack();
+    cpu->gdt->setKernelStack(cpu->kernelStack);
+
+    // Join the new address space before leaving the old one so a shootdown
+    // never misses this CPU.
+    // A thread preempted inside the kernel may be running on a page table
+    // other than its own, so the live CR3 goes with it.
+    if (prev) {
+        asm volatile("mov %%cr3, %0" : "=r"(prev->getContext()->cr3));
+    }
+    next->getProcess()->getVMM()->markActive(cpu->id);
+    asm volatile("mov %0, %%cr3" :: "r"(next->getContext()->cr3) : "memory");
+    if (prev && prev->getProcess()->getVMM() != next->getProcess()->getVMM()) {
+        prev->getProcess()->getVMM()->markInactive(cpu->id);
+    }
+
+    FPU::get().switchTo(cpu, prev, next);
+
+    if (!prev || prev->getFSBase() != next->getFSBase()) {
+        wrmsr(MSR_FS_BASE, next->getFSBase());
     }
+
+    // Stopped by scheduleTail, on the other side of the switch.
+    uint64_t bootRsp;
+    cpu->switchStart = rdtsc();
+    switchContext(prev ? &prev->getContext()->rsp : &bootRsp, next->getContext()->rsp);
 }
 
-Process* Scheduler::getNextProcess() {
-    if (!currentProcess) {
-        return processListHead;
+void Scheduler::schedule() {
+    reschedule(false);
+}
+
+// Called on the way out of an interrupt that hit kernel code with
+// interrupts on, and when preemption is enabled again.
+void Scheduler::preempt() {
+    if (!initialized) return;
+
+    CPUData* cpu = thisCPU();
+    if (!cpu->needResched || cpu->preemptCount) return;
+
+    reschedule(true);
+}
+
+// A preempted thread keeps its place even if it had already marked itself
+// Blocked: it has not reached block() yet, and taking it off the CPU now
+// could lose a wakeup that came before it went on a wait queue.
+void Scheduler::reschedule(bool preempted) {
+    if (!initialized) return;
+
+    uint64_t flags = Spinlock::saveAndDisable();
+    CPUData* cpu = thisCPU();
+    Thread* prev = cpu->current;
+
+    cpu->needResched = false;
+    cpu->schedStats.schedules++;
+    account(cpu);
+
+    if (!preempted && prev && prev != cpu->idle) {
+        LockGuard guard(prev->wakeLock);
+        if (prev->getState() == ThreadState::Blocked) {
+            prev->active = false;
+        }
     }
-    
-    Process* next = currentProcess->next;
-    if (!next) {
-        next = processListHead;
-    }
-    
-    int iterations = 0;
-    while (next && next->getState() != ProcessState::Ready && next->getState() != ProcessState::Running) {
-        iterations++;
-        next = next->next;
-        if (!next) {
-            next = processListHead;
+
+    // A throttled deadline thread, or one admitted on another CPU, has to
+    // give up this one even if nothing else is waiting.
+    ThreadState state = prev ? prev->getState() : ThreadState::Terminated;
+    bool runnable = prev && prev != cpu->idle &&
+                    (state == ThreadState::Running || (preempted && state == ThreadState::Blocked)) &&
+                    prev->canRunOn(cpu->id) &&
+                    !(prev->getPolicy() == SchedPolicy::Deadline && prev->getDeadlineEntity()->throttled) &&
+                    !groupThrottled(prev);
+
+    // Queued here before its affinity changed, or before its group ran out
+    // of quota.
+    Thread* next = cpu->runQueue.pop(runnable ? prev : nullptr);
+    while (next) {
+        if (!next->canRunOn(cpu->id) && pickCPU(next) != cpu) {
+            enqueue(next);
+        } else if (!park(next)) {
+            break;
         }
-        if (next == currentProcess) {
-            return nullptr;
+        next = cpu->runQueue.pop(runnable ? prev : nullptr);
+    }
+    if (!next && !runnable) {
+        next = steal(cpu);
+        if (next && park(next)) next = nullptr;
+    }
+
+    if (!next) {
+        // Nothing should replace the current thread, or the idle task.
+        if (runnable || (prev && prev == cpu->idle)) {
+            cpu->slice = cpu->runQueue.sliceFor(prev);
+            clampSlice(cpu, prev);
+            rearm(cpu, prev);
+            Spinlock::restore(flags);
+            return;
         }
+        next = cpu->idle;
     }
-    
-    return next;
-}
 
-void Scheduler::schedule() {
-    if (!initialized || !processListHead) return;
-    
-    if (currentProcess) {
-        currentProcess->handlePendingSignals();
-    }
-    
-    Process* nextProcess = getNextProcess();
-    if (!nextProcess || nextProcess == currentProcess) {
-        return;
+    if (prev && prev != cpu->idle) {
+        bool involuntary = state == ThreadState::Running || (preempted && state == ThreadState::Blocked);
+        SchedStatistics::recordSwitch(cpu, prev->getProcess()->getSchedStats(), involuntary);
     }
-        
-    Process* oldProcess = currentProcess;
-    
-    // Update kernel stack BEFORE switching
-    Syscall::get().setKernelStack(nextProcess->getKernelStack());
-    
-    // Update state
-    if (oldProcess && oldProcess->getState() == ProcessState::Running) {
-        oldProcess->setState(ProcessState::Ready);
-    }
-    nextProcess->setState(ProcessState::Running);
-    
-    // Update currentProcess BEFORE the switch
-    // This is critical - we update it before switching so when we return
-    // from the context switch, currentProcess is already correct
-    currentProcess = nextProcess;
-    
-    // Disable interrupts during context switch
-    asm volatile("cli");
-    
-    // Perform the actual context switch
-    // We always save the old context, even if terminated, because we need to
-    // properly return from the interrupt handler
-    if (oldProcess) {
-        switchContext(oldProcess->getContext(), nextProcess->getContext());
-    } else {
-        switchContext(nullptr, nextProcess->getContext());
-    }
-    
-    // When we return here, we're running as the "new" process
-    // currentProcess should already be correct
-    
-    // Re-enable interrupts after switch
-    asm volatile("sti");
-    
-    // Clean up terminated processes AFTER switching away from them
-    // We check oldProcess here because we've already switched to the new process
-    if (oldProcess && oldProcess->getState() == ProcessState::Terminated) {
-        removeProcess(oldProcess->getPID());
-    }
-}
-extern "C" void processTrampoline();
-
-void Scheduler::schedule(InterruptFrame* frame) {
-    if (!initialized || !processListHead || !frame) return;
-    
-    Process* nextProcess = getNextProcess();
-    if (!nextProcess || nextProcess == currentProcess) {
-        return;
+
+    cpu->slice = cpu->runQueue.sliceFor(next);
+    clampSlice(cpu, next);
+    rearm(cpu, next);
+    switchTo(cpu, prev, next);
+
+    // Back on this thread's stack, possibly on another CPU.
+    scheduleTail();
+    Spinlock::restore(flags);
+}
+
+// Finishes a switch on the new stack: the previous thread is only queued
+// or freed here, once nothing runs on its kernel stack any more.
+void Scheduler::scheduleTail() {
+    CPUData* cpu = thisCPU();
+    Thread* prev = cpu->previous;
+    cpu->previous = nullptr;
+
+    if (cpu->switchStart) {
+        Thread* current = cpu->current;
+        SchedStats* stats = current == cpu->idle ? nullptr : current->getProcess()->getSchedStats();
+        SchedStatistics::recordSwitchTime(cpu, stats, rdtsc() - cpu->switchStart);
+        cpu->switchStart = 0;
     }
-        
-    Process* oldProcess = currentProcess;
-    
-    // Save current process state from interrupt frame
-    // BUT only if we interrupted usermode (CS = 0x1B)
-    // If we interrupted kernel mode (CS = 0x08), don't save - the process
-    // context still has the correct user-mode state from before the syscall
-    if (oldProcess && frame->cs == 0x1B) {
-        // The interrupt frame contains the user-mode state that was interrupted
-        // Save it into the process context
-        oldProcess->getContext()->rip = frame->rip;
-        oldProcess->getContext()->rsp = frame->rsp;
-        oldProcess->getContext()->rflags = frame->rflags;
-        oldProcess->getContext()->rax = frame->rax;
-        oldProcess->getContext()->rbx = frame->rbx;
-        oldProcess->getContext()->rcx = frame->rcx;
-        oldProcess->getContext()->rdx = frame->rdx;
-        oldProcess->getContext()->rsi = frame->rsi;
-        oldProcess->getContext()->rdi = frame->rdi;
-        oldProcess->getContext()->rbp = frame->rbp;
-        oldProcess->getContext()->r8 = frame->r8;
-        oldProcess->getContext()->r9 = frame->r9;
-        oldProcess->getContext()->r10 = frame->r10;
-        oldProcess->getContext()->r11 = frame->r11;
-        // r12-r15 are NOT in InterruptFrame - don't try to save them
-        
-        // Mark that this process now has valid saved user state
-        oldProcess->setValidUserState(true);
-        
-        if (oldProcess->getState() == ProcessState::Running) {
-            oldProcess->setState(ProcessState::Ready);
+
+    if (!prev) return;
+
+    // The state has to be read first: once onCPU is clear a waker may queue
+    // the thread and another CPU may already be running it. A preempted
+    // thread that was about to block is still active and goes back too.
+    ThreadState state = prev->getState();
+    bool active = prev->active;
+    __atomic_store_n(&prev->onCPU, false, __ATOMIC_SEQ_CST);
+    if (prev == cpu->idle) return;
+
+    if (state == ThreadState::Terminated) {
+        // Read after onCPU is clear: the last thread of an exiting process
+        // either sees this one off its CPU and reaps it, or is seen here.
+        bool reaped = (prev->isDetached() || prev->getProcess()->isExiting()) && reap(prev);
+        if (!reaped) joiners.wakeAll();
+    } else if (state == ThreadState::Running || (state == ThreadState::Blocked && active)) {
+        prev->setState(ThreadState::Ready);
+        if (park(prev)) return;
+        if (!prev->canRunOn(cpu->id)) {
+            enqueue(prev);
+            return;
         }
-    } else if (oldProcess) {
-        // We interrupted kernel mode - just mark as ready
-        if (oldProcess->getState() == ProcessState::Running) {
-            oldProcess->setState(ProcessState::Ready);
+        cpu->runQueue.push(prev);
+        kickIdle(cpu);
+    }
+}
+
+// Idle CPUs have their timer stopped and no longer look for work to steal
+// on their own, so one of them is woken whenever work is left waiting here.
+void Scheduler::kickIdle(CPUData* cpu) {
+    SMP& smp = SMP::get();
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* other = smp.getCPU(i);
+        if (!other || other == cpu || !other->online) continue;
+
+        if (other->current == other->idle) {
+            resched(other->id);
+            return;
         }
     }
-    
-    // Check if next process has ever run in usermode
-    // If RIP points to processTrampoline, this is the first time
-    uint64_t trampolineAddr = reinterpret_cast<uint64_t>(&processTrampoline);
-    
-    // Check if we interrupted usermode or kernel mode
-    // If CS != 0x1B, we're in kernel mode and can't do a context switch via interrupt frame
-    if (frame->cs != 0x1B) {
-        // Don't switch - keep running current process
-        if (oldProcess) {
-            oldProcess->setState(ProcessState::Running);
-            currentProcess = oldProcess;
+}
+
+// Charges the time since the last call to the running thread.
+void Scheduler::account(CPUData* cpu) {
+    uint64_t now = globalTimer ? globalTimer->now() : 0;
+    uint64_t delta = now - cpu->execStart;
+    cpu->execStart = now;
+
+    Thread* current = cpu->current;
+    if (!current || current == cpu->idle) return;
+
+    if (cpu->runQueue.charge(current, delta, now)) {
+        throttle(cpu, current);
+    }
+    cpu->slice -= delta;
+
+    ResourceGroup* group = current->getProcess()->getGroup();
+    if (ResourceGroups::get().chargeCPU(group, delta, now, current->getPolicy() != SchedPolicy::Deadline)) {
+        throttleGroup(cpu, group);
+    }
+}
+
+static void endGroupPeriod(TimerEvent* event) {
+    Scheduler::get().unthrottle(static_cast<ResourceGroup*>(event->data));
+}
+
+// Only the CPU whose charge used up the quota arms the timer. Threads of the
+// group on other CPUs are taken off at their next tick.
+void Scheduler::throttleGroup(CPUData* cpu, ResourceGroup* group) {
+    group->timer.expires = (group->periodStart + group->period + TICK_NS - 1) / TICK_NS;
+    group->timer.callback = endGroupPeriod;
+    group->timer.data = group;
+    cpu->timers.add(&group->timer);
+
+    cpu->needResched = true;
+}
+
+bool Scheduler::park(Thread* thread) {
+    return groupThrottled(thread) && ResourceGroups::get().park(thread->getProcess()->getGroup(), thread);
+}
+
+void Scheduler::unthrottle(ResourceGroup* group) {
+    Thread* thread = ResourceGroups::get().unthrottle(group, globalTimer ? globalTimer->now() : 0);
+    while (thread) {
+        Thread* next = thread->runNext;
+        thread->runNext = nullptr;
+        enqueue(thread);
+        thread = next;
+    }
+}
+
+// A slice never outlasts what is left of the group's quota, so a group
+// alone on a CPU stops close to it.
+void Scheduler::clampSlice(CPUData* cpu, Thread* thread) {
+    if (thread == cpu->idle || thread->getPolicy() == SchedPolicy::Deadline) return;
+
+    uint64_t left = ResourceGroups::get().remaining(thread->getProcess()->getGroup(), cpu->execStart);
+    if (left < static_cast<uint64_t>(cpu->slice)) {
+        cpu->slice = static_cast<int64_t>(left);
+    }
+}
+
+static void replenishDeadline(TimerEvent* event) {
+    Scheduler::get().replenish(static_cast<Thread*>(event->data));
+}
+
+// Takes a deadline thread out of budget off the CPU until its next period.
+// It stays on its run queue, skipped until the timer replenishes it.
+void Scheduler::throttle(CPUData* cpu, Thread* thread) {
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    dl->timer.expires = (DeadlineQueue::nextPeriod(thread) + TICK_NS - 1) / TICK_NS;
+    dl->timer.callback = replenishDeadline;
+    dl->timer.data = thread;
+    cpu->timers.add(&dl->timer);
+
+    cpu->needResched = true;
+}
+
+void Scheduler::replenish(Thread* thread) {
+    CPUData* cpu = SMP::get().getCPU(thread->getDeadlineEntity()->cpu);
+    if (!cpu || !cpu->runQueue.replenish(thread, globalTimer ? globalTimer->now() : 0)) return;
+
+    Thread* running = cpu->current;
+    if (!running || running == cpu->idle || RunQueue::preempts(thread, running)) {
+        resched(cpu->id);
+    }
+}
+
+// The CPU the thread is on if it has room, otherwise the allowed one with
+// the most left. The bandwidth is the sufficient EDF bound runtime/deadline,
+// so every admitted job meets its deadline.
+CPUData* Scheduler::pickDeadlineCPU(Thread* thread, uint64_t bandwidth, CPUData* preferred) {
+    uint64_t affinity = thread->getProcess()->getAffinity();
+    auto fits = [&](CPUData* cpu) {
+        return cpu && cpu->online && (affinity & (1ULL << cpu->id)) &&
+               cpu->deadlineBandwidth + bandwidth <= DEADLINE_BW_LIMIT;
+    };
+    if (fits(preferred)) return preferred;
+
+    SMP& smp = SMP::get();
+    CPUData* best = nullptr;
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* cpu = smp.getCPU(i);
+        if (fits(cpu) && (!best || cpu->deadlineBandwidth < best->deadlineBandwidth)) {
+            best = cpu;
         }
-        
-        return;
     }
-    
-    // From an interrupt handler, we can ONLY schedule processes with valid user state
-    // We cannot use switchContext because it would save kernel-mode state
-    if (!nextProcess->hasValidUserState()) {
-        // Don't switch - keep running old process
-        if (oldProcess) {
-            oldProcess->setState(ProcessState::Running);
-            currentProcess = oldProcess;
+    return best;
+}
+
+bool Scheduler::setDeadline(Thread* thread, uint64_t runtime, uint64_t deadline, uint64_t period) {
+    if (!initialized || thread != getCurrentThread()) return false;
+    if (runtime && (runtime < DEADLINE_MIN_RUNTIME_NS || runtime > deadline || deadline > period ||
+                    period < TICK_NS || period > DEADLINE_MAX_PERIOD_NS)) {
+        return false;
+    }
+    uint64_t bandwidth = runtime ? (runtime << DEADLINE_BW_SHIFT) / deadline : 0;
+
+    uint64_t flags = Spinlock::saveAndDisable();
+    CPUData* cpu = thisCPU();
+    account(cpu);
+
+    DeadlineEntity* dl = thread->getDeadlineEntity();
+    CPUData* old = thread->getPolicy() == SchedPolicy::Deadline ? SMP::get().getCPU(dl->cpu) : nullptr;
+    CPUData* home = nullptr;
+
+    deadlineLock.lock();
+    if (old) old->deadlineBandwidth -= dl->bandwidth;
+    if (bandwidth) {
+        home = pickDeadlineCPU(thread, bandwidth, cpu);
+        if (!home) {
+            if (old) old->deadlineBandwidth += dl->bandwidth;
+            deadlineLock.unlock();
+            Spinlock::restore(flags);
+            return false;
         }
-        
-        return;
+        home->deadlineBandwidth += bandwidth;
+    }
+    deadlineLock.unlock();
+
+    TimerWheel::cancel(&dl->timer);
+    dl->throttled = false;
+    dl->bandwidth = bandwidth;
+
+    if (!bandwidth) {
+        thread->setPolicy(SchedPolicy::Fair);
+    } else {
+        dl->runtime = runtime;
+        dl->deadline = deadline;
+        dl->period = period;
+        dl->cpu = home->id;
+        dl->absDeadline = cpu->execStart + deadline;
+        dl->remaining = runtime;
+        thread->setPolicy(SchedPolicy::Deadline);
+    }
+
+    // Picks a new slice, and moves the thread if it was admitted elsewhere.
+    cpu->needResched = true;
+    Spinlock::restore(flags);
+    return true;
+}
+
+bool Scheduler::setPriority(Thread* thread, int priority) {
+    if (!initialized || thread != getCurrentThread() || priority >= PRIORITY_LEVELS) return false;
+
+    // A deadline reservation is given back first.
+    if (thread->getPolicy() == SchedPolicy::Deadline && !setDeadline(thread, 0, 0, 0)) return false;
+
+    uint64_t flags = Spinlock::saveAndDisable();
+    CPUData* cpu = thisCPU();
+    account(cpu);
+
+    if (priority < 0) {
+        thread->setPolicy(SchedPolicy::Fair);
+    } else {
+        thread->setPriority(priority);
+        thread->setPolicy(SchedPolicy::Fixed);
     }
-    
-    // Process has valid user state - load into interrupt frame
-    if (nextProcess->hasValidUserState()) {
-        // Process has run before and has valid saved state - load into interrupt frame
-        frame->rip = nextProcess->getContext()->rip;
-        frame->rsp = nextProcess->getContext()->rsp;
-        frame->rflags = nextProcess->getContext()->rflags;
-        frame->rax = nextProcess->getContext()->rax;
-        frame->rbx = nextProcess->getContext()->rbx;
-        frame->rcx = nextProcess->getContext()->rcx;
-        frame->rdx = nextProcess->getContext()->rdx;
-        frame->rsi = nextProcess->getContext()->rsi;
-        frame->rdi = nextProcess->getContext()->rdi;
-        frame->rbp = nextProcess->getContext()->rbp;
-        frame->r8 = nextProcess->getContext()->r8;
-        frame->r9 = nextProcess->getContext()->r9;
-        frame->r10 = nextProcess->getContext()->r10;
-        frame->r11 = nextProcess->getContext()->r11;
-        // r12-r15 are NOT in InterruptFrame, they're callee-saved
-        
-        // Update kernel stack
-        Syscall::get().setKernelStack(nextProcess->getKernelStack());
-        
-        // Switch page tables
-        uint64_t newCR3 = nextProcess->getContext()->cr3;
-        asm volatile("mov %0, %%cr3" :: "r"(newCR3) : "memory");
-        
-        // Update state
-        nextProcess->setState(ProcessState::Running);
-        currentProcess = nextProcess;
+
+    cpu->needResched = true;
+    Spinlock::restore(flags);
+    return true;
+}
+
+// Programs this CPU's timer for the end of the slice of thread or the next
+// timer wheel expiry, whichever comes first. With neither, as when idle
+// with no timers pending, the timer is stopped.
+void Scheduler::rearm(CPUData* cpu, Thread* thread) {
+    if (!globalTimer) return;
+
+    uint64_t deadline = UINT64_MAX;
+    if (thread != cpu->idle) {
+        // An expired slice is retried every tick until the kernel gets to
+        // reschedule.
+        uint64_t remaining = cpu->slice > 0 ? cpu->slice : TICK_NS;
+        deadline = cpu->execStart + remaining;
+    }
+
+    uint64_t expiry = cpu->timers.nextExpiry();
+    if (expiry != UINT64_MAX && expiry * TICK_NS < deadline) {
+        deadline = expiry * TICK_NS;
+    }
+
+    if (deadline == UINT64_MAX) {
+        globalTimer->stop();
     } else {
-        // Update kernel stack
-        Syscall::get().setKernelStack(nextProcess->getKernelStack());
-        
-        // Update state
-        nextProcess->setState(ProcessState::Running);
-        currentProcess = nextProcess;
-        
-        // Disable interrupts during context switch
-        asm volatile("cli");
-        
-        // Perform context switch
-        if (oldProcess) {
-            switchContext(oldProcess->getContext(), nextProcess->getContext());
-        } else {
-            switchContext(nullptr, nextProcess->getContext());
+        globalTimer->arm(deadline);
+    }
+}
+
+void Scheduler::updateLoad(CPUData* cpu, uint64_t now) {
+    uint64_t intervals = (now - cpu->loadStamp) / BALANCE_INTERVAL_NS;
+    if (!intervals) return;
+    cpu->loadStamp += intervals * BALANCE_INTERVAL_NS;
+
+    uint64_t queued = cpu->runQueue.size();
+    uint64_t sample = queued;
+    if (cpu->current && cpu->current != cpu->idle) sample++;
+    sample <<= LOAD_SHIFT;
+
+    // Anything older than this has decayed away, and fills the whole trace.
+    if (intervals > 32) intervals = 32;
+    while (intervals--) {
+        cpu->loadAvg = cpu->loadAvg - cpu->loadAvg / LOAD_DECAY + sample / LOAD_DECAY;
+        cpu->queueTrace[cpu->queueTraceHead] = queued;
+        cpu->queueTraceHead = (cpu->queueTraceHead + 1) % QUEUE_TRACE_LENGTH;
+    }
+}
+
+// Pulls threads from the CPU with the highest load average that has any
+// queued, half the difference at most, so the two end up about even. Idle
+// CPUs have no tick and steal for themselves instead.
+void Scheduler::balance(CPUData* cpu, uint64_t now) {
+    updateLoad(cpu, now);
+    if (now - cpu->lastBalance < BALANCE_INTERVAL_NS) return;
+    cpu->lastBalance = now;
+
+    SMP& smp = SMP::get();
+    CPUData* busiest = nullptr;
+    uint64_t busiestLoad = cpu->loadAvg;
+    for (uint32_t i = 0; i < smp.getCPUCount(); i++) {
+        CPUData* other = smp.getCPU(i);
+        if (!other || other == cpu || !other->online || !other->runQueue.size()) continue;
+
+        uint64_t load = __atomic_load_n(&other->loadAvg, __ATOMIC_RELAXED);
+        if (load > busiestLoad) {
+            busiest = other;
+            busiestLoad = load;
+        }
+    }
+    if (!busiest) return;
+
+    uint64_t moves = ((busiestLoad - cpu->loadAvg) / 2) >> LOAD_SHIFT;
+    if (moves > BALANCE_MAX_MOVES) moves = BALANCE_MAX_MOVES;
+
+    for (; moves; moves--) {
+        Thread* thread = busiest->runQueue.steal(cpu->id);
+        if (!thread) break;
+
+        cpu->runQueue.adopt(thread);
+        cpu->runQueue.push(thread);
+        cpu->balanced++;
+
+        Thread* running = cpu->current;
+        if (!running || running == cpu->idle || RunQueue::preempts(thread, running)) {
+            cpu->needResched = true;
         }
-        
-        // Re-enable interrupts after switch
-        asm volatile("sti");
     }
-    
-    // Clean up terminated processes - DISABLED: causes crashes when called from interrupt
-    // TODO: Implement deferred cleanup or fix removeProcess to be interrupt-safe
-    // if (oldProcess && oldProcess->getState() == ProcessState::Terminated) {
-    //     removeProcess(oldProcess->getPID());
-    // }
+}
+
+bool Scheduler::setAffinity(Process* process, uint64_t mask) {
+    if (!(mask & SMP::get().getOnlineMask())) return false;
+
+    Thread* mainThread = process->getMainThread();
+    if (mainThread && mainThread->isKernelTask()) return false;
+
+    LockGuard guard(deadlineLock);
+    if (!process->allowsDeadlineThreads(mask)) return false;
+    process->setAffinity(mask);
+    process->migrateThreads();
+    return true;
 }
 
 void Scheduler::yield() {
     schedule();
 }
 
-void Scheduler::scheduleFromSyscall() {
-    if (!initialized || !processListHead) return;
-    
-    Process* nextProcess = getNextProcess();
-    if (!nextProcess || nextProcess == currentProcess) {
-        return;
+// The caller sets its state to Blocked before arranging for wake(), so a
+// wakeup that comes before this call is not lost.
+void Scheduler::block() {
+    schedule();
+}
+
+bool Scheduler::wake(Thread* thread) {
+    if (!thread) return false;
+
+    LockGuard guard(thread->wakeLock);
+    if (thread->getState() != ThreadState::Blocked) return false;
+
+    // Not yet through schedule(), which will now keep it running.
+    if (thread->active) {
+        thread->setState(ThreadState::Running);
+        return true;
+    }
+
+    thread->setState(ThreadState::Ready);
+    thread->wokenAt = rdtsc();
+    while (__atomic_load_n(&thread->onCPU, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+
+    enqueue(thread);
+    return true;
+}
+
+static void wakeSleeper(TimerEvent* event) {
+    Scheduler::get().wake(static_cast<Thread*>(event->data));
+}
+
+// Returns false when a signal ended the sleep early.
+bool Scheduler::sleep(uint64_t ns) {
+    Thread* current = getCurrentThread();
+    if (!current || !globalTimer) return false;
+
+    TimerEvent event = {};
+    event.expires = (globalTimer->now() + ns + TICK_NS - 1) / TICK_NS;
+    event.callback = wakeSleeper;
+    event.data = current;
+
+    uint64_t flags = Spinlock::saveAndDisable();
+    current->setState(ThreadState::Blocked);
+    if (current->hasPendingSignals()) {
+        current->trySetState(ThreadState::Blocked, ThreadState::Running);
+        Spinlock::restore(flags);
+        return false;
     }
-    
-    Process* oldProcess = currentProcess;
-    
-    // DON'T save old context - we already saved user state on syscall entry
-    // Just mark as ready
-    if (oldProcess && oldProcess->getState() == ProcessState::Running) {
-        oldProcess->setState(ProcessState::Ready);
-    }
-    
-    // Update kernel stack
-    Syscall::get().setKernelStack(nextProcess->getKernelStack());
-    
-    // Update state
-    nextProcess->setState(ProcessState::Running);
-    currentProcess = nextProcess;
-    
-    // Disable interrupts during context switch
-    asm volatile("cli");
-    
-    // Switch to new process WITHOUT saving old context
-    // Pass nullptr for old context
-    switchContext(nullptr, nextProcess->getContext());
-    
-    // Re-enable interrupts after switch
-    asm volatile("sti");
-    
-    // Clean up terminated processes
-    if (oldProcess && oldProcess->getState() == ProcessState::Terminated) {
-        removeProcess(oldProcess->getPID());
+
+    thisCPU()->timers.add(&event);
+    block();
+    Spinlock::restore(flags);
+
+    return !TimerWheel::cancel(&event);
+}
+
+void Scheduler::tick() {
+    if (!initialized) return;
+
+    CPUData* cpu = thisCPU();
+    cpu->ticks++;
+
+    cpu->timers.advance(globalTimer->getTicks());
+    account(cpu);
+    balance(cpu, cpu->execStart);
+
+    if (cpu->current != cpu->idle && (cpu->slice <= 0 || (cpu->current && groupThrottled(cpu->current)))) {
+        cpu->needResched = true;
     }
+    rearm(cpu, cpu->current);
+}
+
+// Called on every way back to user mode, with the user frame still on the
+// kernel stack.
+void Scheduler::returnToUser() {
+    if (!initialized) return;
+
+    if (thisCPU()->needResched) {
+        schedule();
+    }
+
+    CPUData* cpu = thisCPU();
+    Thread* current = cpu->current;
+    if (!current || current == cpu->idle) return;
+
+    current->handlePendingSignals();
+    if (current->getState() == ThreadState::Terminated) {
+        exit(current->getExitCode());
+    }
+}
+
+// Ends the calling thread. The process goes with its last thread.
+void Scheduler::exit(int code) {
+    Thread* current = getCurrentThread();
+    if (current->getPolicy() == SchedPolicy::Deadline) {
+        setDeadline(current, 0, 0, 0);
+    }
+    current->setExitCode(code);
+    current->getProcess()->threadExited(current);
+
+    Spinlock::saveAndDisable();
+    current->setState(ThreadState::Terminated);
+
+    schedule();
+
+    for (;;) {
+        asm volatile("hlt");
+    }
+}
+
+// Leaves the boot stack for good.
+void Scheduler::start() {
+    Spinlock::saveAndDisable();
+
+    CPUData* cpu = thisCPU();
+    Thread* next = cpu->runQueue.pop();
+    if (!next) next = steal(cpu);
+    if (!next) next = cpu->idle;
+
+    cpu->execStart = globalTimer ? globalTimer->now() : 0;
+    cpu->slice = cpu->runQueue.sliceFor(next);
+    rearm(cpu, next);
+
+    switchTo(cpu, nullptr, next);
+
+    for (;;) {
+        asm volatile("hlt");
+    }
+}
+
+// Waits for a joinable thread of the caller's process to exit and frees it.
+// The claim keeps anyone else from freeing the thread in the meantime.
+bool Scheduler::join(uint32_t tid, int* code) {
+    Thread* current = getCurrentThread();
+    ThreadRef ref = lookup(tid);
+    Thread* target = ref.get();
+    if (!current || !target || target == current) return false;
+    if (target->getProcess() != current->getProcess() || target->isDetached()) return false;
+    if (!target->claim()) return false;
+
+    bool exited = joiners.waitUntil([&] {
+        return target->getState() == ThreadState::Terminated &&
+               !__atomic_load_n(&target->onCPU, __ATOMIC_SEQ_CST);
+    });
+    if (!exited) {
+        target->unclaim();
+        return false;
+    }
+
+    if (code) *code = target->getExitCode();
+    pids.remove(target);
+    release(target);
+    return true;
 }
 
 uint32_t Scheduler::allocatePID() {
-    return nextPID++;
+    return pids.allocate();
 }
 
-Process* Scheduler::getProcessByPID(uint32_t pid) {
-    Process* current = processListHead;
-    while (current) {
-        if (current->getPID() == pid) {
-            return current;
-        }
-        current = current->next;
+void Scheduler::releasePID(uint32_t pid) {
+    pids.release(pid);
+}
+
+extern "C" void taskStart() {
+    Scheduler& scheduler = Scheduler::get();
+    scheduler.scheduleTail();
+
+    Thread* current = scheduler.getCurrentThread();
+    if (current->getKernelEntry()) {
+        asm volatile("sti");
+        current->getKernelEntry()(reinterpret_cast<void*>(current->getEntryArg()));
+        scheduler.exit(0);
     }
-    return nullptr;
+
+    enterUsermode(current->getEntry(), current->getUserStack(), current->getEntryArg());
 }
@@ -1,36 +1,125 @@
 #pragma once
 
 #include "process.hpp"
+#include "pidtable.hpp"
+#include <cpu/smp/cpu.hpp>
+#include <cpu/smp/spinlock.hpp>
 #include <cpu/idt/interrupt.hpp>
 #include <cstdint>
 
+// Retry interval for an expired slice the kernel has not acted on yet.
+constexpr uint64_t TICK_NS = 1000000;
+
+// Each busy CPU pulls work towards itself this often. Load averages decay
+// by 1/LOAD_DECAY per interval.
+constexpr uint64_t BALANCE_INTERVAL_NS = 8000000;
+constexpr uint64_t LOAD_SHIFT = 10;
+constexpr uint64_t LOAD_DECAY = 8;
+constexpr int BALANCE_MAX_MOVES = 4;
+
+// What SchedCPUInfo reports about one CPU.
+struct CPUSchedInfo {
+    uint64_t loadAvg;      // in units of 1 << LOAD_SHIFT
+    uint64_t queued;
+    uint64_t migrations;
+    uint64_t balanced;
+    uint64_t idleTime;     // ns
+    uint64_t idleEntries;
+    uint64_t queuePeak;
+    uint32_t queueTrace[QUEUE_TRACE_LENGTH];   // oldest sample first
+};
+
+// A thread found by ID. It and its process are not freed before the
+// reference goes out of scope, even if the thread exits meanwhile.
+class ThreadRef {
+public:
+    explicit ThreadRef(Thread* thread) : thread(thread) {}
+    ~ThreadRef();
+
+    ThreadRef(const ThreadRef&) = delete;
+    ThreadRef& operator=(const ThreadRef&) = delete;
+
+    Thread* get() const { return thread; }
+    Process* process() const { return thread ? thread->getProcess() : nullptr; }
+
+private:
+    Thread* thread;
+};
+
 class Scheduler {
 public:
-    Scheduler() : currentProcess(nullptr), processListHead(nullptr), nextPID(1), initialized(false) {}
-    
+    Scheduler() : initialized(false) {}
+
     static Scheduler& get();
-    
+
     void initialize();
+    void initializeCPU(CPUData* cpu);
+    // Starts the main thread of proc, or another thread.
     void addProcess(Process* proc);
-    void removeProcess(uint32_t pid);
-    
-    Process* getCurrentProcess() { return currentProcess; }
-    void setCurrentProcess(Process* proc) { currentProcess = proc; }
-    Process* getNextProcess();
-    Process* getProcessByPID(uint32_t pid);
-    
+    void addThread(Thread* thread);
+    bool reap(Thread* thread);
+    bool join(uint32_t tid, int* code);
+
+    Thread* getCurrentThread();
+    Process* getCurrentProcess();
+    // Any TID of a process finds it, not only its PID.
+    ThreadRef lookup(uint32_t tid);
+    // Drops a reference taken by lookup().
+    void release(Thread* thread);
+
     void schedule();
-    void schedule(struct InterruptFrame* frame);
-    void scheduleFromSyscall();  // Special version that doesn't save old context
+    void preempt();
     void yield();
-    
+    void block();
+    bool wake(Thread* thread);
+    bool sleep(uint64_t ns);
+    // Admits the calling thread to the deadline class, or with runtime 0
+    // takes it out. False if no CPU has the bandwidth left.
+    bool setDeadline(Thread* thread, uint64_t runtime, uint64_t deadline, uint64_t period);
+    // Moves the calling thread to the fixed priority class at priority, or
+    // with a negative one back to the fair class.
+    bool setPriority(Thread* thread, int priority);
+    void replenish(Thread* thread);
+    // Ends the period of a throttled group and queues its parked threads.
+    void unthrottle(ResourceGroup* group);
+    // Restricts every thread of process to the CPUs in mask, of which at
+    // least one has to be online. Kernel tasks keep their placement.
+    bool setAffinity(Process* process, uint64_t mask);
+    // Makes cpu pick its next thread again as soon as it can.
+    void resched(uint32_t cpu);
+    void tick();
+    void scheduleTail();
+    void returnToUser();
+    [[noreturn]] void exit(int code);
+    [[noreturn]] void start();
+
+    // PIDs and TIDs alike. 0 when every ID is in use. An ID is released when
+    // its thread or process is freed, not when it exits.
     uint32_t allocatePID();
-    
+    void releasePID(uint32_t pid);
+
 private:
-    Process* currentProcess;
-    Process* processListHead;
-    uint32_t nextPID;
+    // Every thread but the idle tasks.
+    PIDTable pids;
     bool initialized;
+
+    void reschedule(bool preempted);
+    void enqueue(Thread* thread);
+    Thread* steal(CPUData* cpu);
+    void kickIdle(CPUData* cpu);
+    void account(CPUData* cpu);
+    void throttle(CPUData* cpu, Thread* thread);
+    void throttleGroup(CPUData* cpu, ResourceGroup* group);
+    bool park(Thread* thread);
+    void clampSlice(CPUData* cpu, Thread* thread);
+    CPUData* pickDeadlineCPU(Thread* thread, uint64_t bandwidth, CPUData* preferred);
+    void rearm(CPUData* cpu, Thread* thread);
+    CPUData* pickCPU(Thread* thread);
+    void updateLoad(CPUData* cpu, uint64_t now);
+    void balance(CPUData* cpu, uint64_t now);
+    void switchTo(CPUData* cpu, Thread* prev, Thread* next);
 };
 
-extern "C" void switchContext(ProcessContext* oldCtx, ProcessContext* newCtx);
+extern "C" void switchContext(uint64_t* oldRsp, uint64_t newRsp);
+extern "C" void taskTrampoline();
+extern "C" [[noreturn]] void taskStart();
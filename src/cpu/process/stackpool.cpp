@@ -0,0 +1,99 @@
+#include "stackpool.hpp"
+#include <cpu/mm/pmm.hpp>
+#include <cpu/mm/vmm.hpp>
+
+static_assert(KERNEL_STACK_SLOTS * (KERNEL_STACK_PAGES + 1) * PAGE_SIZE <= KERNEL_WINDOW_SIZE);
+
+StackPool& StackPool::get() {
+    static StackPool instance;
+    return instance;
+}
+
+uint64_t StackPool::slotTop(size_t slot) {
+    return KERNEL_STACK_BASE + (slot + 1) * SLOT_PAGES * PAGE_SIZE;
+}
+
+size_t StackPool::topSlot(uint64_t top) {
+    return (top - KERNEL_STACK_BASE) / (SLOT_PAGES * PAGE_SIZE) - 1;
+}
+
+void StackPool::initialize() {
+    uint64_t tops[INITIAL_STACKS];
+    for (size_t i = 0; i < INITIAL_STACKS; i++) {
+        tops[i] = allocate();
+    }
+    for (size_t i = 0; i < INITIAL_STACKS; i++) {
+        free(tops[i]);
+    }
+}
+
+bool StackPool::slotIsFree(void* base) {
+    for (size_t i = 0; i < KERNEL_STACK_PAGES; i++) {
+        PageTableEntry* entry = vmm.getEntry(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(base) + i * PAGE_SIZE));
+        if (entry && entry->hasFlag(PTE_PRESENT)) return false;
+    }
+    return true;
+}
+
+// Called with the lock held. The page tables of the window are shared by
+// every address space and only ever grow, so mapping needs no shootdown.
+uint64_t StackPool::mapSlot() {
+    for (size_t i = 0; i < KERNEL_STACK_SLOTS; i++) {
+        size_t slot = (slotHint + i) % KERNEL_STACK_SLOTS;
+        if (slots[slot / 64] & (1ULL << (slot % 64))) continue;
+
+        // mapRange would silently replace whatever else got mapped here.
+        uint64_t top = slotTop(slot);
+        void* base = reinterpret_cast<void*>(top - KERNEL_STACK_PAGES * PAGE_SIZE);
+        if (!slotIsFree(base)) return 0;
+
+        void* phys = pmm.allocatePages(KERNEL_STACK_PAGES);
+        if (!phys) return 0;
+
+        if (!vmm.mapRange(base, phys, KERNEL_STACK_PAGES, PTE_PRESENT | PTE_WRITABLE)) {
+            pmm.freePages(phys, KERNEL_STACK_PAGES);
+            return 0;
+        }
+
+        slots[slot / 64] |= 1ULL << (slot % 64);
+        slotHint = slot + 1;
+        return top;
+    }
+    return 0;
+}
+
+uint64_t StackPool::allocate() {
+    LockGuard guard(lock);
+
+    if (cached) {
+        FreeStack* stack = cached;
+        cached = stack->next;
+        cachedCount--;
+        return reinterpret_cast<uint64_t>(stack) + KERNEL_STACK_PAGES * PAGE_SIZE;
+    }
+    return mapSlot();
+}
+
+void StackPool::free(uint64_t top) {
+    if (!top) return;
+
+    lock.lock();
+    if (cachedCount < MAX_CACHED) {
+        FreeStack* stack = reinterpret_cast<FreeStack*>(top - KERNEL_STACK_PAGES * PAGE_SIZE);
+        stack->next = cached;
+        cached = stack;
+        cachedCount++;
+        lock.unlock();
+        return;
+    }
+    lock.unlock();
+
+    // The shootdown waits on other CPUs, which may be spinning on the lock
+    // with interrupts off. The slot stays taken until it is unmapped.
+    size_t slot = topSlot(top);
+    vmm.unmapRange(reinterpret_cast<void*>(top - KERNEL_STACK_PAGES * PAGE_SIZE), KERNEL_STACK_PAGES, true);
+
+    LockGuard guard(lock);
+    slots[slot / 64] &= ~(1ULL << (slot % 64));
+    if (slot < slotHint) slotHint = slot;
+}
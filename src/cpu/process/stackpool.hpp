@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cpu/smp/spinlock.hpp>
+#include <cpu/mm/layout.hpp>
+#include <cstdint>
+#include <cstddef>
+
+constexpr size_t KERNEL_STACK_PAGES = 4;
+
+// Kernel stacks live in their own window of the kernel half, each slot an
+// unmapped guard page followed by the stack, so an overflow faults instead
+// of running into the neighbouring stack.
+constexpr size_t KERNEL_STACK_SLOTS = 32768;
+
+// Freed stacks stay mapped and are handed out again as they are, so
+// creating a thread usually costs neither the PMM nor a page table walk.
+class StackPool {
+public:
+    StackPool() : cached(nullptr), cachedCount(0), slotHint(0), slots{} {}
+
+    static StackPool& get();
+
+    // Maps the first stacks, which creates the window's page tables. Every
+    // address space copies the kernel half when it is created, so this has
+    // to run before the first process.
+    void initialize();
+
+    // The top of a free stack, 0 if out of memory or slots.
+    uint64_t allocate();
+    void free(uint64_t top);
+
+    size_t getCached() const { return cachedCount; }
+
+private:
+    static constexpr size_t SLOT_PAGES = KERNEL_STACK_PAGES + 1;
+    static constexpr size_t INITIAL_STACKS = 16;
+    // Beyond this many free stacks, the frames go back to the PMM.
+    static constexpr size_t MAX_CACHED = 64;
+
+    struct FreeStack {
+        FreeStack* next;
+    };
+
+    Spinlock lock;
+    FreeStack* cached;
+    size_t cachedCount;
+    size_t slotHint;
+    uint64_t slots[KERNEL_STACK_SLOTS / 64];   // bit set while a slot is mapped
+
+    static uint64_t slotTop(size_t slot);
+    static size_t topSlot(uint64_t top);
+    static bool slotIsFree(void* base);
+    // A newly mapped stack, not yet cached.
+    uint64_t mapSlot();
+};
@@ -0,0 +1,105 @@
+#include "thread.hpp"
+#include "process.hpp"
+#include "stackpool.hpp"
+#include <cpu/mm/pmm.hpp>
+#include <cpu/fpu/fpu.hpp>
+#include <x86_64/requests.hpp>
+#include <cpu/process/scheduler.hpp>
+#include <cpu/idt/interrupt.hpp>
+#include <cpu/smp/cpu.hpp>
+#include <graphics/log.hpp>
+
+Thread::Thread(Process* process, uint32_t tid) : next(nullptr), runNext(nullptr), sibling(nullptr), onCPU(false), active(false), wokenAt(0), tid(tid), process(process), state(ThreadState::Ready), exitCode(0), detached(true), claimed(false), refs(1), policy(SchedPolicy::Fair), priority(DEFAULT_PRIORITY), nice(0), sched{}, dl{}, kernelStack(0), userStack(0), ownedStackBase(0), ownedStackSize(0), entry(0), entryArg(0), kernelEntry(nullptr), lastCPU(-1), fpuState(nullptr), fpuCPU(-1), fsBase(0), pending(0), blocked(0) {
+    kernelStack = StackPool::get().allocate();
+    if (kernelStack) {
+        LogLine().text("[THREAD] TID=").number(tid).text(" KernelStack=").hex(kernelStack).text("\n").commit();
+    }
+
+    // The first switch to the thread pops zeroed callee-saved registers
+    // and returns into taskTrampoline.
+    context.rsp = 0;
+    if (kernelStack) {
+        uint64_t* frame = reinterpret_cast<uint64_t*>(kernelStack);
+        *--frame = 0;
+        *--frame = reinterpret_cast<uint64_t>(&taskTrampoline);
+        for (int i = 0; i < 6; i++) {
+            *--frame = 0;
+        }
+        context.rsp = reinterpret_cast<uint64_t>(frame);
+    }
+
+    uint64_t pml4Virt = reinterpret_cast<uint64_t>(process->getVMM()->getPageTable());
+    uint64_t pml4Phys = pml4Virt - hhdm_request.response->offset;
+    context.cr3 = pml4Phys;
+}
+
+// The main thread's TID is the PID, which the process releases itself.
+Thread::~Thread() {
+    StackPool::get().free(kernelStack);
+
+    if (ownedStackSize) {
+        process->getVMAs()->unmap(ownedStackBase, ownedStackSize);
+    }
+
+    FPU::get().freeState(fpuState);
+    TimerWheel::cancel(&dl.timer);
+
+    if (tid != process->getPID()) {
+        Scheduler::get().releasePID(tid);
+    }
+}
+
+bool Thread::canRunOn(uint32_t cpu) const {
+    if (policy == SchedPolicy::Deadline) return dl.cpu == cpu;
+    return cpu < MAX_CPUS && (process->getAffinity() & (1ULL << cpu));
+}
+
+InterruptFrame* Thread::getUserFrame() {
+    return reinterpret_cast<InterruptFrame*>(kernelStack - sizeof(InterruptFrame));
+}
+
+// A blocked thread is woken so it can act on the signal.
+// Kernel tasks never return to user mode to take a signal.
+void Thread::sendSignal(int sig) {
+    if (sig < 0 || sig >= NSIG || isKernelTask()) return;
+    __atomic_or_fetch(&pending, 1ULL << sig, __ATOMIC_SEQ_CST);
+
+    if (!(blocked & (1ULL << sig))) {
+        Scheduler::get().wake(this);
+    }
+}
+
+bool Thread::hasPendingSignals() const {
+    return __atomic_load_n(&pending, __ATOMIC_SEQ_CST) & ~blocked;
+}
+
+// Fatal signals end the whole process, not just this thread.
+void Thread::handlePendingSignals() {
+    if (!__atomic_load_n(&pending, __ATOMIC_SEQ_CST)) return;
+
+    for (int sig = 0; sig < NSIG; sig++) {
+        if (!(pending & (1ULL << sig))) continue;
+        if (blocked & (1ULL << sig)) continue;
+
+        __atomic_and_fetch(&pending, ~(1ULL << sig), __ATOMIC_SEQ_CST);
+
+        sighandler_t handler = process->getSignalHandler()->handlers[sig];
+        if (sig == SIGKILL || !handler) {
+            process->terminate(128 + sig, this);
+            exitCode = process->getExitCode();
+            return;
+        }
+
+        InterruptFrame* frame = getUserFrame();
+        frame->rsp -= 128;
+        frame->rsp &= ~0xFULL;
+
+        uint64_t* stack = reinterpret_cast<uint64_t*>(frame->rsp);
+        stack[0] = frame->rip;
+
+        frame->rip = reinterpret_cast<uint64_t>(handler);
+        frame->rdi = sig;
+
+        break;
+    }
+}
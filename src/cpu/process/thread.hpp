@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cpu/smp/spinlock.hpp>
+#include <cpu/avltree.hpp>
+#include "timerwheel.hpp"
+
+enum class ThreadState {
+    Ready,
+    Running,
+    Blocked,
+    Terminated
+};
+
+// Legacy FXSAVE region, followed by the XSAVE header and extended
+// components when the CPU has them. The real size is FPU::getSize().
+struct alignas(64) FPUState {
+    uint8_t data[512];
+};
+
+// Everything else a suspended thread needs sits on its kernel stack, pushed
+// by switchContext or, for the user registers, by the interrupt entry stubs.
+struct ThreadContext {
+    uint64_t rsp, cr3;
+};
+
+#define NSIG 32
+#define SIGKILL 9
+#define SIGSEGV 11
+#define SIGTERM 15
+
+typedef void (*KernelEntry)(void* arg);
+
+// Run queue levels of the fixed priority class, 0 is the most urgent.
+constexpr int PRIORITY_LEVELS = 32;
+constexpr int DEFAULT_PRIORITY = 16;
+
+constexpr int NICE_MIN = -20;
+constexpr int NICE_MAX = 19;
+
+// User stack mapped for a thread created without one.
+constexpr size_t THREAD_STACK_SIZE = 1024 * 1024;
+
+// Deadline threads run before fixed priority ones, and those before fair
+// ones.
+enum class SchedPolicy {
+    Fair,
+    Fixed,
+    Deadline
+};
+
+class Thread;
+class Process;
+struct InterruptFrame;
+
+// Fair class bookkeeping, only touched under the lock of the run queue the
+// thread is on or by the CPU running it.
+struct SchedEntity {
+    uint64_t vruntime;   // ns, scaled by the weight
+    uint64_t runtime;    // ns actually spent on a CPU
+    uint32_t weight;     // as accounted in the queue it sits on
+    AVLNode<Thread> tree;
+};
+
+// Deadline class reservation: runtime ns of CPU every period, due within
+// deadline ns of the start of each period. The budget is only touched under
+// the lock of the run queue of the CPU it was admitted on.
+struct DeadlineEntity {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+    uint64_t bandwidth;      // runtime / deadline, as admitted
+    uint32_t cpu;
+
+    uint64_t absDeadline;    // of the current job
+    int64_t remaining;       // budget left in it
+    bool throttled;          // out of budget until the next period
+    bool queued;
+    TimerEvent timer;        // replenishes a throttled thread
+
+    uint64_t missed;         // jobs still running at their deadline
+    uint64_t throttles;      // times the budget ran out
+};
+
+// What the scheduler runs. Every thread belongs to one Process and shares
+// its address space, files and signal handlers with the other threads of it.
+class Thread {
+public:
+    Thread(Process* process, uint32_t tid);
+    ~Thread();
+
+    uint32_t getTID() const { return tid; }
+    Process* getProcess() const { return process; }
+
+    ThreadState getState() const { return __atomic_load_n(&state, __ATOMIC_ACQUIRE); }
+    void setState(ThreadState s) { __atomic_store_n(&state, s, __ATOMIC_SEQ_CST); }
+    bool trySetState(ThreadState from, ThreadState to) {
+        return __atomic_compare_exchange_n(&state, &from, to, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE);
+    }
+
+    ThreadContext* getContext() { return &context; }
+    // Allocated on the first SIMD instruction, see FPU::handleTrap.
+    FPUState* getFPUState() { return fpuState; }
+    void setFPUState(FPUState* state) { fpuState = state; }
+    int getFPUCPU() const { return fpuCPU; }
+    void setFPUCPU(int cpu) { fpuCPU = cpu; }
+
+    // User mode TLS pointer, loaded into FS_BASE whenever the thread runs.
+    uint64_t getFSBase() const { return fsBase; }
+    void setFSBase(uint64_t base) { fsBase = base; }
+
+    uint64_t getKernelStack() const { return kernelStack; }
+    uint64_t getUserStack() const { return userStack; }
+    void setUserStack(uint64_t stack) { userStack = stack; }
+
+    // A user stack the kernel mapped for the thread and unmaps with it.
+    void setOwnedStack(uint64_t base, size_t size) { ownedStackBase = base; ownedStackSize = size; }
+
+    // Where taskStart sends a thread the first time it runs, with arg in
+    // the first argument register. Kernel tasks have a kernelEntry and never
+    // enter user mode.
+    uint64_t getEntry() const { return entry; }
+    void setEntry(uint64_t entry, uint64_t arg = 0) { this->entry = entry; entryArg = arg; }
+    uint64_t getEntryArg() const { return entryArg; }
+    KernelEntry getKernelEntry() const { return kernelEntry; }
+    void setKernelEntry(KernelEntry entry, void* arg = nullptr) { kernelEntry = entry; entryArg = reinterpret_cast<uint64_t>(arg); }
+    bool isKernelTask() const { return kernelEntry != nullptr; }
+
+    // Whether the affinity of the process allows cpu. A deadline thread
+    // stays on the CPU it was admitted on.
+    bool canRunOn(uint32_t cpu) const;
+
+    // CPU the thread last ran on, -1 before it first runs.
+    int getLastCPU() const { return lastCPU; }
+    void setLastCPU(int cpu) { lastCPU = cpu; }
+
+    // Registers saved on entry from user mode, at the top of the kernel stack.
+    InterruptFrame* getUserFrame();
+
+    int getExitCode() const { return exitCode; }
+    void setExitCode(int code) { exitCode = code; }
+
+    // A detached thread is freed as soon as it exits, any other one stays
+    // until it is joined or its process exits.
+    bool isDetached() const { return detached; }
+    void setDetached(bool d) { detached = d; }
+    // True for exactly one caller, who then frees the exited thread.
+    bool claim() { return !__atomic_test_and_set(&claimed, __ATOMIC_ACQ_REL); }
+    void unclaim() { __atomic_clear(&claimed, __ATOMIC_RELEASE); }
+
+    // The PID table holds one reference until the thread is reaped, lookups
+    // by ID one each. Whoever drops the last hands the thread to the Reaper.
+    void hold() { __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED); }
+    bool drop() { return __atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0; }
+
+    // Policy and priority are only changed while the thread is not on a
+    // run queue. A new nice value takes effect from the next charge.
+    SchedPolicy getPolicy() const { return policy; }
+    void setPolicy(SchedPolicy p) { policy = p; }
+    int getPriority() const { return priority; }
+    void setPriority(int prio) { priority = prio; }
+    int getNice() const { return nice; }
+    void setNice(int n) { nice = n < NICE_MIN ? NICE_MIN : (n > NICE_MAX ? NICE_MAX : n); }
+    SchedEntity* getSchedEntity() { return &sched; }
+    DeadlineEntity* getDeadlineEntity() { return &dl; }
+
+    // Links in the Reaper's list, a run queue or a throttled group, and the
+    // thread list of the process.
+    Thread* next;
+    Thread* runNext;
+    Thread* sibling;
+
+    // Set while a CPU is on the thread's kernel stack. A woken thread is
+    // only queued once its old CPU has switched away from it.
+    volatile bool onCPU;
+
+    // Clear once schedule() has taken a blocked thread off its CPU for
+    // good, so wake() has to queue it again. wakeLock orders the two.
+    bool active;
+    Spinlock wakeLock;
+
+    // TSC when the thread was last woken, 0 once it has run since.
+    uint64_t wokenAt;
+
+    // Pending signals are per thread, the handlers belong to the process.
+    void sendSignal(int sig);
+    bool hasPendingSignals() const;
+    void handlePendingSignals();
+    uint64_t getSignalMask() const { return blocked; }
+    void setSignalMask(uint64_t mask) { blocked = mask & ~(1ULL << SIGKILL); }
+
+private:
+    uint32_t tid;
+    Process* process;
+    ThreadState state;
+    int exitCode;
+    bool detached;
+    bool claimed;
+    uint32_t refs;
+    SchedPolicy policy;
+    int priority;
+    int nice;
+    SchedEntity sched;
+    DeadlineEntity dl;
+    uint64_t kernelStack;
+    uint64_t userStack;
+    uint64_t ownedStackBase;
+    size_t ownedStackSize;
+    uint64_t entry;
+    uint64_t entryArg;
+    KernelEntry kernelEntry;
+    int lastCPU;
+    ThreadContext context;
+    FPUState* fpuState;
+    int fpuCPU;          // CPU whose registers last had the state loaded
+    uint64_t fsBase;
+    uint64_t pending;
+    uint64_t blocked;
+};
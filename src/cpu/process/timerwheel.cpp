@@ -0,0 +1,174 @@
+#include "timerwheel.hpp"
+
+TimerWheel::TimerWheel() : current(0), count(0), running(nullptr) {
+    for (int level = 0; level < LEVELS; level++) {
+        for (uint64_t slot = 0; slot < SLOTS; slot++) {
+            slots[level][slot] = nullptr;
+        }
+        pending[level] = 0;
+    }
+}
+
+void TimerWheel::init(uint64_t now) {
+    LockGuard guard(lock);
+    current = now;
+}
+
+// Events already due go into the slot of the current tick. Anything beyond
+// the top level waits in its last slot and is placed again on the way down.
+void TimerWheel::insert(TimerEvent* event) {
+    uint64_t delta = event->expires > current ? event->expires - current : 0;
+    uint64_t limit = 1ULL << (SLOT_BITS * LEVELS);
+    if (delta >= limit) delta = limit - 1;
+    uint64_t expires = current + delta;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    uint64_t slot = (expires >> (SLOT_BITS * level)) & SLOT_MASK;
+
+    event->level = level;
+    event->slot = slot;
+    event->prev = nullptr;
+    event->next = slots[level][slot];
+    if (event->next) {
+        event->next->prev = event;
+    }
+    slots[level][slot] = event;
+    pending[level] |= 1ULL << slot;
+    event->queued = true;
+    count++;
+}
+
+void TimerWheel::unlink(TimerEvent* event) {
+    if (event->prev) {
+        event->prev->next = event->next;
+    } else {
+        slots[event->level][event->slot] = event->next;
+        if (!event->next) {
+            pending[event->level] &= ~(1ULL << event->slot);
+        }
+    }
+    if (event->next) {
+        event->next->prev = event->prev;
+    }
+
+    event->next = nullptr;
+    event->prev = nullptr;
+    event->queued = false;
+    count--;
+}
+
+// Moves the slot of this level that the current tick has just reached one
+// or more levels down. The list is detached first, an event a full lap
+// away lands back in the same slot.
+void TimerWheel::cascade(int level) {
+    uint64_t slot = (current >> (SLOT_BITS * level)) & SLOT_MASK;
+    TimerEvent* event = slots[level][slot];
+    slots[level][slot] = nullptr;
+    pending[level] &= ~(1ULL << slot);
+
+    while (event) {
+        TimerEvent* next = event->next;
+        count--;
+        insert(event);
+        event = next;
+    }
+}
+
+void TimerWheel::add(TimerEvent* event) {
+    LockGuard guard(lock);
+    event->wheel = this;
+    insert(event);
+}
+
+bool TimerWheel::cancel(TimerEvent* event) {
+    TimerWheel* wheel = event->wheel;
+    if (!wheel) return false;
+
+    wheel->lock.lock();
+    if (event->queued) {
+        wheel->unlink(event);
+        wheel->lock.unlock();
+        return true;
+    }
+
+    while (wheel->running == event) {
+        wheel->lock.unlock();
+        asm volatile("pause");
+        wheel->lock.lock();
+    }
+    wheel->lock.unlock();
+    return false;
+}
+
+void TimerWheel::advance(uint64_t now) {
+    lock.lock();
+
+    while (current <= now) {
+        if (!count) {
+            current = now + 1;
+            break;
+        }
+
+        uint64_t index = current & SLOT_MASK;
+        if (index == 0) {
+            for (int level = 1; level < LEVELS; level++) {
+                cascade(level);
+                if ((current >> (SLOT_BITS * level)) & SLOT_MASK) break;
+            }
+        }
+
+        while (TimerEvent* event = slots[0][index]) {
+            unlink(event);
+            running = event;
+            lock.unlock();
+
+            event->callback(event);
+
+            lock.lock();
+            running = nullptr;
+        }
+
+        current++;
+
+        // Skip the rest of an empty lap of level 0 in one step.
+        index = current & SLOT_MASK;
+        if (index && !(pending[0] >> index)) {
+            uint64_t boundary = (current | SLOT_MASK) + 1;
+            current = boundary <= now ? boundary : now + 1;
+        }
+    }
+
+    lock.unlock();
+}
+
+// Exact for level 0. Higher levels only say when the next cascade is due,
+// which may be earlier than their events.
+uint64_t TimerWheel::nextExpiry() {
+    LockGuard guard(lock);
+    if (!count) return UINT64_MAX;
+
+    uint64_t index = current & SLOT_MASK;
+    uint64_t next = UINT64_MAX;
+
+    if (pending[0]) {
+        uint64_t ahead = pending[0] >> index;
+        if (ahead) {
+            next = current + __builtin_ctzll(ahead);
+        } else {
+            next = current + (SLOTS - index) + __builtin_ctzll(pending[0]);
+        }
+    }
+
+    for (int level = 1; level < LEVELS; level++) {
+        if (!pending[level]) continue;
+
+        uint64_t boundary = index ? (current | SLOT_MASK) + 1 : current;
+        if (boundary < next) next = boundary;
+        break;
+    }
+
+    return next;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+struct TimerEvent;
+class TimerWheel;
+
+typedef void (*TimerCallback)(TimerEvent* event);
+
+// Caller-owned; must stay alive until it has fired or cancel() returned,
+// and must not be added again while still queued.
+struct TimerEvent {
+    uint64_t expires;       // in ticks (TICK_NS) since boot
+    TimerCallback callback;
+    void* data;
+
+    TimerEvent* next;
+    TimerEvent* prev;
+    TimerWheel* wheel;      // the wheel it was last added to
+    bool queued;
+    uint8_t level;
+    uint8_t slot;
+};
+
+// Hierarchical timing wheel, one per CPU: four levels of 64 slots, each
+// level 64 times coarser than the one below. Adding and cancelling are
+// constant time; an event moves down a level whenever the level below
+// wraps around, and only runs from level 0.
+class TimerWheel {
+public:
+    TimerWheel();
+
+    void init(uint64_t now);
+
+    void add(TimerEvent* event);
+
+    // Returns true if the event was still pending. Otherwise it has already
+    // fired, and if its callback is running on another CPU this waits for it
+    // to finish.
+    static bool cancel(TimerEvent* event);
+
+    // Runs every event due at or before now. Callbacks run without the
+    // wheel locked and may add events again.
+    void advance(uint64_t now);
+
+    // Tick by which advance() has to run again, or UINT64_MAX when empty.
+    uint64_t nextExpiry();
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1ULL << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+    Spinlock lock;
+    TimerEvent* slots[LEVELS][SLOTS];
+    uint64_t pending[LEVELS];   // bitmap of non-empty slots
+    uint64_t current;           // next tick to run
+    size_t count;
+    TimerEvent* running;
+
+    void insert(TimerEvent* event);
+    void unlink(TimerEvent* event);
+    void cascade(int level);
+};
@@ -1,17 +1,17 @@
 global enterUsermode
 
+; void enterUsermode(uint64_t entry, uint64_t stack, uint64_t arg)
 enterUsermode:
     cli
-    
+
     mov rcx, rdi
     mov r11, rsi
-    
+    mov rdi, rdx
+
     mov ax, 0x23
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
-    
+
     push 0x23
     push r11
     pushfq
@@ -20,5 +20,22 @@ enterUsermode:
     push rax
     push 0x1B
     push rcx
-    
+
+    xor rax, rax
+    xor rbx, rbx
+    xor rcx, rcx
+    xor rdx, rdx
+    xor rsi, rsi
+    xor rbp, rbp
+    xor r8, r8
+    xor r9, r9
+    xor r10, r10
+    xor r11, r11
+    xor r12, r12
+    xor r13, r13
+    xor r14, r14
+    xor r15, r15
+
+    ; The per-CPU block moves to KERNEL_GS_BASE until the next entry.
+    swapgs
     iretq
@@ -0,0 +1,64 @@
+#include "waitqueue.hpp"
+
+void WaitQueue::prepare(WaitEntry* entry) {
+    LockGuard guard(lock);
+
+    if (!entry->queued) {
+        entry->next = nullptr;
+        entry->prev = tail;
+        if (tail) {
+            tail->next = entry;
+        } else {
+            head = entry;
+        }
+        tail = entry;
+        entry->queued = true;
+    }
+
+    entry->thread->setState(ThreadState::Blocked);
+}
+
+void WaitQueue::finish(WaitEntry* entry) {
+    entry->thread->trySetState(ThreadState::Blocked, ThreadState::Running);
+
+    LockGuard guard(lock);
+    if (entry->queued) {
+        unlink(entry);
+    }
+}
+
+void WaitQueue::unlink(WaitEntry* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        tail = entry->prev;
+    }
+
+    entry->next = nullptr;
+    entry->prev = nullptr;
+    entry->queued = false;
+}
+
+void WaitQueue::wakeOne() {
+    LockGuard guard(lock);
+
+    WaitEntry* entry = head;
+    if (!entry) return;
+
+    unlink(entry);
+    Scheduler::get().wake(entry->thread);
+}
+
+void WaitQueue::wakeAll() {
+    LockGuard guard(lock);
+
+    while (WaitEntry* entry = head) {
+        unlink(entry);
+        Scheduler::get().wake(entry->thread);
+    }
+}
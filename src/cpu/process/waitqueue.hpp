@@ -0,0 +1,56 @@
+#pragma once
+
+#include "scheduler.hpp"
+#include <cpu/smp/spinlock.hpp>
+
+struct WaitEntry {
+    Thread* thread;
+    WaitEntry* next;
+    WaitEntry* prev;
+    bool queued;
+};
+
+// Threads blocked until some condition holds, woken in the order they
+// started waiting. Wakers change the condition first and then call wakeOne
+// or wakeAll; both are safe from interrupt handlers.
+class WaitQueue {
+public:
+    WaitQueue() : head(nullptr), tail(nullptr) {}
+
+    // Blocks the caller until cond() is true. Returns false if a signal
+    // arrived first.
+    template <typename Cond>
+    bool waitUntil(Cond cond) {
+        Thread* current = Scheduler::get().getCurrentThread();
+        if (!current) return cond();
+
+        WaitEntry entry = {current, nullptr, nullptr, false};
+        bool done = true;
+        for (;;) {
+            // Queued and Blocked before the check, so a wakeup between the
+            // check and block() only makes block() return at once.
+            prepare(&entry);
+            if (cond()) break;
+            if (current->hasPendingSignals()) {
+                done = false;
+                break;
+            }
+            Scheduler::get().block();
+        }
+
+        finish(&entry);
+        return done;
+    }
+
+    void wakeOne();
+    void wakeAll();
+
+private:
+    Spinlock lock;
+    WaitEntry* head;
+    WaitEntry* tail;
+
+    void prepare(WaitEntry* entry);
+    void finish(WaitEntry* entry);
+    void unlink(WaitEntry* entry);
+};
@@ -0,0 +1,73 @@
+#include "workqueue.hpp"
+#include "exec.hpp"
+#include <cpu/smp/smp.hpp>
+
+WorkQueue& WorkQueue::get() {
+    static WorkQueue instance;
+    return instance;
+}
+
+void WorkQueue::initialize() {
+    if (initialized) return;
+
+    poolCount = SMP::get().getCPUCount();
+    pools = new Pool[poolCount];
+    for (uint32_t cpu = 0; cpu < poolCount; cpu++) {
+        pools[cpu].head = nullptr;
+        pools[cpu].tail = nullptr;
+        for (int i = 0; i < WORKERS_PER_CPU; i++) {
+            ProcessExecutor::createKernelThread(worker, &pools[cpu], cpu);
+        }
+    }
+
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+}
+
+bool WorkQueue::queue(Work* work) {
+    return queueOn(thisCPU()->id, work);
+}
+
+bool WorkQueue::queueOn(uint32_t cpu, Work* work) {
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE) || cpu >= poolCount) return false;
+
+    // Claimed before any pool is locked: the same work queued from two CPUs
+    // would otherwise only be checked against each one's own pool.
+    if (__atomic_test_and_set(&work->queued, __ATOMIC_ACQ_REL)) return false;
+
+    Pool* pool = &pools[cpu];
+    pool->lock.lock();
+    work->next = nullptr;
+    if (pool->tail) {
+        pool->tail->next = work;
+    } else {
+        pool->head = work;
+    }
+    pool->tail = work;
+    pool->lock.unlock();
+
+    pool->idle.wakeOne();
+    return true;
+}
+
+Work* WorkQueue::take(Pool* pool) {
+    LockGuard guard(pool->lock);
+
+    Work* work = pool->head;
+    if (!work) return nullptr;
+
+    pool->head = work->next;
+    if (!pool->head) pool->tail = nullptr;
+    work->next = nullptr;
+    __atomic_clear(&work->queued, __ATOMIC_RELEASE);
+    return work;
+}
+
+void WorkQueue::worker(void* arg) {
+    Pool* pool = static_cast<Pool*>(arg);
+
+    for (;;) {
+        Work* work = nullptr;
+        pool->idle.waitUntil([&] { return (work = take(pool)) != nullptr; });
+        if (work) work->func(work);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "waitqueue.hpp"
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+
+struct Work;
+typedef void (*WorkFunc)(Work* work);
+
+// A deferred call, usually embedded in the object it works on. The queue
+// does not touch it once func has been called, so func may free it.
+struct Work {
+    WorkFunc func;
+    void* data;
+    Work* next;
+    bool queued;
+};
+
+// Kernel threads each CPU keeps for work queued on it.
+constexpr int WORKERS_PER_CPU = 2;
+
+// Runs work in kernel threads instead of the context that queued it, so
+// interrupt handlers and the scheduler can hand off anything that may
+// block, allocate or take long. Work queued on a CPU runs on that CPU, in
+// the order it was queued when there is a single worker free.
+class WorkQueue {
+public:
+    static WorkQueue& get();
+
+    // Starts the pools, once every CPU is known.
+    void initialize();
+
+    // Both return false if the work is already queued or the pools are
+    // not running yet. Safe from interrupt handlers.
+    bool queue(Work* work);
+    bool queueOn(uint32_t cpu, Work* work);
+
+private:
+    WorkQueue() : pools(nullptr), poolCount(0), initialized(false) {}
+
+    struct Pool {
+        Spinlock lock;
+        Work* head;
+        Work* tail;
+        WaitQueue idle;
+    };
+
+    Pool* pools;
+    uint32_t poolCount;
+    bool initialized;
+
+    static Work* take(Pool* pool);
+    static void worker(void* arg);
+};
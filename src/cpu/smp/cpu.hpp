@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cpu/process/runqueue.hpp>
+#include <cpu/process/timerwheel.hpp>
+#include <cpu/process/schedstats.hpp>
+
+class GDT;
+class Thread;
+
+constexpr uint32_t MAX_CPUS = 64;
+
+constexpr uint32_t MSR_FS_BASE = 0xC0000100;
+constexpr uint32_t MSR_GS_BASE = 0xC0000101;
+constexpr uint32_t MSR_KERNEL_GS_BASE = 0xC0000102;
+
+// One per CPU, reached through GS. The kernel keeps its block in GS_BASE
+// and swaps it out with swapgs on every transition to and from user mode,
+// so the first field must point back at the block itself.
+struct CPUData {
+    CPUData* self;
+    uint32_t id;
+    uint32_t lapicId;
+
+    Thread* current;
+    Thread* idle;
+    Thread* previous;
+    Thread* fpuOwner;    // whose SIMD state the registers hold
+    uint64_t kernelStack;
+
+    GDT* gdt;
+    RunQueue runQueue;
+    TimerWheel timers;
+    uint64_t deadlineBandwidth;   // admitted here, see Scheduler::setDeadline
+
+    uint64_t ticks;
+    int64_t slice;        // ns the current thread may still run
+    uint64_t execStart;   // when the current thread was last charged
+    uint64_t lastCollapse;
+
+    // Runnable threads here, the running one included, in units of
+    // 1 << LOAD_SHIFT and decayed every BALANCE_INTERVAL_NS.
+    uint64_t loadAvg;
+    uint64_t loadStamp;
+    uint64_t lastBalance;
+    uint64_t migrations;   // threads that came here from another CPU
+    uint64_t balanced;     // of those, pulled by the load balancer
+    volatile bool needResched;
+    volatile bool polling;   // idle in MWAIT on needResched, no IPI needed
+    volatile bool online;
+    volatile int32_t preemptCount;
+
+    uint64_t idleTime;       // ns spent asleep in the idle task
+    uint64_t idleEntries;
+
+    SchedStats schedStats;
+    uint64_t switchStart;    // TSC as switchContext was entered
+    // Threads queued here, sampled with the load average. queueTraceHead
+    // is the next slot to fill, and so the oldest sample.
+    uint32_t queueTrace[QUEUE_TRACE_LENGTH];
+    uint32_t queueTraceHead;
+};
+
+inline CPUData* thisCPU() {
+    CPUData* cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// A single GS-relative load, so a preemption cannot land between finding
+// the CPU and reading its field.
+inline Thread* currentThread() {
+    Thread* thread;
+    asm volatile("mov %%gs:%c1, %0" : "=r"(thread) : "i"(offsetof(CPUData, current)));
+    return thread;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <cpu/process/scheduler.hpp>
+#include <cstddef>
+
+// The kernel may be preempted whenever interrupts are on and this CPU's
+// count is zero. Spinlocks keep interrupts off, so they need no count of
+// their own; these are for code that only has to stay on one CPU.
+inline void preemptDisable() {
+    asm volatile("incl %%gs:%c0" :: "i"(offsetof(CPUData, preemptCount)) : "memory");
+}
+
+// Reschedules right away if that became due while preemption was off,
+// unless the caller still has interrupts disabled.
+inline void preemptEnable() {
+    asm volatile("decl %%gs:%c0" :: "i"(offsetof(CPUData, preemptCount)) : "memory");
+
+    uint64_t flags;
+    asm volatile("pushfq; pop %0" : "=r"(flags));
+    if (flags & 0x200) {
+        Scheduler::get().preempt();
+    }
+}
+
+class PreemptGuard {
+public:
+    PreemptGuard() { preemptDisable(); }
+    ~PreemptGuard() { preemptEnable(); }
+
+    PreemptGuard(const PreemptGuard&) = delete;
+    PreemptGuard& operator=(const PreemptGuard&) = delete;
+};
@@ -0,0 +1,190 @@
+#include "smp.hpp"
+#include <cpu/gdt/gdt.hpp>
+#include <cpu/fpu/fpu.hpp>
+#include <cpu/idt/idt.hpp>
+#include <cpu/idt/isr.hpp>
+#include <cpu/apic/irqs.hpp>
+#include <cpu/mm/vmm.hpp>
+#include <cpu/process/scheduler.hpp>
+#include <interrupts/timer.hpp>
+#include <x86_64/requests.hpp>
+#include <x86_64/ports.hpp>
+
+extern IDT* idt;
+extern Timer* globalTimer;
+extern "C" void enable_sse();
+
+class ShootdownIPI : public Interrupt {
+public:
+    void initialize() override {}
+
+    void Run(InterruptFrame* frame __attribute__((unused))) override {
+        SMP::get().serviceShootdown();
+        this->sendEOI();
+    }
+};
+
+// Only wakes the target, the idle loop or the next return to user mode
+// picks the new work up.
+class RescheduleIPI : public Interrupt {
+public:
+    void initialize() override {}
+
+    void Run(InterruptFrame* frame __attribute__((unused))) override {
+        this->sendEOI();
+        thisCPU()->needResched = true;
+    }
+};
+
+SMP& SMP::get() {
+    static SMP instance;
+    return instance;
+}
+
+CPUData* SMP::createCPU(uint32_t id, uint32_t lapicId) {
+    CPUData* cpu = new CPUData();
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->lapicId = lapicId;
+    cpu->current = nullptr;
+    cpu->idle = nullptr;
+    cpu->previous = nullptr;
+    cpu->fpuOwner = nullptr;
+    cpu->kernelStack = 0;
+    cpu->gdt = nullptr;
+    cpu->ticks = 0;
+    cpu->slice = 0;
+    cpu->execStart = 0;
+    cpu->lastCollapse = 0;
+    cpu->needResched = false;
+    cpu->online = false;
+    cpu->preemptCount = 0;
+
+    cpus[id] = cpu;
+    return cpu;
+}
+
+void SMP::loadCPU(CPUData* cpu) {
+    wrmsr(MSR_GS_BASE, reinterpret_cast<uint64_t>(cpu));
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void SMP::initializeBSP(GDT* gdt) {
+    if (cpuCount) return;
+
+    CPUData* cpu = createCPU(0, LAPIC::get().getId());
+    cpu->gdt = gdt;
+    cpuCount = 1;
+    loadCPU(cpu);
+
+    ISR::registerIRQ(VECTOR_TLB_SHOOTDOWN, new ShootdownIPI());
+    ISR::registerIRQ(VECTOR_RESCHEDULE, new RescheduleIPI());
+
+    cpu->online = true;
+    onlineMask = 1;
+}
+
+// APs come up one at a time so each finishes with the shared allocators
+// and the LAPIC before the next one starts.
+void SMP::startAPs() {
+    limine_mp_response* response = mp_request.response;
+    if (!response || !cpuCount) return;
+
+    for (uint64_t i = 0; i < response->cpu_count; i++) {
+        limine_mp_info* info = response->cpus[i];
+        if (info->lapic_id == response->bsp_lapic_id) continue;
+        if (cpuCount >= MAX_CPUS) break;
+
+        CPUData* cpu = createCPU(cpuCount, info->lapic_id);
+        cpuCount++;
+
+        info->extra_argument = reinterpret_cast<uint64_t>(cpu);
+        __atomic_store_n(&info->goto_address, &SMP::apEntry, __ATOMIC_SEQ_CST);
+
+        while (!cpu->online) {
+            asm volatile("pause");
+        }
+    }
+}
+
+void SMP::apEntry(limine_mp_info* info) {
+    CPUData* cpu = reinterpret_cast<CPUData*>(info->extra_argument);
+
+    vmm.load();
+    VMM::initPAT();
+    enable_sse();
+    FPU::get().initializeCPU();
+
+    // The GDT constructor loads itself and its TSS; reloading the segments
+    // clears GS, so the per-CPU block goes in afterwards.
+    cpu->gdt = new GDT();
+    idt->load();
+    loadCPU(cpu);
+
+    LAPIC::get().enable();
+    Scheduler::get().initializeCPU(cpu);
+    globalTimer->start();
+
+    SMP& smp = get();
+    __atomic_or_fetch(&smp.onlineMask, 1ULL << cpu->id, __ATOMIC_SEQ_CST);
+    cpu->online = true;
+
+    Scheduler::get().start();
+}
+
+void SMP::sendIPI(CPUData* cpu, uint8_t vector) {
+    if (!cpu || !cpu->online) return;
+    LAPIC::get().sendIPI(cpu->lapicId, vector);
+}
+
+bool SMP::shootdown(uint64_t mask, uint64_t virt, size_t count) {
+    // Nothing to do before the APs are up, and thisCPU() may not be set yet.
+    uint64_t online = __atomic_load_n(&onlineMask, __ATOMIC_ACQUIRE);
+    if (!(online & (online - 1))) return false;
+
+    CPUData* self = thisCPU();
+    mask &= online & ~(1ULL << self->id);
+    if (!mask) return false;
+
+    // Two CPUs shooting at each other must keep answering the other's
+    // request while waiting for the lock, or both would spin forever.
+    while (!shootdownLock.tryLock()) {
+        serviceShootdown();
+        asm volatile("pause");
+    }
+
+    shootdownVirt = virt;
+    shootdownCount = count;
+    __atomic_store_n(&shootdownPending, mask, __ATOMIC_SEQ_CST);
+
+    for (uint32_t i = 0; i < cpuCount; i++) {
+        if (mask & (1ULL << i)) {
+            LAPIC::get().sendIPI(cpus[i]->lapicId, VECTOR_TLB_SHOOTDOWN);
+        }
+    }
+
+    while (__atomic_load_n(&shootdownPending, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+
+    shootdownLock.unlock();
+    return true;
+}
+
+void SMP::serviceShootdown() {
+    uint64_t bit = 1ULL << thisCPU()->id;
+    if (!(__atomic_load_n(&shootdownPending, __ATOMIC_ACQUIRE) & bit)) return;
+
+    // Kernel ranges are always flushed page by page, as in VMM::flushRange.
+    if (shootdownCount > VMM::FLUSH_THRESHOLD && VMM::isUser(reinterpret_cast<void*>(shootdownVirt))) {
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    } else {
+        for (size_t i = 0; i < shootdownCount; i++) {
+            asm volatile("invlpg (%0)" :: "r"(shootdownVirt + i * PAGE_SIZE) : "memory");
+        }
+    }
+
+    __atomic_and_fetch(&shootdownPending, ~bit, __ATOMIC_RELEASE);
+}
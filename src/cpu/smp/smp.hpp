@@ -0,0 +1,46 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "spinlock.hpp"
+#include <cstdint>
+#include <cstddef>
+
+class GDT;
+struct limine_mp_info;
+
+class SMP {
+public:
+    static SMP& get();
+
+    void initializeBSP(GDT* gdt);
+    void startAPs();
+
+    uint32_t getCPUCount() const { return cpuCount; }
+    CPUData* getCPU(uint32_t id) { return id < cpuCount ? cpus[id] : nullptr; }
+    uint64_t getOnlineMask() const { return __atomic_load_n(&onlineMask, __ATOMIC_ACQUIRE); }
+
+    void sendIPI(CPUData* cpu, uint8_t vector);
+
+    // Invalidates [virt, virt + count pages) on every online CPU in mask
+    // other than the caller and waits until all of them are done. Returns
+    // false when no other CPU had to be interrupted.
+    bool shootdown(uint64_t mask, uint64_t virt, size_t count);
+    void serviceShootdown();
+
+private:
+    SMP() : cpuCount(0), onlineMask(0), shootdownPending(0), shootdownVirt(0), shootdownCount(0) {}
+
+    CPUData* cpus[MAX_CPUS];
+    uint32_t cpuCount;
+    volatile uint64_t onlineMask;
+
+    Spinlock shootdownLock;
+    volatile uint64_t shootdownPending;
+    uint64_t shootdownVirt;
+    size_t shootdownCount;
+
+    CPUData* createCPU(uint32_t id, uint32_t lapicId);
+
+    static void loadCPU(CPUData* cpu);
+    static void apEntry(limine_mp_info* info);
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+// Interrupts stay off while the lock is held, so an IRQ on the same CPU can
+// never spin on a lock its own interrupted code owns. The saved flags live in
+// the lock itself; only the holder ever touches them.
+class Spinlock {
+public:
+    Spinlock() : locked(false), savedFlags(0) {}
+
+    void lock() {
+        uint64_t flags = saveAndDisable();
+        while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {
+                asm volatile("pause");
+            }
+        }
+        savedFlags = flags;
+    }
+
+    bool tryLock() {
+        uint64_t flags = saveAndDisable();
+        if (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE)) {
+            restore(flags);
+            return false;
+        }
+        savedFlags = flags;
+        return true;
+    }
+
+    void unlock() {
+        uint64_t flags = savedFlags;
+        __atomic_clear(&locked, __ATOMIC_RELEASE);
+        restore(flags);
+    }
+
+    bool isLocked() const { return __atomic_load_n(&locked, __ATOMIC_RELAXED); }
+
+    static uint64_t saveAndDisable() {
+        uint64_t flags;
+        asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+        return flags;
+    }
+
+    static void restore(uint64_t flags) {
+        if (flags & 0x200) asm volatile("sti" ::: "memory");
+    }
+
+private:
+    volatile bool locked;
+    uint64_t savedFlags;
+};
+
+class LockGuard {
+public:
+    explicit LockGuard(Spinlock& lock) : lock(lock) { lock.lock(); }
+    ~LockGuard() { lock.unlock(); }
+
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+
+private:
+    Spinlock& lock;
+};
@@ -1,79 +1,59 @@
 global syscallEntry
-global kernelStackTop
-global userRSP
 extern syscallHandler
 
-extern saveSyscallState
-
-syscallEntry:
-    cli
-    
-    push r15
-    push r14
-    push r13
-    push r12
-    push r11
-    push r10
-    push r9
-    push r8
-    push rbp
-    push rdi
-    push rsi
+%macro pushad 0
+    push rbx
     push rdx
     push rcx
-    push rbx
-    push rax
-    
     push rax
-    push rbx
-    push rcx
-    push rdx
-    push rsi
     push rdi
-    
-    lea rdi, [rsp + 48]
-    call saveSyscallState
+    push rsi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+%endmacro
 
-    pop rdi
+%macro popad 0
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
     pop rsi
-    pop rdx
-    pop rcx
-    pop rbx
-    pop rax
-    
-    mov rdi, rax
-    mov rsi, rbx
-    mov r10, rcx
-    mov rcx, rdx
-    mov rdx, r10
-    xor r8, r8
-    xor r9, r9
-    
-    call syscallHandler
-    
-    mov [rsp], rax
-    
+    pop rdi
     pop rax
-    pop rbx
     pop rcx
     pop rdx
-    pop rsi
-    pop rdi
-    pop rbp
-    pop r8
-    pop r9
-    pop r10
-    pop r11
-    pop r12
-    pop r13
-    pop r14
-    pop r15
-    
-    sti
+    pop rbx
+%endmacro
 
-    iretq
+; Builds the same InterruptFrame as the IRQ stubs. rax holds the number,
+; rbx/rcx/rdx/rsi/rdi/r8 the arguments 1-6, the result goes back in rax.
+syscallEntry:
+    push 0
+    push 0x80
 
-section .data
-align 8
-userRSP: dq 0
-kernelStackTop: dq 0
\ No newline at end of file
+    test qword [rsp + 24], 3
+    jz .fromKernel
+    swapgs
+.fromKernel:
+    pushad
+
+    mov rdi, rsp
+    mov rbp, rsp
+    and rsp, ~0xF
+
+    cld
+    call syscallHandler
+
+    mov rsp, rbp
+    popad
+
+    test qword [rsp + 24], 3
+    jz .toKernel
+    swapgs
+.toKernel:
+    add rsp, 16
+    iretq
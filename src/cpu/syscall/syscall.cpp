@@ -2,6 +2,7 @@
 #include <cpu/gdt/gdt.hpp>
 #include <cpu/process/scheduler.hpp>
 #include <cpu/process/exec.hpp>
+#include <cpu/smp/smp.hpp>
 #include <fs/vfs/vfs.hpp>
 #include <graphics/console.hpp>
 #include <interrupts/keyboard.hpp>
@@ -13,7 +14,6 @@
 extern Console* console;
 extern Keyboard* globalKeyboard;
 extern Timer* globalTimer;
-extern "C" uint64_t kernelStackTop;
 
 Syscall syscallInstance;
 
@@ -40,11 +40,7 @@ void Syscall::initialize() {
     
 }
 
-void Syscall::setKernelStack(uint64_t stack) {
-    kernelStackTop = stack;
-}
-
-uint64_t Syscall::handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+uint64_t Syscall::handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6) {
     switch ((SyscallNumber)syscall_num) {
         using enum SyscallNumber;
         case Exit:
@@ -62,17 +58,25 @@ uint64_t Syscall::handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uin
         case Fork:
             return sys_fork();
         case Exec:
-            return sys_exec(arg1, arg2, arg3);
+            return sys_exec(arg1, arg2, arg3, arg4);
         case Wait:
             return sys_wait(arg1, arg2);
         case Kill:
             return sys_kill(arg1, arg2);
         case Mmap:
-            return sys_mmap(arg1, arg2, arg3);
+            return sys_mmap(arg1, arg2, arg3, arg4, arg5, arg6);
         case Munmap:
             return sys_munmap(arg1, arg2);
+        case Mprotect:
+            return sys_mprotect(arg1, arg2, arg3);
+        case HugePageInfo:
+            return sys_hugepage_info(arg1);
+        case VMStatsInfo:
+            return sys_vmstats(arg1, arg2, arg3);
         case Yield:
             return sys_yield();
+        case Nice:
+            return sys_nice(arg1, arg2);
         case Sleep:
             return sys_sleep(arg1);
         case GetTime:
@@ -87,27 +91,59 @@ uint64_t Syscall::handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uin
             return sys_signal(arg1, arg2);
         case SigReturn:
             return sys_sigreturn();
+        case ThreadCreate:
+            return sys_thread_create(arg1, arg2, arg3);
+        case ThreadExit:
+            return sys_thread_exit(arg1);
+        case ThreadJoin:
+            return sys_thread_join(arg1, arg2);
+        case SetFSBase:
+            return sys_set_fs_base(arg1);
+        case GetTID:
+            return sys_gettid();
+        case SchedSetDeadline:
+            return sys_sched_set_deadline(arg1, arg2, arg3);
+        case SchedSetPriority:
+            return sys_sched_set_priority(arg1);
+        case SchedDeadlineInfo:
+            return sys_sched_deadline_info(arg1, arg2);
+        case SetAffinity:
+            return sys_set_affinity(arg1, arg2);
+        case GetAffinity:
+            return sys_get_affinity(arg1, arg2);
+        case SchedCPUInfo:
+            return sys_sched_cpu_info(arg1, arg2);
+        case SchedStatsInfo:
+            return sys_schedstats(arg1, arg2, arg3);
+        case GroupCreate:
+            return sys_group_create();
+        case GroupDestroy:
+            return sys_group_destroy(arg1);
+        case GroupSetLimits:
+            return sys_group_set_limits(arg1, arg2, arg3, arg4);
+        case GroupAttach:
+            return sys_group_attach(arg1, arg2);
+        case GroupInfo:
+            return sys_group_info(arg1, arg2);
         default:
             return (uint64_t)-1;
     }
 }
 
+// Ends every thread of the process, not just the caller.
 uint64_t Syscall::sys_exit(uint64_t code) {
-    Process* current = Scheduler::get().getCurrentProcess();
+    Thread* current = Scheduler::get().getCurrentThread();
     if (!current) {
         return (uint64_t)-1;
     }
 
-    current->setExitCode((int)code);
-    current->setState(ProcessState::Terminated);
-    
-    return 0;
+    current->getProcess()->terminate((int)code, current);
+    Scheduler::get().exit(current->getProcess()->getExitCode());
 }
 
 static bool isValidUserPointer(uint64_t ptr, size_t size) {
     // User space: < 0x0000800000000000
-    // Kernel space: >= 0xFFFF800000000000
-    if (ptr >= 0xFFFF800000000000) {
+    if (ptr >= KERNEL_SPACE_BASE) {
         return false;
     }
     if (ptr == 0) {
@@ -141,7 +177,13 @@ uint64_t Syscall::sys_write(uint64_t fd, uint64_t buf, uint64_t count) {
         return count;
     }
     
-    return -1;
+    Process* current = Scheduler::get().getCurrentProcess();
+    FileDescriptor* file = current ? current->getFile((int)fd) : nullptr;
+    if (!file) return -1;
+    
+    int64_t result = isValidUserPointer(buf, count) ? VFS::get().write(file, reinterpret_cast<const void*>(buf), count) : -1;
+    current->putFile(file);
+    return result;
 }
 
 uint64_t Syscall::sys_read(uint64_t fd, uint64_t buf, uint64_t count) {
@@ -155,23 +197,19 @@ uint64_t Syscall::sys_read(uint64_t fd, uint64_t buf, uint64_t count) {
             return -1;
         }
         
-        for (int i = 0; i < 100; i++) {
-            if (globalKeyboard->poll() == 0) break;
-        }
-        
         char* buffer = reinterpret_cast<char*>(buf);
         size_t bytesRead = 0;
         
-        asm volatile("sti");
-        
+        // The keyboard IRQ fills the buffer and wakes us, a signal ends the
+        // read with whatever has been typed so far.
         while (bytesRead < count) {
-            char c = globalKeyboard->poll();
-            
-            if (c == 0) {
-                asm volatile("pause");
-                continue;
+            if (!globalKeyboard->waitForKey()) {
+                return bytesRead ? bytesRead : (uint64_t)-1;
             }
             
+            char c = globalKeyboard->getKey();
+            if (c == 0) continue;
+            
             if (c == '\b') {
                 if (bytesRead > 0) {
                     bytesRead--;
@@ -196,20 +234,48 @@ uint64_t Syscall::sys_read(uint64_t fd, uint64_t buf, uint64_t count) {
             }
         }
         
-        asm volatile("cli");
-        
         return bytesRead;
     }
     
-    return -1;
+    Process* current = Scheduler::get().getCurrentProcess();
+    FileDescriptor* file = current ? current->getFile((int)fd) : nullptr;
+    if (!file) return -1;
+    
+    int64_t result = isValidUserPointer(buf, count) ? VFS::get().read(file, reinterpret_cast<void*>(buf), count) : -1;
+    current->putFile(file);
+    return result;
 }
 
-uint64_t Syscall::sys_open(uint64_t path, uint64_t flags, uint64_t mode) {
-    return -1;
+uint64_t Syscall::sys_open(uint64_t path, uint64_t flags, uint64_t mode __attribute__((unused))) {
+    Process* current = Scheduler::get().getCurrentProcess();
+    if (!current || !isValidUserPointer(path, 1)) return -1;
+    
+    const char* userPath = reinterpret_cast<const char*>(path);
+    char pathname[256];
+    size_t pathLen = 0;
+    while (userPath[pathLen] && pathLen < sizeof(pathname) - 1) {
+        pathname[pathLen] = userPath[pathLen];
+        pathLen++;
+    }
+    pathname[pathLen] = '\0';
+    
+    FileDescriptor* file = nullptr;
+    if (VFS::get().open(pathname, (int)flags, &file) != 0) return -1;
+    
+    int fd = current->installFile(file);
+    if (fd < 0) {
+        VFS::get().close(file);
+        return -1;
+    }
+    
+    return fd;
 }
 
 uint64_t Syscall::sys_close(uint64_t fd) {
-    return -1;
+    Process* current = Scheduler::get().getCurrentProcess();
+    if (!current) return -1;
+    
+    return current->closeFile((int)fd);
 }
 
 uint64_t Syscall::sys_getpid() {
@@ -221,11 +287,16 @@ uint64_t Syscall::sys_fork() {
     return -1;
 }
 
-uint64_t Syscall::sys_exec(uint64_t path, uint64_t argv, uint64_t envp __attribute__((unused))) {
+uint64_t Syscall::sys_exec(uint64_t path, uint64_t argv, uint64_t envp __attribute__((unused)), uint64_t stackSize) {
     if (!isValidUserPointer(path, 1)) {
         return -1;
     }
     
+    // 0 picks the default stack reservation.
+    if (stackSize > MAX_USER_STACK_SIZE) {
+        return -1;
+    }
+    
     const char* userPathname = reinterpret_cast<const char*>(path);
     size_t pathLen = 0;
     while (userPathname[pathLen] && pathLen < 256) pathLen++;
@@ -261,15 +332,7 @@ uint64_t Syscall::sys_exec(uint64_t path, uint64_t argv, uint64_t envp __attribu
     }
     kernelArgv[argc] = nullptr;
     
-    uint64_t userCR3;
-    asm volatile("mov %%cr3, %0" : "=r"(userCR3));
-    
-    extern VMM vmm;
-    vmm.load();
-    
-    Process* newProc = ProcessExecutor::loadUserBinaryWithArgs(pathname, argc, kernelArgv);
-    
-    asm volatile("mov %0, %%cr3" :: "r"(userCR3) : "memory");
+    Process* newProc = ProcessExecutor::loadUserBinaryWithArgs(pathname, argc, kernelArgv, stackSize);
     
     for (int i = 0; i < argc; i++) {
         delete[] kernelArgv[i];
@@ -287,7 +350,7 @@ uint64_t Syscall::sys_exec(uint64_t path, uint64_t argv, uint64_t envp __attribu
     }
     
     Scheduler::get().addProcess(newProc);
-    Scheduler::get().scheduleFromSyscall();
+    Scheduler::get().yield();
     
     return 0;
 }
@@ -298,7 +361,8 @@ uint64_t Syscall::sys_wait(uint64_t pid, uint64_t statusPtr) {
         return (uint64_t)-1;
     }
         
-    Process* child = Scheduler::get().getProcessByPID((uint32_t)pid);
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    Process* child = ref.process();
     if (!child) {
         return (uint64_t)-1;
     }
@@ -316,39 +380,96 @@ uint64_t Syscall::sys_wait(uint64_t pid, uint64_t statusPtr) {
 }
 
 uint64_t Syscall::sys_kill(uint64_t pid, uint64_t sig) {
-    Process* target = Scheduler::get().getProcessByPID((uint32_t)pid);
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    Process* target = ref.process();
     if (!target) return -1;
     
     target->sendSignal((int)sig);
     return 0;
 }
 
-uint64_t Syscall::sys_mmap(uint64_t addr, uint64_t length, uint64_t prot) {
-    return -1;
+uint64_t Syscall::sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t offset) {
+    Process* current = Scheduler::get().getCurrentProcess();
+    if (!current) return MAP_FAILED;
+    
+    if (flags & MAP_ANONYMOUS) {
+        return current->getVMAs()->map(addr, length, prot, flags, nullptr, offset);
+    }
+    
+    FileDescriptor* file = current->getFile((int)fd);
+    if (!file) return MAP_FAILED;
+    
+    uint64_t result = current->getVMAs()->map(addr, length, prot, flags, file->getNode(), offset, file->isWritable());
+    current->putFile(file);
+    return result;
 }
 
 uint64_t Syscall::sys_munmap(uint64_t addr, uint64_t length) {
-    return -1;
+    Process* current = Scheduler::get().getCurrentProcess();
+    if (!current) return (uint64_t)-1;
+    
+    return current->getVMAs()->unmap(addr, length);
 }
 
-uint64_t Syscall::sys_yield() {
-    Scheduler::get().yield();
+uint64_t Syscall::sys_mprotect(uint64_t addr, uint64_t length, uint64_t prot) {
+    Process* current = Scheduler::get().getCurrentProcess();
+    if (!current) return (uint64_t)-1;
+    
+    return current->getVMAs()->protect(addr, length, prot);
+}
+
+uint64_t Syscall::sys_hugepage_info(uint64_t info_ptr) {
+    if (!isValidUserPointer(info_ptr, sizeof(HugePageStats))) return (uint64_t)-1;
+    
+    memcpy(reinterpret_cast<void*>(info_ptr), &hugePageStats, sizeof(HugePageStats));
     return 0;
 }
 
-uint64_t Syscall::sys_sleep(uint64_t ms) {
-    if (!globalTimer) return -1;
+// pid 0 selects the system-wide counters.
+uint64_t Syscall::sys_vmstats(uint64_t pid, uint64_t info_ptr, uint64_t flags) {
+    VMStats* stats = &systemVMStats;
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    if (pid != 0) {
+        Process* target = ref.process();
+        if (!target) return (uint64_t)-1;
+        stats = target->getVMAs()->getStats();
+    }
     
-    uint64_t start = globalTimer->getMilliseconds();
-    uint64_t target = start + ms;
+    if (info_ptr) {
+        if (!isValidUserPointer(info_ptr, sizeof(VMStats))) return (uint64_t)-1;
+        memcpy(reinterpret_cast<void*>(info_ptr), stats, sizeof(VMStats));
+    }
     
-    while (globalTimer->getMilliseconds() < target) {
-        asm volatile("pause");
+    if (flags & VMSTATS_DUMP) {
+        VMStatistics::dump(pid ? "process" : "system", stats);
     }
     
     return 0;
 }
 
+uint64_t Syscall::sys_yield() {
+    Scheduler::get().yield();
+    return 0;
+}
+
+// Takes a TID, 0 selects the calling thread. Out of range values are
+// clamped to -20..19.
+uint64_t Syscall::sys_nice(uint64_t tid, uint64_t nice) {
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)tid);
+    Thread* target = tid ? ref.get() : Scheduler::get().getCurrentThread();
+    if (!target) return (uint64_t)-1;
+    
+    target->setNice((int)(int64_t)nice);
+    return 0;
+}
+
+// -1 when a signal cut the sleep short.
+uint64_t Syscall::sys_sleep(uint64_t ms) {
+    if (!globalTimer) return -1;
+    
+    return Scheduler::get().sleep(ms * 1000000) ? 0 : (uint64_t)-1;
+}
+
 uint64_t Syscall::sys_gettime() {
     if (!globalTimer) {
         return 0;
@@ -377,22 +498,21 @@ uint64_t Syscall::sys_fb_info(uint64_t info_ptr) {
     extern Framebuffer* fb;
     if (!fb) return (uint64_t)-1;
     
-    uint64_t fb_kernel_virt = reinterpret_cast<uint64_t>(fb->getRaw());
-    uint64_t fb_phys = fb_kernel_virt - hhdm_request.response->offset;
+    uint64_t fb_phys = fb->getPhysical();
     
     constexpr uint64_t USER_FB_BASE = 0x0000700000000000;
     
     Process* current = Scheduler::get().getCurrentProcess();
     if (!current) return (uint64_t)-1;
     
-    size_t fb_size = fb->getPitch() * fb->getHeight();
+    size_t fb_size = fb->getSize();
     size_t pages = (fb_size + PAGE_SIZE - 1) / PAGE_SIZE;
     
     current->getVMM()->mapRange(
         reinterpret_cast<void*>(USER_FB_BASE),
         reinterpret_cast<void*>(fb_phys),
         pages,
-        PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_CACHE_DISABLE
+        PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_WRITE_COMBINING
     );
     
     FBInfo* info = reinterpret_cast<FBInfo*>(info_ptr);
@@ -415,45 +535,12 @@ uint64_t Syscall::sys_fb_map() {
     return reinterpret_cast<uint64_t>(fb->getRaw());
 }
 
-extern "C" void saveSyscallState(uint64_t* stack) {
-    Process* current = Scheduler::get().getCurrentProcess();
-    if (!current) return;
-    
-    uint64_t* regs = stack;
-    uint64_t* cpuFrame = stack + 15;
-    
-    uint64_t user_rip = cpuFrame[0];
-    uint64_t user_cs = cpuFrame[1];
-    uint64_t user_rflags = cpuFrame[2];
-    uint64_t user_rsp = cpuFrame[3];
-    
-    if (user_cs == 0x1B) {
-        current->getContext()->rip = user_rip;
-        current->getContext()->rsp = user_rsp;
-        current->getContext()->rflags = user_rflags;
-        
-        current->getContext()->rax = regs[0];
-        current->getContext()->rbx = regs[1];
-        current->getContext()->rcx = regs[2];
-        current->getContext()->rdx = regs[3];
-        current->getContext()->rsi = regs[4];
-        current->getContext()->rdi = regs[5];
-        current->getContext()->rbp = regs[6];
-        current->getContext()->r8 = regs[7];
-        current->getContext()->r9 = regs[8];
-        current->getContext()->r10 = regs[9];
-        current->getContext()->r11 = regs[10];
-        current->getContext()->r12 = regs[11];
-        current->getContext()->r13 = regs[12];
-        current->getContext()->r14 = regs[13];
-        current->getContext()->r15 = regs[14];
-        
-        current->setValidUserState(true);
-    }
-}
-
-extern "C" uint64_t syscallHandler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
-    return Syscall::get().handle(syscall_num, arg1, arg2, arg3, arg4, arg5);
+// Syscalls run with interrupts on so a long one can be preempted.
+extern "C" void syscallHandler(InterruptFrame* frame) {
+    if (frame->rflags & 0x200) asm volatile("sti");
+    frame->rax = Syscall::get().handle(frame->rax, frame->rbx, frame->rcx, frame->rdx, frame->rsi, frame->rdi, frame->r8);
+    asm volatile("cli");
+    Scheduler::get().returnToUser();
 }
 
 uint64_t Syscall::sys_signal(uint64_t sig, uint64_t handler) {
@@ -470,12 +557,239 @@ uint64_t Syscall::sys_signal(uint64_t sig, uint64_t handler) {
 }
 
 uint64_t Syscall::sys_sigreturn() {
-    Process* current = Scheduler::get().getCurrentProcess();
+    Thread* current = Scheduler::get().getCurrentThread();
     if (!current) return (uint64_t)-1;
     
-    uint64_t* stack = reinterpret_cast<uint64_t*>(current->getContext()->rsp);
-    current->getContext()->rip = stack[0];
-    current->getContext()->rsp += 128;
+    InterruptFrame* frame = current->getUserFrame();
+    uint64_t* stack = reinterpret_cast<uint64_t*>(frame->rsp);
+    frame->rip = stack[0];
+    frame->rsp += 128;
     
     return 0;
 }
+
+// Starts a joinable thread in the caller's process at entry, with arg in the
+// first argument register. Without a stack the kernel maps one, with a guard
+// page below it, and unmaps it when the thread is freed.
+uint64_t Syscall::sys_thread_create(uint64_t entry, uint64_t stack, uint64_t arg) {
+    Thread* current = Scheduler::get().getCurrentThread();
+    if (!current) return (uint64_t)-1;
+    Process* process = current->getProcess();
+
+    if (!isValidUserPointer(entry, 1)) return (uint64_t)-1;
+    if (stack && !isValidUserPointer(stack - 1, 1)) return (uint64_t)-1;
+    if (process->isExiting()) return (uint64_t)-1;
+
+    uint64_t base = 0;
+    if (!stack) {
+        VMAManager* vmas = process->getVMAs();
+        base = vmas->map(0, THREAD_STACK_SIZE + PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK);
+        if (base == MAP_FAILED) return (uint64_t)-1;
+        vmas->protect(base, PAGE_SIZE, PROT_NONE);
+        stack = base + THREAD_STACK_SIZE + PAGE_SIZE;
+    }
+
+    uint32_t tid = Scheduler::get().allocatePID();
+    if (!tid) {
+        if (base) process->getVMAs()->unmap(base, THREAD_STACK_SIZE + PAGE_SIZE);
+        return (uint64_t)-1;
+    }
+
+    Thread* thread = process->createThread(tid);
+    if (!thread) {
+        if (base) process->getVMAs()->unmap(base, THREAD_STACK_SIZE + PAGE_SIZE);
+        return (uint64_t)-1;
+    }
+    thread->setDetached(false);
+    if (base) thread->setOwnedStack(base, THREAD_STACK_SIZE + PAGE_SIZE);
+
+    // As if called: aligned, minus the return address slot.
+    thread->setUserStack((stack & ~0xFULL) - 8);
+    thread->setEntry(entry, arg);
+    // A deadline reservation is not inherited, it would bypass admission.
+    thread->setSignalMask(current->getSignalMask());
+    if (current->getPolicy() != SchedPolicy::Deadline) thread->setPolicy(current->getPolicy());
+    thread->setPriority(current->getPriority());
+    thread->setNice(current->getNice());
+
+    Scheduler::get().addThread(thread);
+    return tid;
+}
+
+uint64_t Syscall::sys_thread_exit(uint64_t code) {
+    if (!Scheduler::get().getCurrentThread()) return (uint64_t)-1;
+    Scheduler::get().exit((int)code);
+}
+
+// -1 if tid is not a joinable thread of the caller's process, or a signal
+// interrupted the wait.
+uint64_t Syscall::sys_thread_join(uint64_t tid, uint64_t statusPtr) {
+    if (statusPtr && !isValidUserPointer(statusPtr, sizeof(int))) return (uint64_t)-1;
+
+    int code = 0;
+    if (!Scheduler::get().join((uint32_t)tid, &code)) return (uint64_t)-1;
+
+    if (statusPtr) {
+        *reinterpret_cast<int*>(statusPtr) = code;
+    }
+    return 0;
+}
+
+uint64_t Syscall::sys_set_fs_base(uint64_t base) {
+    Thread* current = Scheduler::get().getCurrentThread();
+    if (!current) return (uint64_t)-1;
+    if (base >= USER_SPACE_END) return (uint64_t)-1;
+
+    current->setFSBase(base);
+    wrmsr(MSR_FS_BASE, base);
+    return 0;
+}
+
+uint64_t Syscall::sys_gettid() {
+    Thread* current = Scheduler::get().getCurrentThread();
+    return current ? current->getTID() : 0;
+}
+
+// Reserves runtime ns of CPU every period ns for the calling thread, due
+// within deadline ns of the start of each period. runtime 0 returns it to
+// the fair class. -1 if the parameters are invalid or do not fit.
+uint64_t Syscall::sys_sched_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period) {
+    Thread* current = Scheduler::get().getCurrentThread();
+    if (!current) return (uint64_t)-1;
+
+    return Scheduler::get().setDeadline(current, runtime, deadline, period) ? 0 : (uint64_t)-1;
+}
+
+// Runs the caller in the fixed priority class, ahead of every fair thread,
+// at priority 0 (most urgent) to 31. -1 returns it to the fair class.
+uint64_t Syscall::sys_sched_set_priority(uint64_t priority) {
+    Thread* current = Scheduler::get().getCurrentThread();
+    if (!current) return (uint64_t)-1;
+
+    return Scheduler::get().setPriority(current, (int)(int64_t)priority) ? 0 : (uint64_t)-1;
+}
+
+// tid 0 selects the calling thread.
+uint64_t Syscall::sys_sched_deadline_info(uint64_t tid, uint64_t info_ptr) {
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)tid);
+    Thread* target = tid ? ref.get() : Scheduler::get().getCurrentThread();
+    if (!target) return (uint64_t)-1;
+    if (!isValidUserPointer(info_ptr, sizeof(DeadlineInfo))) return (uint64_t)-1;
+
+    DeadlineEntity* dl = target->getDeadlineEntity();
+    DeadlineInfo info = {};
+    if (target->getPolicy() == SchedPolicy::Deadline) {
+        info.runtime = dl->runtime;
+        info.deadline = dl->deadline;
+        info.period = dl->period;
+    }
+    info.missed = dl->missed;
+    info.throttles = dl->throttles;
+
+    memcpy(reinterpret_cast<void*>(info_ptr), &info, sizeof(DeadlineInfo));
+    return 0;
+}
+
+// pid 0 selects the caller's process. Bit n of mask allows CPU n.
+uint64_t Syscall::sys_set_affinity(uint64_t pid, uint64_t mask) {
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    Process* target = pid ? ref.process() : Scheduler::get().getCurrentProcess();
+    if (!target) return (uint64_t)-1;
+
+    return Scheduler::get().setAffinity(target, mask) ? 0 : (uint64_t)-1;
+}
+
+uint64_t Syscall::sys_get_affinity(uint64_t pid, uint64_t mask_ptr) {
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    Process* target = pid ? ref.process() : Scheduler::get().getCurrentProcess();
+    if (!target) return (uint64_t)-1;
+    if (!isValidUserPointer(mask_ptr, sizeof(uint64_t))) return (uint64_t)-1;
+
+    *reinterpret_cast<uint64_t*>(mask_ptr) = target->getAffinity();
+    return 0;
+}
+
+uint64_t Syscall::sys_sched_cpu_info(uint64_t cpu, uint64_t info_ptr) {
+    CPUData* data = SMP::get().getCPU((uint32_t)cpu);
+    if (!data || !data->online) return (uint64_t)-1;
+    if (!isValidUserPointer(info_ptr, sizeof(CPUSchedInfo))) return (uint64_t)-1;
+
+    CPUSchedInfo info = {};
+    info.loadAvg = data->loadAvg;
+    info.queued = data->runQueue.size();
+    info.migrations = data->migrations;
+    info.balanced = data->balanced;
+    info.idleTime = data->idleTime;
+    info.idleEntries = data->idleEntries;
+    info.queuePeak = data->runQueue.getPeak();
+    for (size_t i = 0; i < QUEUE_TRACE_LENGTH; i++) {
+        info.queueTrace[i] = data->queueTrace[(data->queueTraceHead + i) % QUEUE_TRACE_LENGTH];
+    }
+
+    memcpy(reinterpret_cast<void*>(info_ptr), &info, sizeof(CPUSchedInfo));
+    return 0;
+}
+
+// pid 0 selects the whole system, summed over all CPUs. Latencies and
+// switch times are in TSC cycles.
+uint64_t Syscall::sys_schedstats(uint64_t pid, uint64_t info_ptr, uint64_t flags) {
+    SchedStats stats;
+    if (pid != 0) {
+        ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+        Process* target = ref.process();
+        if (!target) return (uint64_t)-1;
+        stats = *target->getSchedStats();
+    } else {
+        SchedStatistics::collect(&stats);
+    }
+
+    if (info_ptr) {
+        if (!isValidUserPointer(info_ptr, sizeof(SchedStats))) return (uint64_t)-1;
+        memcpy(reinterpret_cast<void*>(info_ptr), &stats, sizeof(SchedStats));
+    }
+
+    if (flags & SCHEDSTATS_DUMP) {
+        SchedStatistics::dump(pid ? "process" : "system", &stats);
+    }
+
+    return 0;
+}
+
+uint64_t Syscall::sys_group_create() {
+    ResourceGroup* group = ResourceGroups::get().create();
+    return group ? group->id : (uint64_t)-1;
+}
+
+uint64_t Syscall::sys_group_destroy(uint64_t gid) {
+    return ResourceGroups::get().destroy((uint32_t)gid) ? 0 : (uint64_t)-1;
+}
+
+// quota and period in ns, memory in bytes. 0 lifts either limit.
+uint64_t Syscall::sys_group_set_limits(uint64_t gid, uint64_t quota, uint64_t period, uint64_t memory) {
+    return ResourceGroups::get().setLimits((uint32_t)gid, quota, period, memory) ? 0 : (uint64_t)-1;
+}
+
+// pid 0 selects the caller's process. Kernel tasks stay in the root group.
+uint64_t Syscall::sys_group_attach(uint64_t gid, uint64_t pid) {
+    ResourceGroup* group = ResourceGroups::get().lookup((uint32_t)gid);
+    ThreadRef ref = Scheduler::get().lookup((uint32_t)pid);
+    Process* target = pid ? ref.process() : Scheduler::get().getCurrentProcess();
+    if (!group || !target) return (uint64_t)-1;
+
+    Thread* mainThread = target->getMainThread();
+    if (mainThread && mainThread->isKernelTask()) return (uint64_t)-1;
+
+    return ResourceGroups::get().attach(target, group) ? 0 : (uint64_t)-1;
+}
+
+uint64_t Syscall::sys_group_info(uint64_t gid, uint64_t info_ptr) {
+    ResourceGroup* group = ResourceGroups::get().lookup((uint32_t)gid);
+    if (!group) return (uint64_t)-1;
+    if (!isValidUserPointer(info_ptr, sizeof(ResourceGroupInfo))) return (uint64_t)-1;
+
+    ResourceGroupInfo info = {};
+    ResourceGroups::get().getInfo(group, &info);
+
+    memcpy(reinterpret_cast<void*>(info_ptr), &info, sizeof(ResourceGroupInfo));
+    return 0;
+}
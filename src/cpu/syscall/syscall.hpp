@@ -22,27 +22,30 @@ enum class SyscallNumber : uint64_t {
     FBInfo = 16,
     FBMap = 17,
     Signal = 18,
-    SigReturn = 19
+    SigReturn = 19,
+    Mprotect = 20,
+    HugePageInfo = 21,
+    VMStatsInfo = 22,
+    Nice = 23,
+    ThreadCreate = 24,
+    ThreadExit = 25,
+    ThreadJoin = 26,
+    SetFSBase = 27,
+    GetTID = 28,
+    SchedSetDeadline = 29,
+    SchedDeadlineInfo = 30,
+    SetAffinity = 31,
+    GetAffinity = 32,
+    SchedCPUInfo = 33,
+    SchedStatsInfo = 34,
+    GroupCreate = 35,
+    GroupDestroy = 36,
+    GroupSetLimits = 37,
+    GroupAttach = 38,
+    GroupInfo = 39,
+    SchedSetPriority = 40
 };
 
-struct SyscallFrame {
-    uint64_t rax;
-    uint64_t rbx;
-    uint64_t rcx;
-    uint64_t rdx;
-    uint64_t rsi;
-    uint64_t rdi;
-    uint64_t rbp;
-    uint64_t r8;
-    uint64_t r9;
-    uint64_t r10;
-    uint64_t r11;
-    uint64_t r12;
-    uint64_t r13;
-    uint64_t r14;
-    uint64_t r15;
-} __attribute__((packed));
-
 class Syscall {
 public:
     Syscall() : initialized(false) {}
@@ -50,8 +53,7 @@ public:
     static Syscall& get();
     
     void initialize();
-    void setKernelStack(uint64_t stack);
-    uint64_t handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
+    uint64_t handle(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6);
     
 private:
     bool initialized;
@@ -63,12 +65,16 @@ private:
     uint64_t sys_close(uint64_t fd);
     uint64_t sys_getpid();
     uint64_t sys_fork();
-    uint64_t sys_exec(uint64_t path, uint64_t argv, uint64_t envp);
+    uint64_t sys_exec(uint64_t path, uint64_t argv, uint64_t envp, uint64_t stackSize);
     uint64_t sys_wait(uint64_t pid, uint64_t status);
     uint64_t sys_kill(uint64_t pid, uint64_t sig);
-    uint64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot);
+    uint64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t offset);
     uint64_t sys_munmap(uint64_t addr, uint64_t length);
+    uint64_t sys_mprotect(uint64_t addr, uint64_t length, uint64_t prot);
+    uint64_t sys_hugepage_info(uint64_t info_ptr);
+    uint64_t sys_vmstats(uint64_t pid, uint64_t info_ptr, uint64_t flags);
     uint64_t sys_yield();
+    uint64_t sys_nice(uint64_t pid, uint64_t nice);
     uint64_t sys_sleep(uint64_t ms);
     uint64_t sys_gettime();
     uint64_t sys_clear();
@@ -76,7 +82,24 @@ private:
     uint64_t sys_fb_map();
     uint64_t sys_signal(uint64_t sig, uint64_t handler);
     uint64_t sys_sigreturn();
+    uint64_t sys_thread_create(uint64_t entry, uint64_t stack, uint64_t arg);
+    uint64_t sys_thread_exit(uint64_t code);
+    uint64_t sys_thread_join(uint64_t tid, uint64_t statusPtr);
+    uint64_t sys_set_fs_base(uint64_t base);
+    uint64_t sys_gettid();
+    uint64_t sys_sched_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period);
+    uint64_t sys_sched_set_priority(uint64_t priority);
+    uint64_t sys_sched_deadline_info(uint64_t tid, uint64_t info_ptr);
+    uint64_t sys_set_affinity(uint64_t pid, uint64_t mask);
+    uint64_t sys_get_affinity(uint64_t pid, uint64_t mask_ptr);
+    uint64_t sys_sched_cpu_info(uint64_t cpu, uint64_t info_ptr);
+    uint64_t sys_schedstats(uint64_t pid, uint64_t info_ptr, uint64_t flags);
+    uint64_t sys_group_create();
+    uint64_t sys_group_destroy(uint64_t gid);
+    uint64_t sys_group_set_limits(uint64_t gid, uint64_t quota, uint64_t period, uint64_t memory);
+    uint64_t sys_group_attach(uint64_t gid, uint64_t pid);
+    uint64_t sys_group_info(uint64_t gid, uint64_t info_ptr);
 };
 
 extern "C" void syscallEntry();
-extern "C" uint64_t syscallHandler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
+extern "C" void syscallHandler(struct InterruptFrame* frame);
@@ -1,4 +1,5 @@
 #include "elf.hpp"
+#include "execcache.hpp"
 #include <cpu/process/process.hpp>
 #include <cpu/process/scheduler.hpp>
 #include <cpu/mm/pmm.hpp>
@@ -8,7 +9,6 @@
 #include <graphics/console.hpp>
 
 extern Console* console;
-extern "C" void processTrampoline();
 
 bool ELFLoader::validateHeader(const Elf64_Ehdr* ehdr) {
     if (ehdr->e_ident[EI_MAG0] != ELFMAG0 ||
@@ -46,7 +46,7 @@ bool ELFLoader::isValidELF(const void* data, size_t size) {
     return validateHeader(ehdr);
 }
 
-Process* ELFLoader::loadELF(const void* data, size_t size) {
+Process* ELFLoader::loadELF(const void* data, size_t size, size_t stackSize) {
     if (!isValidELF(data, size)) {
         return nullptr;
     }
@@ -54,7 +54,9 @@ Process* ELFLoader::loadELF(const void* data, size_t size) {
     const Elf64_Ehdr* ehdr = static_cast<const Elf64_Ehdr*>(data);
     
     uint32_t pid = Scheduler::get().allocatePID();
-    Process* proc = new Process(pid);
+    if (!pid) return nullptr;
+    Process* proc = Process::create(pid, stackSize);
+    if (!proc) return nullptr;
     
     const uint8_t* fileData = static_cast<const uint8_t*>(data);
     const Elf64_Phdr* phdr = reinterpret_cast<const Elf64_Phdr*>(fileData + ehdr->e_phoff);
@@ -71,7 +73,7 @@ Process* ELFLoader::loadELF(const void* data, size_t size) {
             uint64_t pageAlignedEnd = (endAddr + 0xFFF) & ~0xFFFULL;
             size_t pages = (pageAlignedEnd - pageAlignedAddr) / PAGE_SIZE;
             
-            void* physPages = pmm.allocatePages(pages);
+            void* physPages = pmm.allocatePagesFor(proc->getGroup(), pages);
             if (!physPages) {
                 if (console) {
                     console->drawText("[ELF] Failed to allocate pages\n");
@@ -99,22 +101,60 @@ Process* ELFLoader::loadELF(const void* data, size_t size) {
         }
     }
     
-    uint64_t userStack = proc->getUserStack();
-    userStack &= ~0xFULL;
-    
-    uint64_t entry = ehdr->e_entry;
-    uint64_t trampolineAddr = reinterpret_cast<uint64_t>(&processTrampoline);
-    
-    uint64_t kernelStack = proc->getKernelStack();
-    kernelStack -= 8;
-    *reinterpret_cast<uint64_t*>(kernelStack) = userStack;
-    kernelStack -= 8;
-    *reinterpret_cast<uint64_t*>(kernelStack) = entry;
-    
-    proc->getContext()->rip = trampolineAddr;
-    proc->getContext()->rsp = kernelStack;
-    proc->getContext()->rbp = 0;
-    proc->getContext()->rflags = 0x202;
+    proc->getMainThread()->setUserStack(proc->getMainThread()->getUserStack() & ~0xFULL);
+    proc->getMainThread()->setEntry(ehdr->e_entry);
+
+    return proc;
+}
+
+// Read-only segments are mapped from the image's frames, each mapping
+// holding its own reference on them. Writable ones get private copies.
+Process* ELFLoader::loadImage(ExecImage* image, size_t stackSize) {
+    if (!image) return nullptr;
+
+    uint32_t pid = Scheduler::get().allocatePID();
+    if (!pid) return nullptr;
+    Process* proc = Process::create(pid, stackSize);
+    if (!proc) return nullptr;
+
+    for (size_t i = 0; i < image->segmentCount; i++) {
+        ExecSegment* segment = &image->segments[i];
+        void* physPages = reinterpret_cast<void*>(segment->phys);
+        uint64_t flags = PTE_PRESENT | PTE_USER;
+
+        if (segment->writable) {
+            physPages = pmm.allocatePagesFor(proc->getGroup(), segment->pages);
+            if (!physPages) {
+                if (console) {
+                    console->drawText("[ELF] Failed to allocate pages\n");
+                }
+                delete proc;
+                return nullptr;
+            }
+            memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(physPages) + hhdm_request.response->offset),
+                   reinterpret_cast<void*>(segment->phys + hhdm_request.response->offset), segment->pages * PAGE_SIZE);
+            flags |= PTE_WRITABLE;
+        } else {
+            for (size_t page = 0; page < segment->pages; page++) {
+                pmm.retain(reinterpret_cast<void*>(segment->phys + page * PAGE_SIZE));
+            }
+        }
+
+        proc->getVMM()->mapRange(reinterpret_cast<void*>(segment->start), physPages, segment->pages, flags);
+    }
+
+    proc->getMainThread()->setUserStack(proc->getMainThread()->getUserStack() & ~0xFULL);
+    proc->getMainThread()->setEntry(image->entry);
+
+    return proc;
+}
+
+Process* ELFLoader::loadImageWithArgs(ExecImage* image, int argc, const char** argv, size_t stackSize) {
+    Process* proc = loadImage(image, stackSize);
+
+    if (proc) {
+        setupArguments(proc, argc, argv);
+    }
 
     return proc;
 }
@@ -122,7 +162,7 @@ Process* ELFLoader::loadELF(const void* data, size_t size) {
 void ELFLoader::setupArguments(Process* proc, int argc, const char** argv) {
     if (!proc || argc < 0) return;
     
-    uint64_t userStack = proc->getUserStack();
+    uint64_t userStack = proc->getMainThread()->getUserStack();
     userStack &= ~0xFULL;
     
     size_t totalStringSize = 0;
@@ -138,6 +178,10 @@ void ELFLoader::setupArguments(Process* proc, int argc, const char** argv) {
     userStack -= totalSize;
     userStack &= ~0xFULL;
     
+    // The stack is populated lazily, and the arguments are written through
+    // the HHDM without switching to the new address space.
+    if (!proc->getVMAs()->populate(userStack, totalSize)) return;
+    
     uint8_t* buffer = new uint8_t[totalSize];
     if (!buffer) return;
     memset(buffer, 0, totalSize);
@@ -162,25 +206,15 @@ void ELFLoader::setupArguments(Process* proc, int argc, const char** argv) {
     uint64_t* argcPtr = reinterpret_cast<uint64_t*>(buffer);
     *argcPtr = argc;
     
-    uint64_t savedCR3;
-    asm volatile("mov %%cr3, %0" : "=r"(savedCR3));
-    
-    proc->getVMM()->load();
-    
-    memcpy(reinterpret_cast<void*>(userStack), buffer, totalSize);
-    
-    asm volatile("mov %0, %%cr3" :: "r"(savedCR3) : "memory");
+    bool copied = proc->getVMM()->copyTo(reinterpret_cast<void*>(userStack), buffer, totalSize);
     
     delete[] buffer;
     
-    proc->setUserStack(userStack);
-    
-    uint64_t* userRspOnStack = reinterpret_cast<uint64_t*>(proc->getContext()->rsp + 8);
-    *userRspOnStack = userStack;
+    if (copied) proc->getMainThread()->setUserStack(userStack);
 }
 
-Process* ELFLoader::loadELFWithArgs(const void* data, size_t size, int argc, const char** argv) {
-    Process* proc = loadELF(data, size);
+Process* ELFLoader::loadELFWithArgs(const void* data, size_t size, int argc, const char** argv, size_t stackSize) {
+    Process* proc = loadELF(data, size, stackSize);
     
     if (proc) {
         setupArguments(proc, argc, argv);
@@ -189,7 +223,19 @@ Process* ELFLoader::loadELFWithArgs(const void* data, size_t size, int argc, con
     return proc;
 }
 
+bool ELFLoader::loadCached(const char* path, Process** proc, int argc, const char** argv, size_t stackSize) {
+    ExecImage* image = ExecCache::get().acquire(path);
+    if (!image) return false;
+
+    *proc = argv ? loadImageWithArgs(image, argc, argv, stackSize) : loadImage(image, stackSize);
+    ExecCache::get().release(image);
+    return true;
+}
+
 Process* ELFLoader::loadELFFromFile(const char* path) {
+    Process* cached = nullptr;
+    if (loadCached(path, &cached)) return cached;
+
     FileDescriptor* fd = nullptr;
     int result = VFS::get().open(path, 0, &fd);
     
@@ -221,6 +267,9 @@ Process* ELFLoader::loadELFFromFile(const char* path) {
 }
 
 Process* ELFLoader::loadELFFromFileWithArgs(const char* path, int argc, const char** argv) {
+    Process* cached = nullptr;
+    if (loadCached(path, &cached, argc, argv)) return cached;
+
     FileDescriptor* fd = nullptr;
     int result = VFS::get().open(path, 0, &fd);
     
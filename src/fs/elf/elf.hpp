@@ -64,14 +64,22 @@ struct Elf64_Phdr {
 #define PF_R          0x4
 
 class Process;
+struct ExecImage;
 
 class ELFLoader {
 public:
     static bool isValidELF(const void* data, size_t size);
-    static Process* loadELF(const void* data, size_t size);
-    static Process* loadELFWithArgs(const void* data, size_t size, int argc, const char** argv);
+    static Process* loadELF(const void* data, size_t size, size_t stackSize = 0);
+    static Process* loadELFWithArgs(const void* data, size_t size, int argc, const char** argv, size_t stackSize = 0);
     static Process* loadELFFromFile(const char* path);
     static Process* loadELFFromFileWithArgs(const char* path, int argc, const char** argv);
+    // A process running a cached image, see ExecCache.
+    static Process* loadImage(ExecImage* image, size_t stackSize = 0);
+    static Process* loadImageWithArgs(ExecImage* image, int argc, const char** argv, size_t stackSize = 0);
+    // Runs path from the exec cache, with arguments when argv is given, and
+    // leaves the process (nullptr on failure) in proc. False if the cache
+    // cannot hold the file; the caller then loads it the slow way.
+    static bool loadCached(const char* path, Process** proc, int argc = 0, const char** argv = nullptr, size_t stackSize = 0);
     
 private:
     static bool validateHeader(const Elf64_Ehdr* ehdr);
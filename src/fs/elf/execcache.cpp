@@ -0,0 +1,211 @@
+#include "execcache.hpp"
+#include "elf.hpp"
+#include <cpu/mm/pmm.hpp>
+#include <cpu/mm/vma.hpp>
+#include <fs/vfs/vfs.hpp>
+#include <x86_64/requests.hpp>
+#include <string.h>
+
+ExecCache execCacheInstance;
+
+ExecCache& ExecCache::get() {
+    return execCacheInstance;
+}
+
+ExecImage* ExecCache::lookup(FileSystem* fs, uint64_t inode) {
+    for (ExecImage* image = images; image; image = image->next) {
+        if (image->fs == fs && image->inode == inode) return image;
+    }
+    return nullptr;
+}
+
+ExecImage* ExecCache::takeVictim() {
+    ExecImage** victim = nullptr;
+    for (ExecImage** link = &images; *link; link = &(*link)->next) {
+        if ((*link)->refCount) continue;
+        if (!victim || (*link)->lastUse < (*victim)->lastUse) victim = link;
+    }
+    if (!victim) return nullptr;
+
+    ExecImage* image = *victim;
+    *victim = image->next;
+    image->cached = false;
+    count--;
+    return image;
+}
+
+void ExecCache::destroy(ExecImage* image) {
+    for (size_t i = 0; i < image->segmentCount; i++) {
+        ExecSegment* segment = &image->segments[i];
+        for (size_t page = 0; page < segment->pages; page++) {
+            pmm.release(reinterpret_cast<void*>(segment->phys + page * PAGE_SIZE));
+        }
+    }
+    delete image;
+}
+
+// Images whose segments share a page are not decoded: the frames of one
+// would have to carry bytes of the other.
+ExecImage* ExecCache::decode(const void* data, size_t size) {
+    if (!ELFLoader::isValidELF(data, size)) return nullptr;
+
+    const Elf64_Ehdr* ehdr = static_cast<const Elf64_Ehdr*>(data);
+    const uint8_t* fileData = static_cast<const uint8_t*>(data);
+    if (ehdr->e_phoff > size || ehdr->e_phnum > (size - ehdr->e_phoff) / sizeof(Elf64_Phdr)) return nullptr;
+
+    const Elf64_Phdr* phdr = reinterpret_cast<const Elf64_Phdr*>(fileData + ehdr->e_phoff);
+
+    ExecImage* image = new ExecImage{};
+    if (!image) return nullptr;
+    image->entry = ehdr->e_entry;
+
+    for (uint16_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD || phdr[i].p_memsz == 0) continue;
+
+        uint64_t vaddr = phdr[i].p_vaddr;
+        uint64_t memsz = phdr[i].p_memsz;
+        uint64_t filesz = phdr[i].p_filesz;
+        uint64_t offset = phdr[i].p_offset;
+
+        if (filesz > memsz || offset > size || filesz > size - offset || vaddr >= USER_SPACE_END || memsz > USER_SPACE_END - vaddr) {
+            destroy(image);
+            return nullptr;
+        }
+
+        uint64_t start = vaddr & ~(PAGE_SIZE - 1);
+        uint64_t end = (vaddr + memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        bool overlaps = image->segmentCount == EXEC_MAX_SEGMENTS;
+        for (size_t j = 0; j < image->segmentCount && !overlaps; j++) {
+            ExecSegment* other = &image->segments[j];
+            overlaps = start < other->start + other->pages * PAGE_SIZE && other->start < end;
+        }
+        if (overlaps) {
+            destroy(image);
+            return nullptr;
+        }
+
+        size_t pages = (end - start) / PAGE_SIZE;
+        void* phys = pmm.allocatePages(pages);
+        if (!phys) {
+            destroy(image);
+            return nullptr;
+        }
+
+        uint8_t* frames = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(phys) + hhdm_request.response->offset);
+        memset(frames, 0, pages * PAGE_SIZE);
+        memcpy(frames + (vaddr - start), fileData + offset, filesz);
+
+        ExecSegment* segment = &image->segments[image->segmentCount++];
+        segment->start = start;
+        segment->pages = pages;
+        segment->writable = phdr[i].p_flags & PF_W;
+        segment->phys = reinterpret_cast<uint64_t>(phys);
+    }
+
+    return image;
+}
+
+ExecImage* ExecCache::acquire(const char* path) {
+    FileDescriptor* fd = nullptr;
+    if (VFS::get().open(path, 0, &fd) != 0 || !fd) return nullptr;
+
+    VNode* node = fd->getNode();
+    FileSystem* fs = node->getFS();
+    uint64_t inode = node->getInode();
+
+    lock.lock();
+    ExecImage* image = lookup(fs, inode);
+    if (image) {
+        image->refCount++;
+        image->lastUse = ++clock;
+        hits++;
+        lock.unlock();
+        VFS::get().close(fd);
+        return image;
+    }
+    lock.unlock();
+
+    // The header says whether the rest is worth reading here; anything else
+    // goes back to the caller's loader.
+    Elf64_Ehdr header;
+    FileStats stats;
+    if (VFS::get().read(fd, &header, sizeof(header)) != sizeof(header) || !ELFLoader::isValidELF(&header, sizeof(header)) ||
+        node->ops->stat(node, &stats) != 0) {
+        VFS::get().close(fd);
+        return nullptr;
+    }
+
+    size_t size = stats.size;
+    uint8_t* buffer = new uint8_t[size];
+    fd->setOffset(0);
+    int64_t result = VFS::get().read(fd, buffer, size);
+    VFS::get().close(fd);
+
+    if (result == static_cast<int64_t>(size)) {
+        image = decode(buffer, size);
+    }
+    delete[] buffer;
+    if (!image) return nullptr;
+
+    image->fs = fs;
+    image->inode = inode;
+    image->refCount = 1;
+
+    // Decoding ran unlocked, another exec of the same file may have won.
+    ExecImage* victim = nullptr;
+    lock.lock();
+    misses++;
+    ExecImage* raced = lookup(fs, inode);
+    if (raced) {
+        raced->refCount++;
+        raced->lastUse = ++clock;
+        lock.unlock();
+        destroy(image);
+        return raced;
+    }
+
+    if (count >= MAX_IMAGES) {
+        victim = takeVictim();
+    }
+    // With every slot busy loading, the image serves this exec only.
+    if (count < MAX_IMAGES) {
+        image->cached = true;
+        image->next = images;
+        images = image;
+        count++;
+    }
+    image->lastUse = ++clock;
+    lock.unlock();
+
+    if (victim) destroy(victim);
+    return image;
+}
+
+void ExecCache::release(ExecImage* image) {
+    if (!image) return;
+
+    lock.lock();
+    bool dead = --image->refCount == 0 && !image->cached;
+    lock.unlock();
+
+    if (dead) destroy(image);
+}
+
+void ExecCache::evict(FileSystem* fs, uint64_t inode) {
+    lock.lock();
+    ExecImage* image = nullptr;
+    for (ExecImage** link = &images; *link; link = &(*link)->next) {
+        if ((*link)->fs == fs && (*link)->inode == inode) {
+            image = *link;
+            *link = image->next;
+            image->cached = false;
+            count--;
+            break;
+        }
+    }
+    bool dead = image && image->refCount == 0;
+    lock.unlock();
+
+    if (dead) destroy(image);
+}
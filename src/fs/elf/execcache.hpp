@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+class FileSystem;
+
+constexpr size_t EXEC_MAX_SEGMENTS = 8;
+
+// A PT_LOAD segment rounded out to whole pages and already filled in: file
+// contents at their offset in the first page, zeroes up to the end.
+struct ExecSegment {
+    uint64_t start;
+    size_t pages;
+    bool writable;
+    uint64_t phys;      // contiguous frames
+};
+
+// A decoded executable. Read-only segments are mapped straight from phys
+// into every process running the image, writable ones are copied from it.
+struct ExecImage {
+    FileSystem* fs;
+    uint64_t inode;
+    uint64_t entry;
+    ExecSegment segments[EXEC_MAX_SEGMENTS];
+    size_t segmentCount;
+
+    uint32_t refCount;  // loads in progress
+    bool cached;        // still reachable from the cache
+    uint64_t lastUse;
+    ExecImage* next;
+};
+
+// Executables, keyed by filesystem and inode like the PageCache. The cache
+// holds one reference on every frame of an image; processes take their own
+// on the read-only ones, so evicting an image never pulls pages from under
+// a running program.
+class ExecCache {
+public:
+    ExecCache() : images(nullptr), count(0), clock(0), hits(0), misses(0) {}
+
+    static ExecCache& get();
+
+    // The image of the ELF at path, read and decoded on the first call.
+    // nullptr if the file is not an ELF the cache can hold, the caller then
+    // loads it the slow way. Every image returned is given back to release().
+    ExecImage* acquire(const char* path);
+    void release(ExecImage* image);
+
+    // Drops the image of a file whose contents changed.
+    void evict(FileSystem* fs, uint64_t inode);
+
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+
+private:
+    static constexpr size_t MAX_IMAGES = 16;
+
+    ExecImage* images;
+    size_t count;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    Spinlock lock;
+
+    ExecImage* lookup(FileSystem* fs, uint64_t inode);
+    // Unlinks the least recently used image nobody is loading.
+    ExecImage* takeVictim();
+    static ExecImage* decode(const void* data, size_t size);
+    static void destroy(ExecImage* image);
+};
@@ -1,5 +1,6 @@
 #include "fat32.hpp"
 #include <cpu/mm/heap.hpp>
+#include <fs/vfs/pagecache.hpp>
 
 FAT32FS::FAT32FS(BlockDevice* device) : FileSystem("fat32"), device(device), rootNode(nullptr), fatStart(0), dataStart(0), clusterSize(0), rootDirCluster(0) {
     ops.open = nodeOpen;
@@ -13,6 +14,7 @@ FAT32FS::FAT32FS(BlockDevice* device) : FileSystem("fat32"), device(device), roo
     ops.mkdir = nodeMkdir;
     ops.unlink = nodeUnlink;
     ops.rmdir = nodeRmdir;
+    ops.getPage = PageCache::readPage;
 }
 
 FAT32FS::~FAT32FS() {
@@ -1,4 +1,7 @@
 #include "initrd.hpp"
+#include <fs/vfs/pagecache.hpp>
+#include <cpu/mm/pmm.hpp>
+#include <x86_64/requests.hpp>
 #include <string.h>
 
 constexpr uint32_t INITRD_MAGIC = 0x44524E49;
@@ -22,6 +25,7 @@ InitrdFS::InitrdFS(void* data, size_t size) : FileSystem("initrd"), data(data),
     ops.mkdir = nullptr;
     ops.unlink = nullptr;
     ops.rmdir = nullptr;
+    ops.getPage = nodeGetPage;
 }
 
 InitrdFS::~InitrdFS() {
@@ -79,6 +83,32 @@ int64_t InitrdFS::nodeRead(VNode* node, void* buffer, uint64_t size, uint64_t of
     return toRead;
 }
 
+int InitrdFS::nodeGetPage(VNode* node, uint64_t offset, uint64_t* phys, bool* missed) {
+    if (!node || !phys) return -1;
+    
+    InitrdFS* fs = static_cast<InitrdFS*>(node->getFS());
+    if (!fs || !fs->header) return -1;
+    
+    uint64_t inode = node->getInode();
+    if (inode == 0 || inode > fs->header->fileCount) return -1;
+    
+    InitrdFile* file = &fs->header->files[inode - 1];
+    uint64_t paddedSize = (file->size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    // Page-aligned, zero-padded files are mapped straight out of the image.
+    // Older images fall back to a copy in the page cache.
+    if ((file->offset & (PAGE_SIZE - 1)) || file->offset + paddedSize > fs->dataSize) {
+        return PageCache::readPage(node, offset, phys, missed);
+    }
+    
+    if (offset >= paddedSize) return -1;
+    
+    uint64_t virt = reinterpret_cast<uint64_t>(fs->data) + file->offset + offset;
+    *phys = virt - hhdm_request.response->offset;
+    *missed = false;
+    return 0;
+}
+
 int64_t InitrdFS::nodeWrite(VNode* node, const void* buffer, uint64_t size, uint64_t offset) {
     return -1;
 }
@@ -23,6 +23,7 @@ public:
     int mount(const char* path) override;
     int unmount() override;
     VNode* getRoot() override;
+    bool isReadOnly() override { return true; }
     
     static int nodeOpen(VNode* node, int flags);
     static int nodeClose(VNode* node);
@@ -31,6 +32,7 @@ public:
     static int nodeStat(VNode* node, FileStats* stats);
     static int nodeReaddir(VNode* node, DirEntry* entries, uint64_t count, uint64_t* read);
     static VNode* nodeLookup(VNode* node, const char* name);
+    static int nodeGetPage(VNode* node, uint64_t offset, uint64_t* phys, bool* missed);
     
 private:
     void* data;
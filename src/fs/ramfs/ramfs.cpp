@@ -1,5 +1,6 @@
 #include "ramfs.hpp"
 #include <cpu/mm/heap.hpp>
+#include <fs/vfs/pagecache.hpp>
 
 RamFS::RamFS() : FileSystem("ramfs"), rootNode(nullptr), rootData(nullptr), nextInode(1) {
     ops.open = nodeOpen;
@@ -13,6 +14,7 @@ RamFS::RamFS() : FileSystem("ramfs"), rootNode(nullptr), rootData(nullptr), next
     ops.mkdir = nodeMkdir;
     ops.unlink = nodeUnlink;
     ops.rmdir = nodeRmdir;
+    ops.getPage = PageCache::readPage;
 }
 
 RamFS::~RamFS() {
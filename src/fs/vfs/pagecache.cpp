@@ -0,0 +1,127 @@
+#include "pagecache.hpp"
+#include <cpu/mm/pmm.hpp>
+#include <x86_64/requests.hpp>
+#include <string.h>
+
+PageCache pageCacheInstance;
+
+PageCache& PageCache::get() {
+    return pageCacheInstance;
+}
+
+size_t PageCache::hash(FileSystem* fs, uint64_t inode, uint64_t index) {
+    uint64_t key = reinterpret_cast<uint64_t>(fs) ^ (inode * 0x9E3779B97F4A7C15ULL) ^ (index * 0xC2B2AE3D27D4EB4FULL);
+    key ^= key >> 29;
+    return key % BUCKET_COUNT;
+}
+
+PageCache::Entry* PageCache::lookup(FileSystem* fs, uint64_t inode, uint64_t index) {
+    Entry* entry = buckets[hash(fs, inode, index)];
+    while (entry) {
+        if (entry->fs == fs && entry->inode == inode && entry->index == index) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return nullptr;
+}
+
+int PageCache::readPage(VNode* node, uint64_t offset, uint64_t* phys, bool* missed) {
+    if (!node || !phys || !node->ops || !node->ops->read) return -1;
+    *missed = false;
+    
+    PageCache& cache = get();
+    uint64_t index = offset / PAGE_SIZE;
+    
+    cache.lock.lock();
+    Entry* entry = cache.lookup(node->getFS(), node->getInode(), index);
+    if (entry) {
+        *phys = entry->frame;
+        pmm.retain(reinterpret_cast<void*>(entry->frame));
+        cache.lock.unlock();
+        return 0;
+    }
+    cache.lock.unlock();
+    
+    // The read runs unlocked, another CPU may fill the same page meanwhile.
+    void* frame = pmm.allocatePage();
+    if (!frame) return -1;
+    *missed = true;
+    
+    uint8_t* data = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(frame) + hhdm_request.response->offset);
+    memset(data, 0, PAGE_SIZE);
+    
+    if (node->ops->read(node, data, PAGE_SIZE, index * PAGE_SIZE) < 0) {
+        pmm.freePage(frame);
+        return -1;
+    }
+    
+    entry = new Entry;
+    if (!entry) {
+        pmm.freePage(frame);
+        return -1;
+    }
+    
+    // The cache keeps the allocation reference, the caller gets another.
+    entry->fs = node->getFS();
+    entry->inode = node->getInode();
+    entry->index = index;
+    entry->frame = reinterpret_cast<uint64_t>(frame);
+    
+    cache.lock.lock();
+    Entry* raced = cache.lookup(entry->fs, entry->inode, index);
+    if (raced) {
+        *phys = raced->frame;
+        pmm.retain(reinterpret_cast<void*>(raced->frame));
+        cache.lock.unlock();
+        delete entry;
+        pmm.freePage(frame);
+        return 0;
+    }
+    
+    cache.misses++;
+    size_t bucket = hash(entry->fs, entry->inode, index);
+    entry->next = cache.buckets[bucket];
+    cache.buckets[bucket] = entry;
+    *phys = entry->frame;
+    pmm.retain(frame);
+    cache.lock.unlock();
+    return 0;
+}
+
+void PageCache::update(VNode* node, const void* buffer, uint64_t size, uint64_t offset) {
+    if (!node || !buffer || size == 0) return;
+    
+    const uint8_t* src = static_cast<const uint8_t*>(buffer);
+    uint64_t end = offset + size;
+    LockGuard guard(lock);
+    
+    for (uint64_t index = offset / PAGE_SIZE; index * PAGE_SIZE < end; index++) {
+        Entry* entry = lookup(node->getFS(), node->getInode(), index);
+        if (!entry) continue;
+        
+        uint64_t pageStart = index * PAGE_SIZE;
+        uint64_t from = offset > pageStart ? offset : pageStart;
+        uint64_t to = end < pageStart + PAGE_SIZE ? end : pageStart + PAGE_SIZE;
+        
+        uint8_t* data = reinterpret_cast<uint8_t*>(entry->frame + hhdm_request.response->offset);
+        memcpy(data + (from - pageStart), src + (from - offset), to - from);
+    }
+}
+
+void PageCache::evict(FileSystem* fs, uint64_t inode) {
+    LockGuard guard(lock);
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        Entry** link = &buckets[i];
+        while (*link) {
+            Entry* entry = *link;
+            if (entry->fs == fs && entry->inode == inode) {
+                *link = entry->next;
+                pmm.release(reinterpret_cast<void*>(entry->frame));
+                delete entry;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "vfs.hpp"
+#include <cpu/smp/spinlock.hpp>
+#include <cstdint>
+#include <cstddef>
+
+// Page-sized copies of file contents shared by every mapping of a file.
+// Entries are keyed by filesystem and inode because filesystems hand out a
+// fresh VNode for each lookup of the same file.
+class PageCache {
+public:
+    PageCache() : buckets{}, misses(0) {}
+    
+    static PageCache& get();
+    
+    // Generic VNodeOps::getPage for filesystems that can only read().
+    static int readPage(VNode* node, uint64_t offset, uint64_t* phys, bool* missed);
+    
+    void update(VNode* node, const void* buffer, uint64_t size, uint64_t offset);
+    void evict(FileSystem* fs, uint64_t inode);
+    
+    // Pages that had to be read from the filesystem.
+    uint64_t getMisses() const { return misses; }
+    
+private:
+    struct Entry {
+        FileSystem* fs;
+        uint64_t inode;
+        uint64_t index;
+        uint64_t frame;
+        Entry* next;
+    };
+    
+    static constexpr size_t BUCKET_COUNT = 1024;
+    Entry* buckets[BUCKET_COUNT];
+    uint64_t misses;
+    Spinlock lock;
+    
+    static size_t hash(FileSystem* fs, uint64_t inode, uint64_t index);
+    Entry* lookup(FileSystem* fs, uint64_t inode, uint64_t index);
+};
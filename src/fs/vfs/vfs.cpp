@@ -1,4 +1,6 @@
 #include "vfs.hpp"
+#include "pagecache.hpp"
+#include <fs/elf/execcache.hpp>
 #include <cpu/mm/heap.hpp>
 
 VFS vfsInstance;
@@ -31,7 +33,7 @@ FileSystem::~FileSystem() {
 }
 
 FileDescriptor::FileDescriptor(VNode* node, int flags) 
-    : node(node), flags(flags), offset(0) {
+    : node(node), flags(flags), offset(0), refs(1) {
     if (node) {
         node->refCount++;
     }
@@ -49,6 +51,8 @@ FileDescriptor::~FileDescriptor() {
 int VFS::mount(FileSystem* fs, const char* path) {
     if (!initialized || !fs) return -1;
     
+    LockGuard guard(lock);
+    
     if (path[0] == '/' && path[1] == '\0') {
         rootFS = fs;
         return fs->mount(path);
@@ -73,6 +77,8 @@ int VFS::mount(FileSystem* fs, const char* path) {
 int VFS::unmount(const char* path) {
     if (!initialized || !rootFS) return -1;
     
+    LockGuard guard(lock);
+    
     if (path[0] == '/' && path[1] == '\0') {
         int result = rootFS->unmount();
         if (result == 0) {
@@ -238,6 +244,8 @@ VNode* VFS::resolvePath(const char* path, char* lastComponent) {
 int VFS::open(const char* path, int flags, FileDescriptor** fd) {
     if (!initialized || !fd) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = resolvePath(path, nullptr);
     if (!node) return -1;
     
@@ -253,6 +261,8 @@ int VFS::open(const char* path, int flags, FileDescriptor** fd) {
 int VFS::close(FileDescriptor* fd) {
     if (!initialized || !fd) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = fd->getNode();
     if (node && node->ops && node->ops->close) {
         node->ops->close(node);
@@ -265,6 +275,8 @@ int VFS::close(FileDescriptor* fd) {
 int64_t VFS::read(FileDescriptor* fd, void* buffer, uint64_t size) {
     if (!initialized || !fd || !buffer) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = fd->getNode();
     if (!node || !node->ops || !node->ops->read) return -1;
     
@@ -279,11 +291,15 @@ int64_t VFS::read(FileDescriptor* fd, void* buffer, uint64_t size) {
 int64_t VFS::write(FileDescriptor* fd, const void* buffer, uint64_t size) {
     if (!initialized || !fd || !buffer) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = fd->getNode();
     if (!node || !node->ops || !node->ops->write) return -1;
     
     int64_t result = node->ops->write(node, buffer, size, fd->getOffset());
     if (result > 0) {
+        PageCache::get().update(node, buffer, result, fd->getOffset());
+        ExecCache::get().evict(node->getFS(), node->getInode());
         fd->setOffset(fd->getOffset() + result);
     }
     
@@ -293,6 +309,8 @@ int64_t VFS::write(FileDescriptor* fd, const void* buffer, uint64_t size) {
 int64_t VFS::seek(FileDescriptor* fd, int64_t offset, SeekMode mode) {
     if (!initialized || !fd) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = fd->getNode();
     if (!node) return -1;
     
@@ -328,6 +346,8 @@ int64_t VFS::seek(FileDescriptor* fd, int64_t offset, SeekMode mode) {
 int VFS::stat(const char* path, FileStats* stats) {
     if (!initialized || !stats) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = resolvePath(path, nullptr);
     if (!node) return -1;
     
@@ -339,6 +359,8 @@ int VFS::stat(const char* path, FileStats* stats) {
 int VFS::readdir(const char* path, DirEntry* entries, uint64_t count, uint64_t* read) {
     if (!initialized || !entries || !read) return -1;
     
+    LockGuard guard(lock);
+    
     VNode* node = resolvePath(path, nullptr);
     if (!node) return -1;
     
@@ -352,6 +374,8 @@ int VFS::readdir(const char* path, DirEntry* entries, uint64_t count, uint64_t*
 int VFS::create(const char* path, uint32_t mode) {
     if (!initialized) return -1;
     
+    LockGuard guard(lock);
+    
     char parent[256];
     char name[256];
     splitPath(path, parent, name);
@@ -368,6 +392,8 @@ int VFS::create(const char* path, uint32_t mode) {
 int VFS::mkdir(const char* path, uint32_t mode) {
     if (!initialized) return -1;
     
+    LockGuard guard(lock);
+    
     char parent[256];
     char name[256];
     splitPath(path, parent, name);
@@ -384,6 +410,8 @@ int VFS::mkdir(const char* path, uint32_t mode) {
 int VFS::unlink(const char* path) {
     if (!initialized) return -1;
     
+    LockGuard guard(lock);
+    
     char parent[256];
     char name[256];
     splitPath(path, parent, name);
@@ -393,12 +421,22 @@ int VFS::unlink(const char* path) {
     
     if (!parentNode->ops || !parentNode->ops->unlink) return -1;
     
-    return parentNode->ops->unlink(parentNode, name);
+    VNode* victim = parentNode->ops->lookup ? parentNode->ops->lookup(parentNode, name) : nullptr;
+    
+    int result = parentNode->ops->unlink(parentNode, name);
+    if (result == 0 && victim) {
+        PageCache::get().evict(victim->getFS(), victim->getInode());
+        ExecCache::get().evict(victim->getFS(), victim->getInode());
+    }
+    
+    return result;
 }
 
 int VFS::rmdir(const char* path) {
     if (!initialized) return -1;
     
+    LockGuard guard(lock);
+    
     char parent[256];
     char name[256];
     splitPath(path, parent, name);
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cpu/smp/spinlock.hpp>
 
 enum class FileType {
     Regular,
@@ -13,6 +14,12 @@ enum class FileType {
     Socket
 };
 
+// Access mode in the low bits of the open flags.
+constexpr int O_RDONLY = 0x0;
+constexpr int O_WRONLY = 0x1;
+constexpr int O_RDWR = 0x2;
+constexpr int O_ACCMODE = 0x3;
+
 enum class SeekMode {
     Set,
     Current,
@@ -51,6 +58,11 @@ struct VNodeOps {
     int (*mkdir)(VNode* parent, const char* name, uint32_t mode, VNode** result);
     int (*unlink)(VNode* parent, const char* name);
     int (*rmdir)(VNode* parent, const char* name);
+    // Supplies the physical frame holding the page at a page-aligned offset,
+    // with a reference the caller drops with pmm.release() or keeps for its
+    // mapping. The frame may be evicted the moment the call returns.
+    // missed is set if the contents had to be read from the filesystem.
+    int (*getPage)(VNode* node, uint64_t offset, uint64_t* phys, bool* missed);
 };
 
 class VNode {
@@ -82,6 +94,7 @@ public:
     virtual int mount(const char* path) = 0;
     virtual int unmount() = 0;
     virtual VNode* getRoot() = 0;
+    virtual bool isReadOnly() { return false; }
     
     const char* getName() { return name; }
     
@@ -96,13 +109,20 @@ public:
     
     VNode* getNode() { return node; }
     int getFlags() { return flags; }
+    bool isWritable() { return (flags & O_ACCMODE) != O_RDONLY; }
     uint64_t getOffset() { return offset; }
     void setOffset(uint64_t off) { offset = off; }
     
+    // The file table holds one reference, each thread using the descriptor
+    // another. Whoever drops the last closes it.
+    void hold() { __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED); }
+    bool drop() { return __atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0; }
+    
 private:
     VNode* node;
     int flags;
     uint64_t offset;
+    uint32_t refs;
 };
 
 struct MountPoint {
@@ -142,5 +162,6 @@ private:
     
     FileSystem* rootFS;
     MountPoint* mountPoints;
+    Spinlock lock;
     bool initialized;
 };
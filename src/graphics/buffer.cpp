@@ -1,11 +1,23 @@
 #include "buffer.hpp"
+#include <cpu/mm/vmm.hpp>
+#include <cpu/mm/layout.hpp>
+#include <x86_64/requests.hpp>
 #include <string.h>
 
 Buffer::Buffer(limine_framebuffer* fb) {
     address = reinterpret_cast<uint32_t*>(fb->address);
+    physical = reinterpret_cast<uint64_t>(fb->address) - hhdm_request.response->offset;
     width = fb->width;
     height = fb->height;
     pitch = fb->pitch / 4;
+
+    // The HHDM view is uncached; use a write-combining alias so pixel stores
+    // are merged into bursts instead of going out one by one.
+    size_t pages = (getSize() + PAGE_SIZE - 1) / PAGE_SIZE;
+    void* virt = reinterpret_cast<void*>(FRAMEBUFFER_BASE);
+    if (vmm.mapRange(virt, reinterpret_cast<void*>(physical), pages, PTE_PRESENT | PTE_WRITABLE | PTE_WRITE_COMBINING)) {
+        address = reinterpret_cast<uint32_t*>(virt);
+    }
 }
 
 Buffer::~Buffer() {
@@ -37,6 +49,14 @@ uint64_t Buffer::getPitch(){
     return pitch;
 }
 
+uint64_t Buffer::getPhysical() {
+    return physical;
+}
+
+uint64_t Buffer::getSize() {
+    return pitch * 4 * height;
+}
+
 Color Buffer::getPixel(uint64_t x, uint64_t y) {
     if (x >= width || y >= height) return Color{0, 0, 0};
     uint64_t pixelColor = address[y * pitch + x];
@@ -16,9 +16,12 @@ class Buffer {
         Color getPixel(uint64_t x, uint64_t y);
         void* getRaw();
         uint64_t getPitch();
+        uint64_t getPhysical();
+        uint64_t getSize();
     
     private:
         uint32_t* address;
+        uint64_t physical;
         uint64_t width;
         uint64_t height;
         uint64_t pitch;
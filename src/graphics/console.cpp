@@ -255,7 +255,10 @@ void Console::handleAnsiChar(char c) {
                 if (c == '\n') {
                     newLine();
                 } else if (c == '\t') {
-                    drawText("    ");
+                    for (int i = 0; i < 4; i++) {
+                        drawChar(' ');
+                        advance();
+                    }
                 } else if (c == '\r') {
                     posX = 0;
                 } else if (c == '\b') {
@@ -463,6 +466,7 @@ void Console::scroll(){
 }
 
 void Console::drawText(const char* str){
+    LockGuard guard(lock);
     Cereal::get().write(str);
     while (*str) {
         handleAnsiChar(*str);
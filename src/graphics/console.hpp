@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <tuple>
 #include "framebuffer.hpp"
+#include <cpu/smp/spinlock.hpp>
 
 class Console {
 private:
@@ -48,6 +49,8 @@ private:
     bool italic;
     bool underline;
     
+    Spinlock lock;
+    
     void toString(char* ptr, int64_t num, int radix);
     void toString(char* ptr, uint64_t num, int radix);
     void drawChar(const char c);
@@ -43,4 +43,12 @@ void* Framebuffer::getRaw(){
 
 uint64_t Framebuffer::getPitch(){
     return buffer->getPitch();
+}
+
+uint64_t Framebuffer::getPhysical(){
+    return buffer->getPhysical();
+}
+
+uint64_t Framebuffer::getSize(){
+    return buffer->getSize();
 }
\ No newline at end of file
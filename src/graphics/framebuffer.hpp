@@ -16,6 +16,8 @@ class Framebuffer {
         Color getPixel(uint64_t x, uint64_t y);
         void* getRaw();
         uint64_t getPitch();
+        uint64_t getPhysical();
+        uint64_t getSize();
 
     private:
         Buffer* buffer;
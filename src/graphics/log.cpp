@@ -0,0 +1,96 @@
+#include "log.hpp"
+#include "console.hpp"
+#include <cpu/cereal/cereal.hpp>
+#include <string.h>
+
+extern Console* console;
+
+KernelLog& KernelLog::get() {
+    static KernelLog instance;
+    return instance;
+}
+
+void KernelLog::write(const char* str) {
+    size_t length = strlen(str);
+    if (!length) return;
+
+    lock.lock();
+    if (length > BUFFER_SIZE - (head - tail)) {
+        dropped++;
+        lock.unlock();
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        buffer[(head + i) % BUFFER_SIZE] = str[i];
+    }
+    head += length;
+    lock.unlock();
+
+    WorkQueue::get().queue(&work);
+}
+
+// The console is only drawn on outside the lock, writers never wait for it.
+// Text written while another worker drains is left to that one, which looks
+// again after letting go.
+void KernelLog::drain(Work*) {
+    KernelLog& log = get();
+    char chunk[CHUNK_SIZE + 1];
+
+    if (__atomic_test_and_set(&log.draining, __ATOMIC_SEQ_CST)) return;
+
+    for (;;) {
+        log.lock.lock();
+        size_t length = log.head - log.tail;
+        if (length > CHUNK_SIZE) length = CHUNK_SIZE;
+        for (size_t i = 0; i < length; i++) {
+            chunk[i] = log.buffer[(log.tail + i) % BUFFER_SIZE];
+        }
+        log.tail += length;
+        log.lock.unlock();
+
+        if (!length) {
+            __atomic_clear(&log.draining, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&log.head, __ATOMIC_SEQ_CST) == __atomic_load_n(&log.tail, __ATOMIC_SEQ_CST)) return;
+            if (__atomic_test_and_set(&log.draining, __ATOMIC_SEQ_CST)) return;
+            continue;
+        }
+        chunk[length] = '\0';
+
+        if (console) {
+            console->drawText(chunk);
+        } else {
+            Cereal::get().write(chunk);
+        }
+    }
+}
+
+LogLine& LogLine::text(const char* str) {
+    while (*str && length < LINE_SIZE - 1) {
+        buffer[length++] = *str++;
+    }
+    buffer[length] = '\0';
+    return *this;
+}
+
+LogLine& LogLine::number(uint64_t value) {
+    return digits(value, 10);
+}
+
+LogLine& LogLine::hex(uint64_t value) {
+    return digits(value, 16);
+}
+
+LogLine& LogLine::digits(uint64_t value, int radix) {
+    char reversed[20];
+    int count = 0;
+    do {
+        reversed[count++] = "0123456789abcdef"[value % radix];
+        value /= radix;
+    } while (value);
+
+    while (count && length < LINE_SIZE - 1) {
+        buffer[length++] = reversed[--count];
+    }
+    buffer[length] = '\0';
+    return *this;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cpu/smp/spinlock.hpp>
+#include <cpu/process/workqueue.hpp>
+#include <cstdint>
+#include <cstddef>
+
+// Diagnostics that must not stall the caller. Text is copied into a ring
+// and drawn on the console later by a worker; what does not fit is dropped
+// and counted. Before the workqueue runs, text waits for the first message
+// written afterwards.
+class KernelLog {
+public:
+    static KernelLog& get();
+
+    // Either all of str goes in or none of it.
+    void write(const char* str);
+
+    uint64_t getDropped() const { return dropped; }
+
+private:
+    KernelLog() : head(0), tail(0), dropped(0), draining(false), work{drain, nullptr, nullptr, false} {}
+
+    static constexpr size_t BUFFER_SIZE = 16384;
+    static constexpr size_t CHUNK_SIZE = 256;
+
+    char buffer[BUFFER_SIZE];
+    size_t head;     // total bytes written
+    size_t tail;     // total bytes drawn
+    uint64_t dropped;
+    bool draining;   // keeps a second worker from drawing out of order
+    Spinlock lock;
+    Work work;
+
+    static void drain(Work* work);
+};
+
+// One line built on the stack, so it reaches the log in one piece.
+class LogLine {
+public:
+    LogLine() : length(0) { buffer[0] = '\0'; }
+
+    LogLine& text(const char* str);
+    LogLine& number(uint64_t value);
+    LogLine& hex(uint64_t value);
+
+    void commit() { KernelLog::get().write(buffer); }
+
+private:
+    static constexpr size_t LINE_SIZE = 128;
+
+    char buffer[LINE_SIZE];
+    size_t length;
+
+    LogLine& digits(uint64_t value, int radix);
+};
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <array>
 #include <cpu/idt/interrupt.hpp>
+#include <cpu/process/waitqueue.hpp>
 #include <x86_64/ports.hpp>
 
 class Keyboard : public Interrupt {
@@ -117,11 +118,14 @@ public:
                     }
                     
                     if (c != 0) {
+                        bufferLock.lock();
                         int nextHead = (bufferHead + 1) % BUFFER_SIZE;
                         if (nextHead != bufferTail) {
                             buffer[bufferHead] = c;
                             bufferHead = nextHead;
                         }
+                        bufferLock.unlock();
+                        readers.wakeAll();
                     }
                 }
             }
@@ -130,15 +134,21 @@ public:
         sendEOI();
     }
     
-    bool hasKey() { return bufferHead != bufferTail; }
+    bool hasKey() { return __atomic_load_n(&bufferHead, __ATOMIC_ACQUIRE) != bufferTail; }
     
     char getKey() {
+        LockGuard guard(bufferLock);
         if (!hasKey()) return 0;
     
         char c = buffer[bufferTail];
         bufferTail = (bufferTail + 1) % BUFFER_SIZE;
         return c;
     }
+    
+    // Blocks until a key is buffered. Returns false if a signal came first.
+    bool waitForKey() {
+        return readers.waitUntil([this] { return hasKey(); });
+    }
 
     char poll() {
         uint8_t status = inb(0x64);
@@ -190,6 +200,8 @@ private:
     char buffer[BUFFER_SIZE];
     int bufferHead = 0;
     int bufferTail = 0;
+    Spinlock bufferLock;
+    WaitQueue readers;
     
     bool shiftPressed;
     bool ctrlPressed;
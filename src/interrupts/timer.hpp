@@ -3,67 +3,139 @@
 #include <cpu/idt/interrupt.hpp>
 #include <cpu/process/scheduler.hpp>
 #include <cpu/apic/irqs.hpp>
+#include <cpu/mm/collapse.hpp>
 #include <graphics/console.hpp>
+#include <x86_64/ports.hpp>
 
 extern Console* console;
 
+// One-shot per-CPU timer. Nothing ticks periodically: the scheduler arms
+// it for the end of the current slice and stops it while the CPU idles.
+// Time is read from the TSC, which is assumed invariant and in sync
+// across CPUs.
 class Timer : public Interrupt {
 public:
     void initialize() override {
+        uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        tscDeadline = ecx & (1 << 24);
+
+        calibrate();
+        tscBase = rdtsc();
+
+        start();
+    }
+
+    // Application processors reuse the rates calibrated on the BSP.
+    void start() {
         LAPIC& lapic = LAPIC::get();
-        
         lapic.setTimerDivide(0x03);
-        
-        lapic.write(0x320, 0x10000);
-        lapic.write(0x380, 0xFFFFFFFF);
-                
-        for (int i = 0; i < 10000000; i++) {
-            asm volatile("pause");
+        lapic.write(LAPIC_TIMER, VECTOR_TIMER | (tscDeadline ? LAPIC_TIMER_TSC_DEADLINE : 0));
+        // Orders the LVT write before the first deadline MSR write.
+        asm volatile("mfence" ::: "memory");
+    }
+
+    // Fires once at deadline (ns since boot), replacing any earlier arming
+    // on this CPU.
+    void arm(uint64_t deadline) {
+        if (tscDeadline) {
+            wrmsr(MSR_TSC_DEADLINE, tscBase + nsToTSC(deadline));
+            return;
         }
 
-        uint32_t ticks = lapic.read(0x390);
-        uint32_t elapsed = 0xFFFFFFFF - ticks;
+        uint64_t current = now();
+        uint64_t delta = deadline > current ? deadline - current : 0;
+        uint64_t count = delta * lapicPerMs / 1000000;
+        if (count == 0) count = 1;
+        if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+        LAPIC::get().write(LAPIC_TIMER_INITCNT, static_cast<uint32_t>(count));
+    }
 
-        if (elapsed == 0) {
-            tpus = 1000;
+    void stop() {
+        if (tscDeadline) {
+            wrmsr(MSR_TSC_DEADLINE, 0);
         } else {
-            tpus = elapsed / 100000;
-            if (tpus == 0) {
-                tpus = 1;
-            }
+            LAPIC::get().write(LAPIC_TIMER_INITCNT, 0);
         }
-
-        uint32_t count = tpus * 10000;
-
-        lapic.write(0x380, count);
-        lapic.write(0x320, VECTOR_TIMER | 0x20000);
     }
-    
+
     void Run(InterruptFrame* frame) override {
         this->sendEOI();
-        tick++;
-        milliseconds++;
-        
-        if(tick % 10 == 0){
-            Scheduler::get().schedule(frame);
+
+        // Pick the interrupted process for huge page collapsing. Kernel
+        // tasks have nothing to collapse.
+        CPUData* cpu = thisCPU();
+        uint64_t current = now();
+        if (current - cpu->lastCollapse >= HUGE_COLLAPSE_INTERVAL_NS && frame->cs == 0x1B) {
+            cpu->lastCollapse = current;
+            Process* process = Scheduler::get().getCurrentProcess();
+            if (process) HugePageCollapser::get().request(cpu->id, process->getPID());
         }
+
+        Scheduler::get().tick();
     }
-    
+
     static Timer& get() {
         static Timer instance;
         return instance;
     }
-    
+
+    // ns since the timer was initialized.
+    uint64_t now() const {
+        if (!tscPerMs) return 0;
+        uint64_t delta = rdtsc() - tscBase;
+        return delta / tscPerMs * 1000000 + (delta % tscPerMs) * 1000000 / tscPerMs;
+    }
+
     uint64_t getMilliseconds() const {
-        return milliseconds;
+        return now() / 1000000;
     }
-    
+
     uint64_t getTicks() const {
-        return tick;
+        return now() / TICK_NS;
     }
 
 private:
-    uint32_t tpus;
-    uint64_t tick = 0;
-    uint64_t milliseconds = 0;
-};
\ No newline at end of file
+    static constexpr uint64_t HUGE_COLLAPSE_INTERVAL_NS = 1000000000;
+    static constexpr uint32_t PIT_FREQUENCY = 1193182;
+    static constexpr uint32_t CALIBRATION_MS = 10;
+
+    bool tscDeadline = false;
+    uint64_t tscBase = 0;
+    uint64_t tscPerMs = 0;
+    uint64_t lapicPerMs = 0;
+
+    uint64_t nsToTSC(uint64_t ns) const {
+        return ns / 1000000 * tscPerMs + (ns % 1000000) * tscPerMs / 1000000;
+    }
+
+    // Counts the TSC and the LAPIC timer against PIT channel 2, which is
+    // polled through port 0x61 and needs no interrupt.
+    void calibrate() {
+        LAPIC& lapic = LAPIC::get();
+        lapic.setTimerDivide(0x03);
+        lapic.write(LAPIC_TIMER, LAPIC_TIMER_MASKED);
+
+        uint16_t latch = PIT_FREQUENCY / (1000 / CALIBRATION_MS);
+        outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+        outb(0x43, 0xB0);
+        outb(0x42, latch & 0xFF);
+        outb(0x42, latch >> 8);
+
+        lapic.write(LAPIC_TIMER_INITCNT, 0xFFFFFFFF);
+        uint64_t tscStart = rdtsc();
+
+        while (!(inb(0x61) & 0x20)) {
+            asm volatile("pause");
+        }
+
+        uint64_t tscEnd = rdtsc();
+        uint32_t lapicElapsed = 0xFFFFFFFF - lapic.read(LAPIC_TIMER_CURCNT);
+        lapic.write(LAPIC_TIMER_INITCNT, 0);
+
+        tscPerMs = (tscEnd - tscStart) / CALIBRATION_MS;
+        lapicPerMs = lapicElapsed / CALIBRATION_MS;
+        if (tscPerMs == 0) tscPerMs = 1;
+        if (lapicPerMs == 0) lapicPerMs = 1;
+    }
+};
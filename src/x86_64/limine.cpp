@@ -8,6 +8,11 @@
 #include <cpu/apic/irqs.hpp>
 #include <cpu/pic.hpp>
 #include <cpu/process/scheduler.hpp>
+#include <cpu/process/workqueue.hpp>
+#include <cpu/process/stackpool.hpp>
+#include <cpu/smp/smp.hpp>
+#include <cpu/fpu/fpu.hpp>
+#include <cpu/idle/idle.hpp>
 #include <cpu/process/exec.hpp>
 #include <graphics/framebuffer.hpp>
 #include <graphics/console.hpp>
@@ -23,18 +28,19 @@
 Framebuffer* fb = nullptr;
 Console* console = nullptr;
 GDT* gdt = nullptr;
+IDT* idt = nullptr;
 Keyboard* globalKeyboard = nullptr;
 Timer* globalTimer = nullptr;
 
 int main();
 
-extern "C" void enterUsermode(uint64_t entry, uint64_t stack);
 extern "C" void _kinit(){
     asm volatile("cli");
     
     static GDT _gdt;
     gdt = &_gdt;
     static IDT _idt;
+    idt = &_idt;
     
     MemoryManager mm;
 
@@ -55,6 +61,10 @@ extern "C" void _kinit(){
         console->drawText("APIC initialization failed.\n");
     }
     
+    SMP::get().initializeBSP(gdt);
+    FPU::get().initialize();
+    CPUIdle::get().initialize();
+    StackPool::get().initialize();
     Scheduler::get().initialize();
     
     globalTimer = new Timer();
@@ -84,8 +94,18 @@ extern "C" void _kinit(){
         console->drawText("RamFS mounted at /tmp\n");
     }
     
+    SMP::get().startAPs();
+    console->drawText("CPUs online: ");
+    console->drawNumber(SMP::get().getCPUCount());
+    console->drawText("\n");
+    
+    WorkQueue::get().initialize();
+    
     int returnCode = main();
 
-    for(;;);
+    // main() hands the CPU to the scheduler and never comes back.
+    for (;;) {
+        asm volatile("cli; hlt");
+    }
 
 }
\ No newline at end of file
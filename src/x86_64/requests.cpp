@@ -42,5 +42,13 @@ __attribute__((used, section(".limine_requests")))
         .response = nullptr
     };
 
+__attribute__((used, section(".limine_requests")))
+    volatile limine_mp_request mp_request = {
+        .id = LIMINE_MP_REQUEST_ID,
+        .revision = 0,
+        .response = nullptr,
+        .flags = 0
+    };
+
 __attribute__((used, section(".limine_requests_end")))
         volatile uint64_t limine_requests_end_marker[] = LIMINE_REQUESTS_END_MARKER;
\ No newline at end of file
@@ -7,4 +7,5 @@ extern limine_framebuffer_request framebuffer_request;
 extern limine_memmap_request memorymap_request;
 extern limine_hhdm_request hhdm_request;
 extern limine_rsdp_request rsdp_request;
-extern limine_module_request module_request;
\ No newline at end of file
+extern limine_module_request module_request;
+extern limine_mp_request mp_request;
\ No newline at end of file
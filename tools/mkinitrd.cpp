@@ -6,6 +6,12 @@
 #include <filesystem>
 
 constexpr uint32_t INITRD_MAGIC = 0x44524E49;
+constexpr uint64_t PAGE_SIZE = 4096;
+
+// File data is page aligned and zero padded so the kernel can map it in place
+static uint64_t alignToPage(uint64_t value) {
+    return (value + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
 
 struct InitrdFile {
     char name[64];
@@ -34,7 +40,7 @@ int main(int argc, char** argv) {
     std::vector<InitrdFile> files;
     std::vector<std::vector<uint8_t>> fileData;
     
-    uint64_t currentOffset = sizeof(InitrdHeader) + inputFiles.size() * sizeof(InitrdFile);
+    uint64_t currentOffset = alignToPage(sizeof(InitrdHeader) + inputFiles.size() * sizeof(InitrdFile));
     
     for (const auto& path : inputFiles) {
         std::ifstream file(path, std::ios::binary | std::ios::ate);
@@ -61,7 +67,7 @@ int main(int argc, char** argv) {
         files.push_back(fileEntry);
         fileData.push_back(data);
         
-        currentOffset += size;
+        currentOffset = alignToPage(currentOffset + size);
         
         std::cout << "Added: " << filename << " (" << size << " bytes)" << std::endl;
     }
@@ -82,10 +88,17 @@ int main(int argc, char** argv) {
         output.write(reinterpret_cast<const char*>(&file), sizeof(file));
     }
     
-    for (const auto& data : fileData) {
-        output.write(reinterpret_cast<const char*>(data.data()), data.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        uint64_t position = output.tellp();
+        std::vector<char> padding(files[i].offset - position, 0);
+        output.write(padding.data(), padding.size());
+        output.write(reinterpret_cast<const char*>(fileData[i].data()), fileData[i].size());
     }
     
+    uint64_t position = output.tellp();
+    std::vector<char> padding(alignToPage(position) - position, 0);
+    output.write(padding.data(), padding.size());
+    
     std::cout << "Created initrd: " << outputPath << std::endl;
     std::cout << "  Files: " << files.size() << std::endl;
     std::cout << "  Total size: " << currentOffset << " bytes" << std::endl;